@@ -0,0 +1,327 @@
+/*
+ * FotaProto.h
+ *
+ *  Codec of the bootloader command frames, shared by the bootloader (STM32),
+ *  the gateway (ESP32) and host builds (Linux). Header only, plain C99 so it
+ *  compiles unchanged as C and C++. tools/fotaproto.py is the Python mirror.
+ *
+ *  Trame (little endian) :
+ *      len u8 | cmd u8 | addr u32 | count u8 | data[count] | crc u32
+ *  len   : octets qui suivent le champ len
+ *  count : longueur de data, ou nombre de secteurs pour l'effacement
+ *  crc   : unite CRC du STM32 (0x04C11DB7, init 0xFFFFFFFF, un octet par mot
+ *          de 32 bits, sans xor final) sur cmd .. fin de data
+ */
+
+#ifndef FOTA_PROTO_H_
+#define FOTA_PROTO_H_
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__GNUC__)
+#define PROTO_UNUSED __attribute__((unused))
+#else
+#define PROTO_UNUSED
+#endif
+
+/* --- Commandes --- */
+#define PROTO_CMD_GET_VER        0x10
+#define PROTO_CMD_GET_HELP       0x11
+#define PROTO_CMD_GET_CID        0x12
+#define PROTO_CMD_GO_TO_ADDR     0x14
+#define PROTO_CMD_FLASH_ERASE    0x15
+#define PROTO_CMD_MEM_WRITE      0x16
+#define PROTO_CMD_MEM_WRITE_LZ   0x17
+#define PROTO_CMD_SET_APP_INFO   0x18
+#define PROTO_CMD_MEM_READ       0x19
+#define PROTO_CMD_SELECT         0x1A
+#define PROTO_CMD_GET_BITMAP     0x1B
+#define PROTO_CMD_DISCOVER       0x1C
+#define PROTO_CMD_SET_COMP_INFO  0x1D
+#define PROTO_CMD_GET_COMPONENTS 0x1E
+
+#define PROTO_CMD_FIRST          PROTO_CMD_GET_VER
+#define PROTO_CMD_LAST           PROTO_CMD_GET_COMPONENTS
+
+/* --- Octets de controle --- */
+#define PROTO_ACK                0xCD  /* Suivi de la longueur de la reponse */
+#define PROTO_NACK               0xAB
+#define PROTO_KNOCK              0xF0  /* Jamais une longueur de trame valide */
+
+/* --- Geometrie de trame --- */
+#define PROTO_MAX_FRAME          200   /* Tampon de reception du bootloader */
+#define PROTO_OFS_LEN            0
+#define PROTO_OFS_CMD            1
+#define PROTO_OFS_ADDR           2
+#define PROTO_OFS_COUNT          6
+#define PROTO_OFS_DATA           7
+#define PROTO_CRC_SIZE           4
+#define PROTO_OVERHEAD           (PROTO_OFS_DATA + PROTO_CRC_SIZE)
+#define PROTO_MIN_FRAME          (PROTO_OFS_CMD + 1 + PROTO_CRC_SIZE)
+#define PROTO_MAX_DATA           (PROTO_MAX_FRAME - PROTO_OVERHEAD)
+
+/*
+ * Lecture (PROTO_CMD_MEM_READ, data = longueur u32) : reponse ACK | 5 |
+ * statut | taille de l'application valide u32, puis la plage en blocs
+ * ACK | n | data[n] | crc u32 (n <= PROTO_READ_BLOCK), enchaines sans attente.
+ */
+#define PROTO_READ_BLOCK         248
+
+/*
+ * Bus multipoint (RS-485) : chaque bootloader a un identifiant de noeud
+ * (CRC de l'UID 96 bits). PROTO_CMD_SELECT, addr = identifiant : seul ce
+ * noeud repond ensuite, les autres ignorent les trames. addr =
+ * PROTO_NODE_BROADCAST, data = taille de bloc u32 : tous les noeuds
+ * effacent et ecrivent sans repondre, et notent chaque bloc recu dans un
+ * bitmap relu ensuite par PROTO_CMD_GET_BITMAP (addr = octet de depart,
+ * PROTO_BITMAP_PAGE octets au plus). PROTO_CMD_DISCOVER, addr = premier
+ * identifiant, data = dernier u32 : chaque noeud de la plage repond
+ * ACK | 8 | id u32 | crc(id) u32, deux reponses simultanees se detruisent.
+ * Tant qu'aucun SELECT n'a ete recu, le noeud repond a tout (point a point).
+ */
+#define PROTO_NODE_BROADCAST     0xFFFFFFFFU
+#define PROTO_BITMAP_PAGE        128
+
+/*
+ * Composants (manifeste FMF1, tools/fwmanifest.py) : regions Flash alignees
+ * sur les secteurs, mises a jour independamment. PROTO_CMD_SET_COMP_INFO,
+ * addr = debut de la region, data = id u32 | version u32 | taille u32 |
+ * SHA-256 de la region (relue en Flash, ordre d'ecriture libre) ; l'id 0 est
+ * l'application. PROTO_CMD_GET_COMPONENTS : ACK | n | un enregistrement
+ * id u8 | version u32 | addr u32 | taille u32 | hash u32 (4 premiers octets
+ * du SHA-256) par composant valide.
+ */
+#define PROTO_COMP_INFO_SIZE     17
+#define PROTO_MAX_COMPONENTS     7     /* Application comprise : 119 octets, une reponse */
+
+typedef enum {
+    PROTO_OK = 0,
+    PROTO_ERR_SIZE,
+    PROTO_ERR_CRC
+} Proto_Status;
+
+/* --- Table des commandes, indexee par (code - PROTO_CMD_FIRST) --- */
+#define PROTO_F_ADDR             0x01  /* Utilise le champ addr */
+#define PROTO_F_DATA             0x02  /* count = longueur de data */
+
+typedef struct {
+    uint8_t Code;                /* 0 : emplacement libre */
+    uint8_t Flags;
+    const char *Name;
+} Proto_Command;
+
+/*
+ * Une ligne par code de PROTO_CMD_FIRST a PROTO_CMD_LAST, dans l'ordre :
+ * CMD(nom, drapeaux) pour une commande, HOLE pour un code libre. La table et
+ * PROTO_COMMAND_COUNT en sont derives.
+ */
+#define PROTO_COMMAND_TABLE(CMD, HOLE)                   \
+    CMD(GET_VER,        0)                              \
+    CMD(GET_HELP,       0)                              \
+    CMD(GET_CID,        0)                              \
+    HOLE                                                \
+    CMD(GO_TO_ADDR,     PROTO_F_ADDR)                   \
+    CMD(FLASH_ERASE,    PROTO_F_ADDR)                   \
+    CMD(MEM_WRITE,      PROTO_F_ADDR | PROTO_F_DATA)    \
+    CMD(MEM_WRITE_LZ,   PROTO_F_ADDR | PROTO_F_DATA)    \
+    CMD(SET_APP_INFO,   PROTO_F_DATA)                   \
+    CMD(MEM_READ,       PROTO_F_ADDR | PROTO_F_DATA)    \
+    CMD(SELECT,         PROTO_F_ADDR | PROTO_F_DATA)    \
+    CMD(GET_BITMAP,     PROTO_F_ADDR)                   \
+    CMD(DISCOVER,       PROTO_F_ADDR | PROTO_F_DATA)    \
+    CMD(SET_COMP_INFO,  PROTO_F_ADDR | PROTO_F_DATA)    \
+    CMD(GET_COMPONENTS, 0)
+
+#define PROTO_ROW(Name, Flags)   { PROTO_CMD_##Name, (Flags), #Name },
+#define PROTO_NO_ROW             { 0, 0, 0 },
+#define PROTO_ONE(Name, Flags)   + 1
+
+#define PROTO_COMMAND_COUNT      (0 PROTO_COMMAND_TABLE(PROTO_ONE, ))
+#define PROTO_TABLE_ROWS         (0 PROTO_COMMAND_TABLE(PROTO_ONE, + 1))
+
+#if defined(__cplusplus)
+static_assert(PROTO_TABLE_ROWS == PROTO_CMD_LAST - PROTO_CMD_FIRST + 1, "PROTO_COMMAND_TABLE needs one row per code");
+#else
+_Static_assert(PROTO_TABLE_ROWS == PROTO_CMD_LAST - PROTO_CMD_FIRST + 1, "PROTO_COMMAND_TABLE needs one row per code");
+#endif
+
+static const Proto_Command Proto_Commands[PROTO_CMD_LAST - PROTO_CMD_FIRST + 1] PROTO_UNUSED = {
+    PROTO_COMMAND_TABLE(PROTO_ROW, PROTO_NO_ROW)
+};
+
+/* Entree de la commande, NULL si le code est inconnu */
+static inline const Proto_Command *Proto_Find(uint8_t Code)
+{
+    if ((Code < PROTO_CMD_FIRST) || (Code > PROTO_CMD_LAST) ||
+        (Proto_Commands[Code - PROTO_CMD_FIRST].Code == 0)) {
+        return 0;
+    }
+    return &Proto_Commands[Code - PROTO_CMD_FIRST];
+}
+
+#if defined(PROTO_CRC_HW)
+/* --- CRC : unite materielle de la cible (meme algorithme), fournie par le
+ *     build qui definit PROTO_CRC_HW ; pas de table ni de reprise de calcul --- */
+uint32_t Proto_Crc_Hw(const uint8_t *pData, uint32_t Len);
+
+static inline uint32_t Proto_Crc(const uint8_t *pData, uint32_t Len)
+{
+    return Proto_Crc_Hw(pData, Len);
+}
+
+#else
+/* --- CRC : une recherche de table par octet du registre (4 par octet de
+ *     donnee) au lieu de 32 decalages. Table generee par
+ *     tools/fotaproto.py table --- */
+static const uint32_t Proto_Crc_Table[256] PROTO_UNUSED = {
+    0x00000000U, 0x04C11DB7U, 0x09823B6EU, 0x0D4326D9U, 0x130476DCU, 0x17C56B6BU,
+    0x1A864DB2U, 0x1E475005U, 0x2608EDB8U, 0x22C9F00FU, 0x2F8AD6D6U, 0x2B4BCB61U,
+    0x350C9B64U, 0x31CD86D3U, 0x3C8EA00AU, 0x384FBDBDU, 0x4C11DB70U, 0x48D0C6C7U,
+    0x4593E01EU, 0x4152FDA9U, 0x5F15ADACU, 0x5BD4B01BU, 0x569796C2U, 0x52568B75U,
+    0x6A1936C8U, 0x6ED82B7FU, 0x639B0DA6U, 0x675A1011U, 0x791D4014U, 0x7DDC5DA3U,
+    0x709F7B7AU, 0x745E66CDU, 0x9823B6E0U, 0x9CE2AB57U, 0x91A18D8EU, 0x95609039U,
+    0x8B27C03CU, 0x8FE6DD8BU, 0x82A5FB52U, 0x8664E6E5U, 0xBE2B5B58U, 0xBAEA46EFU,
+    0xB7A96036U, 0xB3687D81U, 0xAD2F2D84U, 0xA9EE3033U, 0xA4AD16EAU, 0xA06C0B5DU,
+    0xD4326D90U, 0xD0F37027U, 0xDDB056FEU, 0xD9714B49U, 0xC7361B4CU, 0xC3F706FBU,
+    0xCEB42022U, 0xCA753D95U, 0xF23A8028U, 0xF6FB9D9FU, 0xFBB8BB46U, 0xFF79A6F1U,
+    0xE13EF6F4U, 0xE5FFEB43U, 0xE8BCCD9AU, 0xEC7DD02DU, 0x34867077U, 0x30476DC0U,
+    0x3D044B19U, 0x39C556AEU, 0x278206ABU, 0x23431B1CU, 0x2E003DC5U, 0x2AC12072U,
+    0x128E9DCFU, 0x164F8078U, 0x1B0CA6A1U, 0x1FCDBB16U, 0x018AEB13U, 0x054BF6A4U,
+    0x0808D07DU, 0x0CC9CDCAU, 0x7897AB07U, 0x7C56B6B0U, 0x71159069U, 0x75D48DDEU,
+    0x6B93DDDBU, 0x6F52C06CU, 0x6211E6B5U, 0x66D0FB02U, 0x5E9F46BFU, 0x5A5E5B08U,
+    0x571D7DD1U, 0x53DC6066U, 0x4D9B3063U, 0x495A2DD4U, 0x44190B0DU, 0x40D816BAU,
+    0xACA5C697U, 0xA864DB20U, 0xA527FDF9U, 0xA1E6E04EU, 0xBFA1B04BU, 0xBB60ADFCU,
+    0xB6238B25U, 0xB2E29692U, 0x8AAD2B2FU, 0x8E6C3698U, 0x832F1041U, 0x87EE0DF6U,
+    0x99A95DF3U, 0x9D684044U, 0x902B669DU, 0x94EA7B2AU, 0xE0B41DE7U, 0xE4750050U,
+    0xE9362689U, 0xEDF73B3EU, 0xF3B06B3BU, 0xF771768CU, 0xFA325055U, 0xFEF34DE2U,
+    0xC6BCF05FU, 0xC27DEDE8U, 0xCF3ECB31U, 0xCBFFD686U, 0xD5B88683U, 0xD1799B34U,
+    0xDC3ABDEDU, 0xD8FBA05AU, 0x690CE0EEU, 0x6DCDFD59U, 0x608EDB80U, 0x644FC637U,
+    0x7A089632U, 0x7EC98B85U, 0x738AAD5CU, 0x774BB0EBU, 0x4F040D56U, 0x4BC510E1U,
+    0x46863638U, 0x42472B8FU, 0x5C007B8AU, 0x58C1663DU, 0x558240E4U, 0x51435D53U,
+    0x251D3B9EU, 0x21DC2629U, 0x2C9F00F0U, 0x285E1D47U, 0x36194D42U, 0x32D850F5U,
+    0x3F9B762CU, 0x3B5A6B9BU, 0x0315D626U, 0x07D4CB91U, 0x0A97ED48U, 0x0E56F0FFU,
+    0x1011A0FAU, 0x14D0BD4DU, 0x19939B94U, 0x1D528623U, 0xF12F560EU, 0xF5EE4BB9U,
+    0xF8AD6D60U, 0xFC6C70D7U, 0xE22B20D2U, 0xE6EA3D65U, 0xEBA91BBCU, 0xEF68060BU,
+    0xD727BBB6U, 0xD3E6A601U, 0xDEA580D8U, 0xDA649D6FU, 0xC423CD6AU, 0xC0E2D0DDU,
+    0xCDA1F604U, 0xC960EBB3U, 0xBD3E8D7EU, 0xB9FF90C9U, 0xB4BCB610U, 0xB07DABA7U,
+    0xAE3AFBA2U, 0xAAFBE615U, 0xA7B8C0CCU, 0xA379DD7BU, 0x9B3660C6U, 0x9FF77D71U,
+    0x92B45BA8U, 0x9675461FU, 0x8832161AU, 0x8CF30BADU, 0x81B02D74U, 0x857130C3U,
+    0x5D8A9099U, 0x594B8D2EU, 0x5408ABF7U, 0x50C9B640U, 0x4E8EE645U, 0x4A4FFBF2U,
+    0x470CDD2BU, 0x43CDC09CU, 0x7B827D21U, 0x7F436096U, 0x7200464FU, 0x76C15BF8U,
+    0x68860BFDU, 0x6C47164AU, 0x61043093U, 0x65C52D24U, 0x119B4BE9U, 0x155A565EU,
+    0x18197087U, 0x1CD86D30U, 0x029F3D35U, 0x065E2082U, 0x0B1D065BU, 0x0FDC1BECU,
+    0x3793A651U, 0x3352BBE6U, 0x3E119D3FU, 0x3AD08088U, 0x2497D08DU, 0x2056CD3AU,
+    0x2D15EBE3U, 0x29D4F654U, 0xC5A92679U, 0xC1683BCEU, 0xCC2B1D17U, 0xC8EA00A0U,
+    0xD6AD50A5U, 0xD26C4D12U, 0xDF2F6BCBU, 0xDBEE767CU, 0xE3A1CBC1U, 0xE760D676U,
+    0xEA23F0AFU, 0xEEE2ED18U, 0xF0A5BD1DU, 0xF464A0AAU, 0xF9278673U, 0xFDE69BC4U,
+    0x89B8FD09U, 0x8D79E0BEU, 0x803AC667U, 0x84FBDBD0U, 0x9ABC8BD5U, 0x9E7D9662U,
+    0x933EB0BBU, 0x97FFAD0CU, 0xAFB010B1U, 0xAB710D06U, 0xA6322BDFU, 0xA2F33668U,
+    0xBCB4666DU, 0xB8757BDAU, 0xB5365D03U, 0xB1F740B4U
+};
+
+static inline uint32_t Proto_Crc_Update(uint32_t Crc, const uint8_t *pData, uint32_t Len)
+{
+    while (Len--) {
+        Crc ^= *pData++;
+        Crc = (Crc << 8) ^ Proto_Crc_Table[Crc >> 24];
+        Crc = (Crc << 8) ^ Proto_Crc_Table[Crc >> 24];
+        Crc = (Crc << 8) ^ Proto_Crc_Table[Crc >> 24];
+        Crc = (Crc << 8) ^ Proto_Crc_Table[Crc >> 24];
+    }
+    return Crc;
+}
+
+static inline uint32_t Proto_Crc(const uint8_t *pData, uint32_t Len)
+{
+    return Proto_Crc_Update(0xFFFFFFFFU, pData, Len);
+}
+#endif /* PROTO_CRC_HW */
+
+/* --- Champs 32 bits, sans acces non aligne --- */
+static inline uint32_t Proto_Get_U32(const uint8_t *p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline void Proto_Put_U32(uint8_t *p, uint32_t Value)
+{
+    p[0] = (uint8_t)Value;
+    p[1] = (uint8_t)(Value >> 8);
+    p[2] = (uint8_t)(Value >> 16);
+    p[3] = (uint8_t)(Value >> 24);
+}
+
+/* --- Decodage : vue sur le tampon de l'appelant, aucune copie --- */
+typedef struct {
+    uint8_t Command;
+    uint32_t Address;
+    uint8_t Count;               /* Octet 6 tel que recu */
+    const uint8_t *pData;
+    uint8_t Data_Size;           /* Octets presents entre l'entete et le CRC */
+} Proto_Frame;
+
+/*
+ * Size : octets recus, champ len compris. Les trames courtes (len, cmd, crc)
+ * restent acceptees : Address, Count et Data_Size valent alors 0.
+ */
+static inline Proto_Status Proto_Decode(const uint8_t *pFrame, uint16_t Size, Proto_Frame *pOut)
+{
+    uint16_t Crc_Offset;
+
+    if ((Size < PROTO_MIN_FRAME) || (Size > PROTO_MAX_FRAME) ||
+        ((uint16_t)pFrame[PROTO_OFS_LEN] + 1 != Size)) {
+        return PROTO_ERR_SIZE;
+    }
+    Crc_Offset = Size - PROTO_CRC_SIZE;
+    if (Proto_Crc(&pFrame[PROTO_OFS_CMD], Crc_Offset - PROTO_OFS_CMD) != Proto_Get_U32(&pFrame[Crc_Offset])) {
+        return PROTO_ERR_CRC;
+    }
+
+    pOut->Command = pFrame[PROTO_OFS_CMD];
+    if (Size >= PROTO_OVERHEAD) {
+        pOut->Address = Proto_Get_U32(&pFrame[PROTO_OFS_ADDR]);
+        pOut->Count = pFrame[PROTO_OFS_COUNT];
+        pOut->pData = &pFrame[PROTO_OFS_DATA];
+        pOut->Data_Size = (uint8_t)(Size - PROTO_OVERHEAD);
+    } else {
+        pOut->Address = 0;
+        pOut->Count = 0;
+        pOut->pData = 0;
+        pOut->Data_Size = 0;
+    }
+    return PROTO_OK;
+}
+
+/* Vrai si count decrit bien les donnees presentes (commandes PROTO_F_DATA) */
+static inline uint8_t Proto_Data_Ok(const Proto_Frame *pFrame)
+{
+    return pFrame->Count <= pFrame->Data_Size;
+}
+
+/*
+ * Encodage dans pBuf. Les donnees peuvent deja etre en place a
+ * pBuf + PROTO_OFS_DATA (pas de copie). Retourne la taille totale de la
+ * trame, 0 si elle ne tient pas.
+ */
+static inline uint16_t Proto_Encode(uint8_t *pBuf, uint16_t BufSize, uint8_t Command,
+                                    uint32_t Address, const uint8_t *pData, uint8_t DataLen)
+{
+    uint16_t Size = (uint16_t)(PROTO_OVERHEAD + DataLen);
+
+    if ((DataLen > PROTO_MAX_DATA) || (Size > BufSize)) {
+        return 0;
+    }
+    pBuf[PROTO_OFS_LEN] = (uint8_t)(Size - 1);
+    pBuf[PROTO_OFS_CMD] = Command;
+    Proto_Put_U32(&pBuf[PROTO_OFS_ADDR], Address);
+    pBuf[PROTO_OFS_COUNT] = DataLen;
+    if ((DataLen > 0) && (pData != &pBuf[PROTO_OFS_DATA])) {
+        memmove(&pBuf[PROTO_OFS_DATA], pData, DataLen);
+    }
+    Proto_Put_U32(&pBuf[PROTO_OFS_DATA + DataLen],
+                  Proto_Crc(&pBuf[PROTO_OFS_CMD], PROTO_OFS_DATA - PROTO_OFS_CMD + DataLen));
+    return Size;
+}
+
+#endif /* FOTA_PROTO_H_ */
@@ -0,0 +1,226 @@
+/*
+ * test_fotaproto.c
+ *
+ *  Host test of FotaProto.h: CRC and frame vectors produced by
+ *  tools/fotaproto.py, encode / decode round trip for every command and
+ *  length, rejection of damaged frames. "bench" adds encode / decode
+ *  timings (host CPU, table CRC).
+ *
+ *      cc -std=c99 -O2 -Wall -o test_fotaproto common/test_fotaproto.c
+ *      ./test_fotaproto [bench]
+ *
+ *  Exit 0 if every check passes.
+ */
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "FotaProto.h"
+
+static int Failures;
+
+#define CHECK(cond) do { \
+    if (!(cond)) { printf("FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond); Failures++; } \
+} while (0)
+
+/* --- Vecteurs : python3 tools/fotaproto.py encode ... --- */
+typedef struct {
+    uint8_t Command;
+    uint32_t Address;
+    uint8_t DataLen;             /* data = 0, 1, 2 ... */
+    const char *Hex;
+} Frame_Vector;
+
+static const Frame_Vector Frame_Vectors[] = {
+    { PROTO_CMD_GET_VER,     0x00000000U, 0,  "0a1000000000009e333c95" },
+    { PROTO_CMD_FLASH_ERASE, 0x08008000U, 1,  "0b150080000801002b00ba76" },
+    { PROTO_CMD_MEM_WRITE,   0x08008000U, 16, "1a160080000810000102030405060708090a0b0c0d0e0fbb697b05" },
+};
+
+static uint16_t From_Hex(const char *pHex, uint8_t *pOut)
+{
+    uint16_t Len = 0;
+    unsigned int Byte;
+
+    while (pHex[0] && pHex[1] && (sscanf(pHex, "%2x", &Byte) == 1)) {
+        pOut[Len++] = (uint8_t)Byte;
+        pHex += 2;
+    }
+    return Len;
+}
+
+static void Test_Crc(void)
+{
+    uint8_t Data[256];
+
+    for (int i = 0; i < 256; i++) {
+        Data[i] = (uint8_t)i;
+    }
+    CHECK(Proto_Crc(Data, 0) == 0xFFFFFFFFU);
+    CHECK(Proto_Crc((const uint8_t *)"123456789", 9) == 0x1556F485U);
+    CHECK(Proto_Crc(Data, sizeof(Data)) == 0x96670628U);
+    /* Reprise de calcul : meme resultat en deux morceaux */
+    CHECK(Proto_Crc_Update(Proto_Crc(Data, 100), &Data[100], 156) == 0x96670628U);
+}
+
+static void Test_Vectors(void)
+{
+    uint8_t Expected[PROTO_MAX_FRAME], Buf[PROTO_MAX_FRAME], Data[PROTO_MAX_DATA];
+    Proto_Frame Frame = { 0 };
+
+    for (int i = 0; i < PROTO_MAX_DATA; i++) {
+        Data[i] = (uint8_t)i;
+    }
+    for (size_t v = 0; v < sizeof(Frame_Vectors) / sizeof(Frame_Vectors[0]); v++) {
+        const Frame_Vector *pV = &Frame_Vectors[v];
+        uint16_t Len = From_Hex(pV->Hex, Expected);
+        uint16_t Size = Proto_Encode(Buf, sizeof(Buf), pV->Command, pV->Address, Data, pV->DataLen);
+
+        CHECK(Size == Len);
+        CHECK(memcmp(Buf, Expected, Len) == 0);
+        CHECK(Proto_Decode(Expected, Len, &Frame) == PROTO_OK);
+        CHECK(Frame.Command == pV->Command);
+        CHECK(Frame.Address == pV->Address);
+        CHECK(Frame.Data_Size == pV->DataLen);
+    }
+}
+
+static void Test_Round_Trip(void)
+{
+    uint8_t Buf[PROTO_MAX_FRAME], Data[PROTO_MAX_DATA];
+    Proto_Frame Frame = { 0 };
+    int Errors = 0;
+
+    for (int i = 0; i < PROTO_MAX_DATA; i++) {
+        Data[i] = (uint8_t)(i * 7 + 3);
+    }
+    for (int Code = PROTO_CMD_FIRST; Code <= PROTO_CMD_LAST; Code++) {
+        for (int Len = 0; Len <= PROTO_MAX_DATA; Len++) {
+            uint32_t Address = 0x08000000U + (uint32_t)Code * 0x1000U + (uint32_t)Len;
+            uint16_t Size = Proto_Encode(Buf, sizeof(Buf), (uint8_t)Code, Address, Data, (uint8_t)Len);
+
+            if ((Size != PROTO_OVERHEAD + Len) ||
+                (Proto_Decode(Buf, Size, &Frame) != PROTO_OK) ||
+                (Frame.Command != Code) || (Frame.Address != Address) ||
+                (Frame.Count != Len) || (Frame.Data_Size != Len) || !Proto_Data_Ok(&Frame) ||
+                ((Len > 0) && memcmp(Frame.pData, Data, Len) != 0)) {
+                Errors++;
+            }
+        }
+    }
+    CHECK(Errors == 0);
+
+    /* Donnees deja en place dans le tampon */
+    memcpy(&Buf[PROTO_OFS_DATA], Data, 32);
+    CHECK(Proto_Encode(Buf, sizeof(Buf), PROTO_CMD_MEM_WRITE, 0, &Buf[PROTO_OFS_DATA], 32) == PROTO_OVERHEAD + 32);
+    CHECK(Proto_Decode(Buf, PROTO_OVERHEAD + 32, &Frame) == PROTO_OK);
+    CHECK(memcmp(Frame.pData, Data, 32) == 0);
+}
+
+static void Test_Rejects(void)
+{
+    uint8_t Buf[PROTO_MAX_FRAME + 1], Data[PROTO_MAX_DATA + 1] = { 0 };
+    Proto_Frame Frame = { 0 };
+    uint16_t Size = Proto_Encode(Buf, sizeof(Buf), PROTO_CMD_MEM_WRITE, 0x08008000U, Data, 64);
+    int Missed = 0;
+
+    /* Chaque bit inverse apres le champ len est detecte */
+    for (uint16_t Bit = 8; Bit < Size * 8; Bit++) {
+        Buf[Bit / 8] ^= (uint8_t)(1U << (Bit % 8));
+        if (Proto_Decode(Buf, Size, &Frame) != PROTO_ERR_CRC) {
+            Missed++;
+        }
+        Buf[Bit / 8] ^= (uint8_t)(1U << (Bit % 8));
+    }
+    CHECK(Missed == 0);
+
+    CHECK(Proto_Decode(Buf, Size - 1, &Frame) == PROTO_ERR_SIZE);
+    CHECK(Proto_Decode(Buf, PROTO_MIN_FRAME - 1, &Frame) == PROTO_ERR_SIZE);
+    CHECK(Proto_Encode(Buf, sizeof(Buf), PROTO_CMD_MEM_WRITE, 0, Data, PROTO_MAX_DATA + 1) == 0);
+    CHECK(Proto_Encode(Buf, PROTO_OVERHEAD + 63, PROTO_CMD_MEM_WRITE, 0, Data, 64) == 0);
+
+    /* Trame courte (len, cmd, crc) : champs a 0 */
+    Buf[PROTO_OFS_LEN] = PROTO_MIN_FRAME - 1;
+    Buf[PROTO_OFS_CMD] = PROTO_CMD_GET_VER;
+    Proto_Put_U32(&Buf[PROTO_OFS_CMD + 1], Proto_Crc(&Buf[PROTO_OFS_CMD], 1));
+    CHECK(Proto_Decode(Buf, PROTO_MIN_FRAME, &Frame) == PROTO_OK);
+    CHECK((Frame.Command == PROTO_CMD_GET_VER) && (Frame.Data_Size == 0) && (Frame.pData == 0));
+}
+
+static void Test_Commands(void)
+{
+    int Count = 0;
+
+    for (int Code = 0; Code < 256; Code++) {
+        const Proto_Command *pCmd = Proto_Find((uint8_t)Code);
+
+        if (pCmd) {
+            CHECK(pCmd->Code == Code);
+            CHECK(pCmd->Name != 0);
+            Count++;
+        }
+    }
+    CHECK(Count == PROTO_COMMAND_COUNT);
+    CHECK(Proto_Find(0x13) == 0);
+}
+
+static double Now_Ns(void)
+{
+    struct timespec Ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &Ts);
+    return (double)Ts.tv_sec * 1e9 + (double)Ts.tv_nsec;
+}
+
+static void Bench(void)
+{
+    static const uint8_t Lengths[] = { 0, 64, PROTO_MAX_DATA };
+    uint8_t Buf[PROTO_MAX_FRAME], Data[PROTO_MAX_DATA];
+    Proto_Frame Frame = { 0 };
+    const int Rounds = 200000;
+    volatile uint32_t Sink = 0;
+
+    for (int i = 0; i < PROTO_MAX_DATA; i++) {
+        Data[i] = (uint8_t)i;
+    }
+    printf("%-8s %-6s %10s %10s\n", "op", "data", "ns/frame", "MB/s");
+    for (size_t l = 0; l < sizeof(Lengths); l++) {
+        uint8_t Len = Lengths[l];
+        uint16_t Size = 0;
+        double T0 = Now_Ns(), T1;
+
+        for (int r = 0; r < Rounds; r++) {
+            Data[0] = (uint8_t)r;
+            Size = Proto_Encode(Buf, sizeof(Buf), PROTO_CMD_MEM_WRITE, (uint32_t)r, Data, Len);
+            Sink += Buf[Size - 1];
+        }
+        T1 = Now_Ns();
+        printf("%-8s %-6u %10.1f %10.1f\n", "encode", Len, (T1 - T0) / Rounds,
+               Size * (double)Rounds / (T1 - T0) * 1e3);
+
+        T0 = Now_Ns();
+        for (int r = 0; r < Rounds; r++) {
+            Sink += (uint32_t)Proto_Decode(Buf, Size, &Frame) + Frame.Address;
+        }
+        T1 = Now_Ns();
+        printf("%-8s %-6u %10.1f %10.1f\n", "decode", Len, (T1 - T0) / Rounds,
+               Size * (double)Rounds / (T1 - T0) * 1e3);
+    }
+    (void)Sink;
+}
+
+int main(int argc, char **argv)
+{
+    Test_Crc();
+    Test_Vectors();
+    Test_Round_Trip();
+    Test_Rejects();
+    Test_Commands();
+    printf("%s (%d failure%s)\n", Failures ? "FAILED" : "OK", Failures, Failures == 1 ? "" : "s");
+
+    if ((argc > 1) && (strcmp(argv[1], "bench") == 0)) {
+        Bench();
+    }
+    return Failures ? 1 : 0;
+}
@@ -5,199 +5,2548 @@
 #include <LittleFS.h>
 #include <PubSubClient.h>
 #include <WiFiClientSecure.h>
+#include <esp_rom_crc.h>
+#include <mbedtls/sha256.h>
+#include <mbedtls/pk.h>
+#include <mbedtls/ecdsa.h>
+#include <esp_attr.h>
+#include <SPI.h>
+#include "FotaProto.h" // common/ : trames partagees avec le bootloader
 
 // --- CONFIGURATION ---
 #define SSID_NAME "Redmi 13C"
 #define SSID_PASS "youssef12"
 #define MQTT_SERVER "test.mosquitto.org"
-#define TOPIC_SUB "/FOTA/test"
-#define TOPIC_PUB "/FOTA/status"
+// Topics par passerelle : /FOTA/<id>/cmd, /FOTA/<id>/status, /FOTA/<id>/presence
+// <id> = adresse MAC eFuse (stable), voir tools/campaign.py pour les deploiements
+#define TOPIC_ROOT "/FOTA"
 
 // --- PINS & BOOTLOADER ---
 #define PIN_RX 18
 #define PIN_TX 17
 #define PIN_RST 4
+#define UART_BAUD 115200
+
+// Liaison SPI (bootloader compile avec CBL_TRANSPORT_SPI) au lieu de l'UART
+#define TRANSPORT_SPI 0
+#define PIN_SPI_SCK 12
+#define PIN_SPI_MISO 13
+#define PIN_SPI_MOSI 11
+#define PIN_SPI_CS 10
+#define PIN_SPI_READY 9        // Entree : la cible a arme son DMA
+#define SPI_HZ 8000000
+#define SPI_XFER (PROTO_MAX_FRAME + 1) // CBL_SPI_XFER_SIZE
+#define SPI_READY_TIMEOUT 20   // ms ; au-dela l'envoi est perdu, comme sur l'UART
+
+#if TRANSPORT_SPI
+#define LINK_BAUD SPI_HZ
+#define WIRE_MS(bytes) (SPI_XFER * 8 * 1000 / SPI_HZ + 1) // Un echange quelle que soit la taille
+#else
+#define LINK_BAUD UART_BAUD
+#define WIRE_MS(bytes) ((bytes) * 10 * 1000 / UART_BAUD + 1)
+#endif
 #define ADDR_APP 0x08008000
+#define KNOCK_BYTE PROTO_KNOCK // Garde le bootloader en mode commande
+#define KNOCK_WINDOW 50   // ms de frappe apres le reset
+
+// --- FICHIERS LITTLEFS ---
+#define FILE_UPDATE "/update.bin"   // Image a flasher
+#define FILE_CURRENT "/current.bin" // Derniere image flashee avec succes (base des patchs)
+#define FILE_PATCH "/update.patch"  // Patch FDP1 telecharge (tools/fwdelta.py)
+#define FILE_SIG "/update.sig"      // Signature du flux image (<url>.sig)
+#define FILE_TRACE "/uart.trace"    // Trace UART de la derniere session (tools/uarttrace.py)
+#define FILE_BACKUP "/backup.bin"   // Application relue sur la cible avant effacement (rollback)
+#define FILE_NODES "/nodes.bin"     // Identifiants des noeuds du bus RS-485 (u32 LE)
+#define FILE_JOBS "/jobs.bin"       // File de commandes planifiees
+#define UART_RX_BUFFER 4096         // ~350 ms de flux MEM_READ pendant les ecritures LittleFS
+
+// --- AUTHENTIFICATION ---
+// Sans signature valide, l'image est ecrite mais jamais marquee demarrable
+#define REQUIRE_SIGNATURE 1
+// Cle publique de signature, hors du depot : fw_public_key.h a cote de ce
+// fichier, genere par tools/fwsign.py pubkey key.pem --header
+#define FW_PUBLIC_KEY_SIZE 179 // PEM SubjectPublicKeyInfo P-256, NUL compris
+#if __has_include("fw_public_key.h")
+#include "fw_public_key.h"
+static_assert(sizeof(FW_PUBLIC_KEY) == FW_PUBLIC_KEY_SIZE, "fw_public_key.h: P-256 PEM public key expected");
+#elif REQUIRE_SIGNATURE
+#error "fw_public_key.h missing: tools/fwsign.py pubkey key.pem --header > esp32-code/fw_public_key.h"
+#else
+static const char FW_PUBLIC_KEY[] = "";
+#endif
+
+// --- GLOBALS ---
+WiFiClient espClient;
+PubSubClient client(espClient);
+String deviceId, topicCmd, topicStatus, topicPresence;
+
+// --- DEMARRAGE RAPIDE ---
+// Canal, BSSID et bail IP de la derniere connexion, conserves en RTC a travers
+// les resets logiciels / deep sleep : la reconnexion saute scan et DHCP
+#define WIFI_CACHE_MAGIC 0x57494649 // "WIFI"
+#define WIFI_FAST_TIMEOUT 1500      // ms avant de revenir a une connexion complete
+struct WifiCache
+{
+  uint32_t magic;
+  uint8_t channel;
+  uint8_t bssid[6];
+  uint32_t ip, gateway, mask, dns;
+  uint32_t crc;
+};
+RTC_NOINIT_ATTR WifiCache wifiCache;
+uint32_t wifiMs = 0;    // Duree de la connexion Wi-Fi au demarrage
+bool wifiFast = false;  // Connexion faite depuis le cache
+bool reportedReady = false;
+bool doTraceUpload = false;
+String traceURL = "";
+mbedtls_sha256_context streamHash; // Hash des charges utiles envoyees (accelere materiel)
+mbedtls_sha256_context fileHash;   // Hash du conteneur FWZ1 / FSG1 relu pendant l'envoi (signe)
+
+// --- LOGGING (USB + MQTT) ---
+// PubSubClient n'est appele que depuis la boucle principale : les messages des
+// autres taches (telechargements) passent par logQueue, videe par logFlush()
+#define LOG_LINE 160
+#define LOG_QUEUE 16
+TaskHandle_t loopTask = NULL;
+QueueHandle_t logQueue = NULL;
+
+void logM(String msg)
+{
+  Serial.println(msg);
+  if (xTaskGetCurrentTaskHandle() != loopTask)
+  {
+    char line[LOG_LINE];
+    strlcpy(line, msg.c_str(), sizeof(line));
+    if (logQueue)
+      xQueueSend(logQueue, line, 0); // File pleine : message sur USB seulement
+    return;
+  }
+  if (client.connected())
+    client.publish(topicStatus.c_str(), msg.c_str());
+}
+
+void logFlush()
+{
+  char line[LOG_LINE];
+  while (xQueueReceive(logQueue, line, 0) == pdTRUE)
+    if (client.connected())
+      client.publish(topicStatus.c_str(), line);
+}
+
+// --- TRACE UART ---
+// "FTR1" | baud u32, puis des enregistrements :
+//   dt varint (us depuis l'enregistrement precedent) | type u8 | len varint | octets
+// Les octets consecutifs d'un meme sens sont regroupes en un enregistrement.
+#define TRACE_TX 0    // Passerelle -> bootloader
+#define TRACE_RX 1    // Bootloader -> passerelle
+#define TRACE_RESET 2 // Reset materiel de la cible (len 0)
+bool traceEnabled = false; // Commande MQTT "trace on" / "trace off"
+File traceFile;
+uint8_t traceBuf[128];
+uint8_t traceFill = 0, traceType = TRACE_TX;
+uint32_t traceStart = 0, traceLast = 0;
+
+void traceVarint(uint32_t v)
+{
+  uint8_t b[5], n = 0;
+  do
+  {
+    b[n] = v & 0x7F;
+    v >>= 7;
+    if (v)
+      b[n] |= 0x80;
+    n++;
+  } while (v);
+  traceFile.write(b, n);
+}
+
+void traceFlush()
+{
+  if (!traceFile || (traceFill == 0 && traceType != TRACE_RESET))
+    return;
+  traceVarint(traceStart - traceLast);
+  traceLast = traceStart;
+  traceFile.write(traceType);
+  traceVarint(traceFill);
+  traceFile.write(traceBuf, traceFill);
+  traceFill = 0;
+  traceType = TRACE_TX;
+}
+
+void traceBytes(uint8_t type, const uint8_t *data, size_t n)
+{
+  if (!traceFile)
+    return;
+  if (traceFill > 0 && (type != traceType || type == TRACE_RESET))
+    traceFlush();
+  if (traceFill == 0)
+  {
+    traceStart = micros();
+    traceType = type;
+    if (type == TRACE_RESET)
+    {
+      traceFlush();
+      return;
+    }
+  }
+  while (n--)
+  {
+    traceBuf[traceFill++] = *data++;
+    if (traceFill == sizeof(traceBuf))
+    {
+      traceFlush();
+      traceStart = micros();
+      traceType = type;
+    }
+  }
+}
+
+void traceBegin()
+{
+  if (!traceEnabled)
+    return;
+  traceFile = LittleFS.open(FILE_TRACE, "w");
+  if (!traceFile)
+    return;
+  uint32_t baud = LINK_BAUD;
+  traceFile.write((const uint8_t *)"FTR1", 4);
+  traceFile.write((const uint8_t *)&baud, 4);
+  traceFill = 0;
+  traceLast = micros();
+}
+
+void traceEnd()
+{
+  if (!traceFile)
+    return;
+  traceFlush();
+  logM("Trace: " + String(traceFile.size()) + " bytes in " FILE_TRACE);
+  traceFile.close();
+}
+
+// Envoie la trace par HTTP POST (commande "trace upload <url>")
+void handleTraceUpload()
+{
+  File f = LittleFS.open(FILE_TRACE, "r");
+  if (!f)
+  {
+    logM("Trace: nothing recorded");
+    return;
+  }
+  WiFiClient plain;
+  WiFiClientSecure secure;
+  secure.setInsecure();
+  HTTPClient http;
+  if (traceURL.startsWith("https"))
+    http.begin(secure, traceURL);
+  else
+    http.begin(plain, traceURL);
+  http.addHeader("Content-Type", "application/octet-stream");
+  int code = http.sendRequest("POST", &f, f.size());
+  http.end();
+  f.close();
+  logM("Trace upload: HTTP " + String(code));
+}
+
+// --- LIAISON CIBLE ---
+// Le reste du code ne voit qu'un flux d'octets : portWrite / portAvailable /
+// portRead. Tous les echanges passent par ici pour etre traces.
+#if TRANSPORT_SPI
+// Echanges full duplex de SPI_XFER octets, cadences seulement quand la cible
+// leve PIN_SPI_READY. Chaque sens porte n | n octets | bourrage 0xFF
+// (stm32-code/Transport.h).
+uint8_t spiTx[SPI_XFER];
+uint8_t spiTxLen = 0;
+uint8_t spiRing[1024];
+uint16_t spiHead = 0, spiTail = 0;
+
+bool spiExchange(uint32_t timeout)
+{
+  uint8_t rx[SPI_XFER];
+  uint32_t start = millis();
+  while (!digitalRead(PIN_SPI_READY))
+    if (millis() - start >= timeout)
+      return false;
+
+  spiTx[0] = spiTxLen;
+  memset(&spiTx[1 + spiTxLen], 0xFF, SPI_XFER - 1 - spiTxLen);
+  SPI.beginTransaction(SPISettings(SPI_HZ, MSBFIRST, SPI_MODE0));
+  digitalWrite(PIN_SPI_CS, LOW);
+  SPI.transferBytes(spiTx, rx, SPI_XFER);
+  digitalWrite(PIN_SPI_CS, HIGH);
+  SPI.endTransaction();
+  spiTxLen = 0;
+
+  // La cible baisse ready a la fin de son DMA : attendre le front evite de
+  // cadencer un echange qu'elle n'a pas encore re-arme
+  start = micros();
+  while (digitalRead(PIN_SPI_READY) && micros() - start < 1000)
+    ;
+  uint8_t n = rx[0] < SPI_XFER ? rx[0] : 0;
+  for (uint8_t i = 0; i < n; i++)
+  {
+    spiRing[spiHead] = rx[1 + i];
+    spiHead = (spiHead + 1) % sizeof(spiRing);
+  }
+  return true;
+}
+
+void portBegin()
+{
+  pinMode(PIN_SPI_CS, OUTPUT);
+  digitalWrite(PIN_SPI_CS, HIGH);
+  pinMode(PIN_SPI_READY, INPUT_PULLDOWN);
+  SPI.begin(PIN_SPI_SCK, PIN_SPI_MISO, PIN_SPI_MOSI, PIN_SPI_CS);
+}
+
+void portWrite(const uint8_t *data, size_t n)
+{
+  traceBytes(TRACE_TX, data, n);
+  while (n > 0)
+  {
+    size_t chunk = min(n, (size_t)(SPI_XFER - 1 - spiTxLen));
+    memcpy(&spiTx[1 + spiTxLen], data, chunk);
+    spiTxLen += chunk;
+    data += chunk;
+    n -= chunk;
+    spiExchange(SPI_READY_TIMEOUT);
+  }
+}
+
+// Une cible en attente d'octets leve ready : on en profite pour relever ses reponses
+// Les echanges SPI sont synchrones : rien ne reste en file
+void portFlush()
+{
+}
+
+int portAvailable()
+{
+  if (spiHead == spiTail && digitalRead(PIN_SPI_READY))
+    spiExchange(0);
+  return (spiHead + sizeof(spiRing) - spiTail) % sizeof(spiRing);
+}
+
+int portRead()
+{
+  if (!portAvailable())
+    return -1;
+  uint8_t c = spiRing[spiTail];
+  spiTail = (spiTail + 1) % sizeof(spiRing);
+  traceBytes(TRACE_RX, &c, 1);
+  return c;
+}
+#else
+void portBegin()
+{
+  Serial1.setRxBufferSize(UART_RX_BUFFER); // Avant begin()
+  Serial1.begin(UART_BAUD, SERIAL_8N1, PIN_RX, PIN_TX);
+}
+
+void portWrite(const uint8_t *data, size_t n)
+{
+  Serial1.write(data, n);
+  traceBytes(TRACE_TX, data, n);
+}
+
+// Retour une fois le dernier bit sur la ligne (FIFO et registre a decalage)
+void portFlush()
+{
+  Serial1.flush();
+}
+
+int portAvailable()
+{
+  return Serial1.available();
+}
+
+int portRead()
+{
+  int b = Serial1.read();
+  if (b >= 0)
+  {
+    uint8_t c = b;
+    traceBytes(TRACE_RX, &c, 1);
+  }
+  return b;
+}
+#endif
+
+void portPurge()
+{
+  while (portAvailable())
+    portRead();
+}
+
+// n octets, chaque octet arrivant dans le delai
+bool portReadBytes(uint8_t *buf, size_t n, uint32_t timeout)
+{
+  uint32_t last = millis();
+  size_t got = 0;
+  while (got < n)
+  {
+    if (portAvailable())
+    {
+      buf[got++] = portRead();
+      last = millis();
+    }
+    else if (millis() - last > timeout)
+      return false;
+  }
+  return true;
+}
+
+// Attend la fin d'un flux en cours : ligne silencieuse pendant idleMs
+void portDrain(uint32_t idleMs)
+{
+  uint32_t last = millis();
+  while (millis() - last < idleMs)
+    if (portAvailable())
+    {
+      portRead();
+      last = millis();
+    }
+}
+
+// --- OUTILS STM32 (Reset) ---
+void resetSTM32()
+{
+  logM(">>> Reset STM32...");
+  digitalWrite(PIN_RST, LOW);
+  delay(150);
+  portPurge();
+  traceBytes(TRACE_RESET, NULL, 0);
+  digitalWrite(PIN_RST, HIGH);
+
+  // Sans frappe, un bootloader avec une application valide saute directement
+  // dessus apres quelques ms : on frappe jusqu'a son ACK
+  uint32_t start = millis();
+  bool knocked = false;
+  const uint8_t knock = KNOCK_BYTE;
+  while (!knocked && millis() - start < KNOCK_WINDOW)
+  {
+    portWrite(&knock, 1);
+    delay(1);
+    while (portAvailable())
+      if (portRead() == PROTO_ACK)
+        knocked = true;
+  }
+  delay(5); // Le bootloader ignore la fin de la rafale
+  portPurge();
+}
+
+// --- COMMUNICATION UART ---
+// Format de trame et CRC : common/FotaProto.h
+void sendPacket(uint8_t cmd, uint32_t addr, const uint8_t *payload, uint8_t len)
+{
+  uint8_t buf[PROTO_MAX_FRAME];
+  uint16_t size = Proto_Encode(buf, sizeof(buf), cmd, addr, payload, len);
+  if (size > 0)
+    portWrite(buf, size);
+}
+
+// --- REPONSES BOOTLOADER ---
+// NACK : 0xAB seul. ACK : 0xCD, longueur, puis <longueur> octets (statut Flash,
+// version...). La trame est rendue des qu'elle est complete, sans delai ni purge.
+#define STATUS_WRITE_PASSED 0x01  // FLASH_PAYLOAD_WRITE_PASSED
+#define STATUS_ERASE_OK 0x03      // SUCCESSFUL_ERASE
+#define STATUS_ERASE_REJECTED 0x00 // INVALID_PAGE_NUMBER (UpdateAgent : image plus grande que le staging)
+#define STATUS_ADDR_VALID 0x01    // ADDRESS_IS_VALID
+#define STATUS_APP_SAVED 0x01     // APP_INFO_SAVED
+
+enum RespResult
+{
+  RESP_OK,
+  RESP_NACK,
+  RESP_TIMEOUT,
+  RESP_BAD_STATUS
+};
+
+struct Response
+{
+  uint8_t len;
+  uint8_t data[PROTO_BITMAP_PAGE]; // Plus longue reponse : une page de bitmap (GET_COMPONENTS : 119)
+};
+
+RespResult readResponse(uint32_t timeout, Response *resp)
+{
+  enum { WAIT_ACK, WAIT_LEN, WAIT_DATA } state = WAIT_ACK;
+  uint8_t got = 0;
+  uint32_t start = millis();
+  resp->len = 0;
+
+  while (millis() - start < timeout)
+  {
+    if (!portAvailable())
+      continue;
+    uint8_t b = portRead();
+    switch (state)
+    {
+    case WAIT_ACK:
+      if (b == PROTO_NACK)
+        return RESP_NACK;
+      if (b == PROTO_ACK)
+        state = WAIT_LEN;
+      break; // Octet parasite (fin de rafale de knocks...) : ignore
+    case WAIT_LEN:
+      resp->len = b;
+      if (b == 0)
+        return RESP_OK;
+      state = WAIT_DATA;
+      break;
+    case WAIT_DATA:
+      if (got < sizeof(resp->data))
+        resp->data[got] = b;
+      if (++got == resp->len)
+        return RESP_OK;
+      break;
+    }
+  }
+  return RESP_TIMEOUT;
+}
+
+// ACK suivi du statut attendu (premier octet de la reponse)
+RespResult waitStatus(uint8_t expected, uint32_t timeout = 2000)
+{
+  Response resp;
+  RespResult r = readResponse(timeout, &resp);
+  if (r == RESP_OK && (resp.len < 1 || resp.data[0] != expected))
+    return RESP_BAD_STATUS;
+  return r;
+}
+
+// --- CONTROLE DE LIEN (AIMD + RTO adaptatif) ---
+// Taille des blocs : +CHUNK_STEP a chaque ACK propre, divisee par 2 sur echec.
+// Multiples de 4 pour garder la programmation par mots cote bootloader.
+#define CHUNK_MIN 16
+#define CHUNK_START 64
+#define CHUNK_MAX (PROTO_MAX_DATA & ~3) // 188 : plus grand multiple de 4 qui tient dans une trame
+#define CHUNK_STEP 16
+#define MAX_RETRIES 5
+#define RTO_MIN 20    // ms
+#define RTO_MAX 2000  // ms, ancien timeout fixe
+
+struct LinkControl
+{
+  uint16_t chunk;
+  float srtt, rttvar; // ms, estimateurs de Jacobson/Karels (RFC 6298)
+  uint32_t rto;
+  uint32_t frames, retries, bytes;
+  uint32_t startMs;
+} linkCtl;
+
+void linkReset()
+{
+  linkCtl.chunk = CHUNK_START;
+  linkCtl.srtt = 0;
+  linkCtl.rttvar = 0;
+  linkCtl.rto = RTO_MAX;
+  linkCtl.frames = linkCtl.retries = linkCtl.bytes = 0;
+  linkCtl.startMs = millis();
+}
+
+void linkOnAck(uint32_t rtt)
+{
+  if (linkCtl.srtt == 0)
+  {
+    linkCtl.srtt = rtt;
+    linkCtl.rttvar = rtt / 2.0f;
+  }
+  else
+  {
+    linkCtl.rttvar = 0.75f * linkCtl.rttvar + 0.25f * fabsf(linkCtl.srtt - rtt);
+    linkCtl.srtt = 0.875f * linkCtl.srtt + 0.125f * rtt;
+  }
+  linkCtl.rto = constrain((uint32_t)(linkCtl.srtt + 4 * linkCtl.rttvar), RTO_MIN, RTO_MAX);
+  linkCtl.chunk = min(CHUNK_MAX, linkCtl.chunk + CHUNK_STEP);
+}
+
+void linkOnLoss()
+{
+  linkCtl.chunk = max(CHUNK_MIN, (linkCtl.chunk / 2) & ~3);
+  linkCtl.rto = min((uint32_t)RTO_MAX, linkCtl.rto * 2); // Backoff exponentiel
+}
+
+// Envoie len octets d'ecriture, avec au plus MAX_RETRIES retransmissions de
+// suite. Apres une perte, le reste de MEM_WRITE est redecoupe a la nouvelle
+// taille linkCtl.chunk : les reprises raccourcissent sur une ligne bruitee.
+// Un record MEM_WRITE_LZ ne se decoupe pas. Le bootloader ne hache que les
+// octets au-dela de ceux deja recus, une reprise recoupee compte donc une fois.
+bool sendWithRetry(uint8_t cmd, uint32_t addr, const uint8_t *buf, uint8_t len)
+{
+  bool split = cmd == PROTO_CMD_MEM_WRITE;
+  uint8_t done = 0;
+  int attempt = 0;
+
+  while (done < len)
+  {
+    if (attempt > MAX_RETRIES)
+    {
+      logM("Write Fail @ " + String(addr + done, HEX) + " after " + String(MAX_RETRIES) + " retries");
+      return false;
+    }
+    if (attempt > 0)
+    {
+      linkCtl.retries++;
+      delay(linkCtl.rto / 4); // Laisse la ligne se calmer avant de renvoyer
+      portPurge(); // Reponse tardive de la tentative precedente
+    }
+    uint8_t n = split ? min((uint16_t)(len - done), linkCtl.chunk) : len;
+    // Jamais moins que deux fois le temps de la trame sur le fil
+    uint32_t wireMs = WIRE_MS(n + 14);
+    uint32_t t0 = millis();
+    sendPacket(cmd, addr + done, buf + done, n);
+    RespResult r = waitStatus(STATUS_WRITE_PASSED, max(linkCtl.rto, 2 * wireMs));
+    if (r == RESP_BAD_STATUS)
+    {
+      // Trame recue intacte mais ecriture refusee (adresse, Flash non effacee) :
+      // une retransmission n'y changerait rien
+      logM("Write rejected @ " + String(addr + done, HEX));
+      return false;
+    }
+    if (r == RESP_OK)
+    {
+      // Karn : pas de mesure RTT sur une retransmission
+      if (attempt == 0)
+        linkOnAck(millis() - t0);
+      linkCtl.frames++;
+      linkCtl.bytes += n;
+      done += n;
+      attempt = 0;
+      continue;
+    }
+    linkOnLoss();
+    attempt++;
+  }
+  return true;
+}
+
+// Commande idempotente (SET_APP_INFO, GO_TO_ADDR) : renvoyee sur NACK ou
+// timeout comme une ecriture. Un statut inattendu est definitif.
+RespResult commandWithRetry(uint8_t cmd, uint32_t addr, const uint8_t *data, uint8_t len, uint8_t expected)
+{
+  RespResult r = RESP_TIMEOUT;
+  for (int attempt = 0; attempt <= MAX_RETRIES && r != RESP_OK && r != RESP_BAD_STATUS; attempt++)
+  {
+    if (attempt > 0)
+    {
+      linkCtl.retries++;
+      delay(linkCtl.rto / 4);
+      portPurge();
+    }
+    sendPacket(cmd, addr, data, len);
+    r = waitStatus(expected);
+  }
+  return r;
+}
+
+void linkReport()
+{
+  uint32_t elapsed = max((uint32_t)1, (uint32_t)(millis() - linkCtl.startMs));
+  logM("Link: " + String(linkCtl.frames) + " frames, " + String(linkCtl.retries) + " retries, chunk " +
+       String(linkCtl.chunk) + ", srtt " + String(linkCtl.srtt, 1) + " ms, " +
+       String(linkCtl.bytes * 1000 / elapsed) + " B/s");
+}
+
+// --- CACHE D'IMAGES ENTRE PASSERELLES (LAN) ---
+// Les fichiers telecharges (image, signature, patch) sont annonces en UDP
+// broadcast par le hash de leur URL et servis aux autres passerelles du site
+// en HTTP clair avec Range. Avant d'aller sur le WAN, une passerelle demande
+// si un pair a deja le fichier ou est en train de le telecharger : seule la
+// premiere sort du site, les autres copient son fichier et le verifient par
+// SHA-256 (puis par signature pour l'image). tools/peercache.py parle le
+// meme protocole depuis un PC.
+//   "FPC1" | type u8 | cle u32 (CRC-32 de l'URL), puis selon le type :
+//   WANT    -
+//   HAVE    taille u32 | port HTTP u16 | SHA-256
+//   FETCH   id u64 (MAC) : telechargement WAN en cours, le plus petit id gagne
+//   FAILED  - : telechargement WAN abandonne, les autres essaient eux-memes
+#define PEER_UDP_PORT 8071
+#define PEER_HTTP_PORT 8070
+#define PEER_MAX_FILES 4     // Image + signature, patch + signature
+#define PEER_QUERY_MS 300    // Attente des reponses a WANT
+#define PEER_CLAIM_MS 200    // Attente d'un FETCH concurrent avant de sortir sur le WAN
+#define PEER_WAIT_MS 120000  // Attente maximale du HAVE d'un pair qui telecharge
+#define PEER_RETRIES 3       // Reprises (Range) d'un transfert interrompu
+#define PEER_WANT 0
+#define PEER_HAVE 1
+#define PEER_FETCH 2
+#define PEER_FAILED 3
+
+struct PeerFile
+{
+  uint32_t key;
+  char path[16];
+  uint32_t size;
+  uint8_t sha[32];
+};
+PeerFile peerFiles[PEER_MAX_FILES];
+SemaphoreHandle_t peerLock; // peerFiles, peerWant et peerServing
+char peerServing[16];       // Fichier en cours d'envoi a un pair, "" sinon
+
+// Requete en cours de la boucle principale, renseignee par la tache reseau
+struct PeerWant
+{
+  uint32_t key;
+  bool have, failed;
+  IPAddress ip;
+  uint16_t port;
+  uint32_t size;
+  uint8_t sha[32];
+  uint64_t fetcher; // Plus petit id concurrent vu, 0 si aucun
+};
+PeerWant peerWant;
+uint32_t peerFetching = 0; // Cle telechargee sur le WAN par cette passerelle
+uint64_t peerId;
+WiFiUDP peerUdp; // Tache reseau : reception et reponses
+WiFiUDP peerOut; // Boucle principale : requetes et annonces
+WiFiServer peerServer(PEER_HTTP_PORT);
+
+uint32_t peerKey(const String &url)
+{
+  return esp_rom_crc32_le(0, (const uint8_t *)url.c_str(), url.length());
+}
+
+bool fileSHA256(const char *path, uint8_t *digest, uint32_t *size)
+{
+  File f = LittleFS.open(path, "r");
+  uint8_t buf[512];
+  mbedtls_sha256_context ctx;
+  *size = 0;
+  if (!f)
+    return false;
+  mbedtls_sha256_init(&ctx);
+  mbedtls_sha256_starts(&ctx, 0);
+  while (f.available())
+  {
+    int n = f.read(buf, sizeof(buf));
+    mbedtls_sha256_update(&ctx, buf, n);
+    *size += n;
+  }
+  f.close();
+  mbedtls_sha256_finish(&ctx, digest);
+  mbedtls_sha256_free(&ctx);
+  return true;
+}
+
+void peerSend(WiFiUDP &udp, uint8_t type, uint32_t key, const uint8_t *data, size_t n, IPAddress to)
+{
+  uint8_t msg[9 + 38];
+  memcpy(msg, "FPC1", 4);
+  msg[4] = type;
+  memcpy(&msg[5], &key, 4);
+  memcpy(&msg[9], data, n);
+  udp.beginPacket(to, PEER_UDP_PORT);
+  udp.write(msg, 9 + n);
+  udp.endPacket();
+}
+
+void peerAnnounce(WiFiUDP &udp, const PeerFile &p, IPAddress to)
+{
+  uint8_t data[38];
+  uint16_t port = PEER_HTTP_PORT;
+  memcpy(data, &p.size, 4);
+  memcpy(&data[4], &port, 2);
+  memcpy(&data[6], p.sha, 32);
+  peerSend(udp, PEER_HAVE, p.key, data, sizeof(data), to);
+}
+
+PeerFile *peerFind(uint32_t key)
+{
+  for (int i = 0; i < PEER_MAX_FILES; i++)
+    if (peerFiles[i].path[0] && peerFiles[i].key == key)
+      return &peerFiles[i];
+  return NULL;
+}
+
+// Prend peerLock une fois que path n'est plus en cours d'envoi a un pair
+void peerTakeIdle(const char *path)
+{
+  for (;;)
+  {
+    xSemaphoreTake(peerLock, portMAX_DELAY);
+    if (strcmp(peerServing, path) != 0)
+      return;
+    xSemaphoreGive(peerLock);
+    vTaskDelay(pdMS_TO_TICKS(10));
+  }
+}
+
+// A appeler avant d'ecrire ou de supprimer path : attend la fin d'un
+// transfert en cours vers un pair
+void peerForget(const char *path)
+{
+  peerTakeIdle(path);
+  for (int i = 0; i < PEER_MAX_FILES; i++)
+    if (strcmp(peerFiles[i].path, path) == 0)
+      peerFiles[i].path[0] = 0;
+  xSemaphoreGive(peerLock);
+}
+
+// Remplace to par from sans qu'un pair puisse lire l'un des deux entre-temps
+void moveFile(const char *from, const char *to)
+{
+  peerForget(to);
+  peerTakeIdle(from);
+  LittleFS.remove(to);
+  LittleFS.rename(from, to);
+  for (int i = 0; i < PEER_MAX_FILES; i++)
+    if (strcmp(peerFiles[i].path, from) == 0)
+      strlcpy(peerFiles[i].path, to, sizeof(peerFiles[i].path));
+  xSemaphoreGive(peerLock);
+}
+
+// Fichier verifie : il devient servable et les pairs en attente sont prevenus
+void peerPublish(uint32_t key, const char *path)
+{
+  PeerFile p;
+  p.key = key;
+  strlcpy(p.path, path, sizeof(p.path));
+  if (!fileSHA256(path, p.sha, &p.size))
+    return;
+  peerForget(path);
+  xSemaphoreTake(peerLock, portMAX_DELAY);
+  PeerFile *slot = peerFind(key);
+  for (int i = 0; !slot && i < PEER_MAX_FILES; i++)
+    if (!peerFiles[i].path[0])
+      slot = &peerFiles[i];
+  if (!slot)
+    slot = &peerFiles[0];
+  *slot = p;
+  xSemaphoreGive(peerLock);
+  peerAnnounce(peerOut, p, WiFi.broadcastIP());
+}
+
+void peerOnPacket()
+{
+  uint8_t msg[9 + 38];
+  int n = peerUdp.read(msg, sizeof(msg));
+  uint32_t key;
+  if (n < 9 || memcmp(msg, "FPC1", 4) != 0)
+    return;
+  memcpy(&key, &msg[5], 4);
+  IPAddress from = peerUdp.remoteIP();
+  if (from == WiFi.localIP())
+    return; // Nos propres broadcasts
+
+  xSemaphoreTake(peerLock, portMAX_DELAY);
+  if (msg[4] == PEER_WANT)
+  {
+    PeerFile *p = peerFind(key);
+    if (p)
+      peerAnnounce(peerUdp, *p, from);
+    else if (peerFetching == key)
+      peerSend(peerUdp, PEER_FETCH, key, (uint8_t *)&peerId, 8, from);
+  }
+  else if (key == peerWant.key)
+  {
+    if (msg[4] == PEER_HAVE && n == 9 + 38 && !peerWant.have)
+    {
+      peerWant.ip = from;
+      memcpy(&peerWant.size, &msg[9], 4);
+      memcpy(&peerWant.port, &msg[13], 2);
+      memcpy(peerWant.sha, &msg[15], 32);
+      peerWant.have = true;
+    }
+    else if (msg[4] == PEER_FETCH && n == 9 + 8)
+    {
+      uint64_t id;
+      memcpy(&id, &msg[9], 8);
+      if (peerWant.fetcher == 0 || id < peerWant.fetcher)
+        peerWant.fetcher = id;
+    }
+    else if (msg[4] == PEER_FAILED)
+      peerWant.failed = true;
+  }
+  xSemaphoreGive(peerLock);
+}
+
+// Un client a la fois ; GET /<cle hex>, "Range: bytes=debut-[fin]" accepte.
+// peerLock n'est tenu que pour trouver et ouvrir le fichier : peerServing
+// le protege ensuite des ecritures (peerForget attend la fin de l'envoi)
+void peerServe(WiFiClient &c)
+{
+  uint32_t key = 0, start = 0, end = UINT32_MAX, size = 0;
+  bool ranged = false;
+  String line = c.readStringUntil('\n');
+  if (line.startsWith("GET /"))
+    key = strtoul(line.c_str() + 5, NULL, 16);
+  while (c.connected())
+  {
+    line = c.readStringUntil('\n');
+    line.trim();
+    if (line.length() == 0)
+      break;
+    if (line.startsWith("Range: bytes="))
+    {
+      ranged = true;
+      start = line.substring(13).toInt();
+      int dash = line.indexOf('-');
+      if (dash > 0 && dash + 1 < (int)line.length())
+        end = line.substring(dash + 1).toInt();
+    }
+  }
+
+  xSemaphoreTake(peerLock, portMAX_DELAY);
+  PeerFile *p = peerFind(key);
+  File f = p ? LittleFS.open(p->path, "r") : File();
+  if (f)
+  {
+    size = p->size;
+    strlcpy(peerServing, p->path, sizeof(peerServing));
+  }
+  xSemaphoreGive(peerLock);
+
+  if (!f || start >= size || end < start)
+  {
+    c.print(f ? "HTTP/1.1 416 Range Not Satisfiable\r\n" : "HTTP/1.1 404 Not Found\r\n");
+    c.print("Content-Length: 0\r\nConnection: close\r\n\r\n");
+  }
+  else
+  {
+    end = min(end, size - 1);
+    c.print(ranged ? "HTTP/1.1 206 Partial Content\r\n" : "HTTP/1.1 200 OK\r\n");
+    if (ranged)
+      c.print("Content-Range: bytes " + String(start) + "-" + String(end) + "/" + String(size) + "\r\n");
+    c.print("Content-Length: " + String(end - start + 1) + "\r\nConnection: close\r\n\r\n");
+    uint8_t buf[1024];
+    uint32_t left = end - start + 1;
+    f.seek(start);
+    while (left > 0 && c.connected())
+    {
+      int n = f.read(buf, min(left, (uint32_t)sizeof(buf)));
+      if (n <= 0)
+        break;
+      c.write(buf, n);
+      left -= n;
+    }
+  }
+  if (f)
+  {
+    f.close();
+    xSemaphoreTake(peerLock, portMAX_DELAY);
+    peerServing[0] = 0;
+    xSemaphoreGive(peerLock);
+  }
+  c.stop();
+}
+
+// Tache reseau sur le coeur 0 : les pairs sont servis meme pendant un flashage
+void peerTask(void *)
+{
+  peerUdp.begin(PEER_UDP_PORT);
+  peerServer.begin();
+  for (;;)
+  {
+    if (peerUdp.parsePacket())
+      peerOnPacket();
+    WiFiClient c = peerServer.available();
+    if (c)
+      peerServe(c);
+    vTaskDelay(pdMS_TO_TICKS(5));
+  }
+}
+
+void peerBegin()
+{
+  peerId = ESP.getEfuseMac();
+  peerLock = xSemaphoreCreateMutex();
+  xTaskCreatePinnedToCore(peerTask, "peer", 6144, NULL, 1, NULL, 0);
+}
+
+// Copie depuis un pair, reprise par Range apres une coupure, puis controle du hash
+bool peerDownload(const PeerWant &w, uint32_t key, const char *path)
+{
+  String url = "http://" + w.ip.toString() + ":" + String(w.port) + "/" + String(key, HEX);
+  uint8_t digest[32];
+  uint32_t size = 0;
+  logM("Download: " + url);
+  File f = LittleFS.open(path, "w");
+  f.close();
+  for (int attempt = 0; attempt < PEER_RETRIES; attempt++)
+  {
+    f = LittleFS.open(path, "a");
+    uint32_t have = f.size();
+    if (have >= w.size)
+    {
+      f.close();
+      break;
+    }
+    WiFiClient c;
+    HTTPClient http;
+    http.begin(c, url);
+    if (have)
+      http.addHeader("Range", "bytes=" + String(have) + "-");
+    int code = http.GET();
+    if (code == HTTP_CODE_OK && have)
+    {
+      // Range ignore : on repart du debut
+      f.close();
+      f = LittleFS.open(path, "w");
+    }
+    if (code == HTTP_CODE_OK || code == HTTP_CODE_PARTIAL_CONTENT)
+      http.writeToStream(&f);
+    f.close();
+    http.end();
+  }
+  if (fileSHA256(path, digest, &size) && size == w.size && memcmp(digest, w.sha, 32) == 0)
+  {
+    logM("Download OK (peer " + w.ip.toString() + ")");
+    return true;
+  }
+  logM("Peer copy failed hash check");
+  LittleFS.remove(path);
+  return false;
+}
+
+// Attend une condition sur peerWant (tache prepTask : la boucle MQTT tourne a cote)
+bool peerWait(uint32_t ms, bool (*done)(const PeerWant &))
+{
+  uint32_t start = millis();
+  while (millis() - start < ms)
+  {
+    xSemaphoreTake(peerLock, portMAX_DELAY);
+    bool ok = done(peerWant);
+    xSemaphoreGive(peerLock);
+    if (ok)
+      return true;
+    vTaskDelay(pdMS_TO_TICKS(10));
+  }
+  return false;
+}
+
+bool peerHasCopy(const PeerWant &w) { return w.have; }
+bool peerSettled(const PeerWant &w) { return w.have || w.failed; }
+
+// Telechargement direct (WAN, TLS)
+bool wanDownload(const String &url, const char *path)
+{
+  logM("Download: " + url);
+  WiFiClientSecure sClient;
+  sClient.setInsecure();
+  HTTPClient http;
+  http.begin(sClient, url);
+
+  if (http.GET() == HTTP_CODE_OK)
+  {
+    File f = LittleFS.open(path, "w");
+    http.writeToStream(&f);
+    f.close();
+    http.end();
+    logM("Download OK");
+    return true;
+  }
+  logM("Download Failed");
+  http.end();
+  return false;
+}
+
+// Pair d'abord, WAN ensuite ; le fichier obtenu est a son tour servi aux pairs
+bool downloadFile(const String &url, const char *path)
+{
+  uint32_t key = peerKey(url);
+  PeerWant w;
+  peerForget(path);
+
+  xSemaphoreTake(peerLock, portMAX_DELAY);
+  peerWant = PeerWant();
+  peerWant.key = key;
+  xSemaphoreGive(peerLock);
+  peerSend(peerOut, PEER_WANT, key, NULL, 0, WiFi.broadcastIP());
+  peerWait(PEER_QUERY_MS, peerHasCopy);
+
+  // Personne n'a le fichier : on se propose, un id plus petit garde la main
+  xSemaphoreTake(peerLock, portMAX_DELAY);
+  bool claim = !peerWant.have && peerWant.fetcher == 0;
+  if (claim)
+    peerFetching = key;
+  xSemaphoreGive(peerLock);
+  if (claim)
+  {
+    peerSend(peerOut, PEER_FETCH, key, (uint8_t *)&peerId, 8, WiFi.broadcastIP());
+    peerWait(PEER_CLAIM_MS, peerHasCopy);
+    xSemaphoreTake(peerLock, portMAX_DELAY);
+    claim = !peerWant.have && (peerWant.fetcher == 0 || peerWant.fetcher > peerId);
+    if (!claim)
+      peerFetching = 0;
+    xSemaphoreGive(peerLock);
+  }
+  if (!claim && !peerWant.have)
+  {
+    logM("Peer download in progress, waiting");
+    peerWait(PEER_WAIT_MS, peerSettled);
+  }
+  xSemaphoreTake(peerLock, portMAX_DELAY);
+  w = peerWant;
+  peerWant.key = 0;
+  xSemaphoreGive(peerLock);
+
+  bool ok = (!claim && w.have && peerDownload(w, key, path)) || wanDownload(url, path);
+  xSemaphoreTake(peerLock, portMAX_DELAY);
+  peerFetching = 0;
+  xSemaphoreGive(peerLock);
+  if (ok)
+    peerPublish(key, path);
+  else if (claim)
+    peerSend(peerOut, PEER_FAILED, key, NULL, 0, WiFi.broadcastIP());
+  return ok;
+}
+
+// --- TACHES FOTA ---
+
+// CRC-32 standard (zlib) d'un fichier, calcule par la ROM de l'ESP32
+uint32_t fileCRC32(const char *path, uint32_t *size)
+{
+  File f = LittleFS.open(path, "r");
+  uint8_t buf[512];
+  uint32_t crc = 0;
+  *size = 0;
+  if (!f)
+    return 0;
+  while (f.available())
+  {
+    int n = f.read(buf, sizeof(buf));
+    crc = esp_rom_crc32_le(crc, buf, n);
+    *size += n;
+  }
+  f.close();
+  return crc;
+}
+
+/*
+ * Applique un patch FDP1 (genere par tools/fwdelta.py) sur l'image installee.
+ * Le patch est lu en flux : seules les operations COPY/INSERT courantes et un
+ * buffer de 512 octets sont en RAM. Le resultat est ecrit dans FILE_UPDATE.
+ */
+bool applyPatch(const char *basePath, const char *patchPath, const char *outPath)
+{
+  peerForget(outPath);
+  uint32_t baseSize = 0;
+  uint32_t baseCRC = fileCRC32(basePath, &baseSize);
+
+  File patch = LittleFS.open(patchPath, "r");
+  if (!patch)
+    return false;
+
+  uint8_t hdr[20];
+  uint32_t hBaseSize, hBaseCRC, targetSize, targetCRC;
+  if (patch.read(hdr, sizeof(hdr)) != sizeof(hdr) || memcmp(hdr, "FDP1", 4) != 0)
+  {
+    logM("Patch: bad header");
+    patch.close();
+    return false;
+  }
+  memcpy(&hBaseSize, &hdr[4], 4);
+  memcpy(&hBaseCRC, &hdr[8], 4);
+  memcpy(&targetSize, &hdr[12], 4);
+  memcpy(&targetCRC, &hdr[16], 4);
+
+  if (hBaseSize != baseSize || hBaseCRC != baseCRC)
+  {
+    logM("Patch: base mismatch (installed CRC " + String(baseCRC, HEX) + ")");
+    patch.close();
+    return false;
+  }
+
+  File base = LittleFS.open(basePath, "r");
+  File out = LittleFS.open(outPath, "w");
+  uint8_t buf[512];
+  uint32_t written = 0, crc = 0;
+  bool ok = true;
+
+  while (ok && written < targetSize)
+  {
+    uint8_t op = 0;
+    uint32_t arg[2] = {0, 0};
+    if (patch.read(&op, 1) != 1)
+      break;
+
+    if (op == 0x01) // COPY base_offset, length
+    {
+      ok = patch.read((uint8_t *)arg, 8) == 8 && base.seek(arg[0]);
+      for (uint32_t left = arg[1]; ok && left > 0;)
+      {
+        int n = base.read(buf, min((uint32_t)sizeof(buf), left));
+        ok = n > 0;
+        if (ok)
+        {
+          out.write(buf, n);
+          crc = esp_rom_crc32_le(crc, buf, n);
+          left -= n;
+          written += n;
+        }
+      }
+    }
+    else if (op == 0x02) // INSERT length, data
+    {
+      ok = patch.read((uint8_t *)arg, 4) == 4;
+      for (uint32_t left = arg[0]; ok && left > 0;)
+      {
+        int n = patch.read(buf, min((uint32_t)sizeof(buf), left));
+        ok = n > 0;
+        if (ok)
+        {
+          out.write(buf, n);
+          crc = esp_rom_crc32_le(crc, buf, n);
+          left -= n;
+          written += n;
+        }
+      }
+    }
+    else
+      ok = false;
+  }
+  base.close();
+  out.close();
+  patch.close();
+
+  if (!ok || written != targetSize || crc != targetCRC)
+  {
+    logM("Patch: apply failed");
+    return false;
+  }
+  logM("Patch OK: " + String(targetSize) + " bytes");
+  return true;
+}
+
+// --- SAUVEGARDE DE L'APPLICATION (MEM_READ) ---
+// Une requete couvre toute la plage : le bootloader enchaine les blocs sans
+// attendre, la liaison reste pleine. Un bloc corrompu relance la lecture a
+// partir de lui, les blocs deja recus sont gardes.
+bool readFlash(uint32_t addr, uint32_t len, File &out)
+{
+  uint8_t req[4];
+  uint8_t block[2 + PROTO_READ_BLOCK + PROTO_CRC_SIZE];
+  int retries = 0;
+
+  while (len > 0)
+  {
+    Response resp;
+    Proto_Put_U32(req, len);
+    sendPacket(PROTO_CMD_MEM_READ, addr, req, sizeof(req));
+    if (readResponse(RTO_MAX, &resp) != RESP_OK || resp.len < 1 || resp.data[0] != STATUS_ADDR_VALID)
+      return false;
+
+    bool bad = false;
+    while (len > 0 && !bad)
+    {
+      uint8_t n = len > PROTO_READ_BLOCK ? PROTO_READ_BLOCK : len;
+      // ACK | n | data[n] | crc
+      if (!portReadBytes(block, 2 + n + PROTO_CRC_SIZE, 100) || block[0] != PROTO_ACK || block[1] != n ||
+          Proto_Crc(&block[2], n) != Proto_Get_U32(&block[2 + n]))
+        bad = true;
+      else
+      {
+        out.write(&block[2], n);
+        addr += n;
+        len -= n;
+        retries = 0;
+      }
+    }
+    if (bad)
+    {
+      if (++retries > MAX_RETRIES)
+        return false;
+      portDrain(20); // Fin du flux en cours avant de redemander
+    }
+  }
+  return true;
+}
+
+// Copie locale de l'application valide de la cible (bootloader deja actif)
+bool snapshotApp()
+{
+  Response resp;
+  uint8_t req[4] = {0};
+
+  // Longueur nulle : seulement le statut et la taille de l'application
+  sendPacket(PROTO_CMD_MEM_READ, ADDR_APP, req, sizeof(req));
+  if (readResponse(RTO_MAX, &resp) != RESP_OK || resp.len < 5 || resp.data[0] != STATUS_ADDR_VALID)
+  {
+    logM("Backup: no MEM_READ support");
+    return false;
+  }
+  uint32_t size = Proto_Get_U32(&resp.data[1]);
+  if (size == 0)
+  {
+    logM("Backup: no valid application");
+    return false;
+  }
+
+  File f = LittleFS.open(FILE_BACKUP ".tmp", "w");
+  uint32_t start = millis();
+  bool ok = f && readFlash(ADDR_APP, size, f);
+  f.close();
+  uint32_t ms = millis() - start;
+  if (!ok)
+  {
+    LittleFS.remove(FILE_BACKUP ".tmp");
+    logM("Backup FAILED");
+    return false;
+  }
+  LittleFS.remove(FILE_BACKUP);
+  LittleFS.rename(FILE_BACKUP ".tmp", FILE_BACKUP);
+  logM("Backup: " + String(size) + " bytes in " + String(ms) + " ms (" + String(ms ? size * 1000 / ms : 0) + " B/s)");
+  return true;
+}
+
+void handleBackup()
+{
+  resetSTM32();
+  snapshotApp();
+}
+
+// Conserve l'image flashee comme base des prochains patchs
+void commitCurrentImage()
+{
+  moveFile(FILE_UPDATE, FILE_CURRENT);
+}
+
+// Sauvegarde sur demande ("erase backup") : relire toute l'application
+// coute ~20 s a 115200 bauds pour 224 KB, a chaque mise a jour sinon.
+// Jamais pour un rollback (l'application en place est celle a remplacer)
+void handleErase(bool backup = false)
+{
+  resetSTM32();
+  if (backup)
+    snapshotApp();
+  logM("Erasing Flash...");
+  sendPacket(PROTO_CMD_FLASH_ERASE, 0xFFFFFFFF, NULL, 0); // Effacement de toute l'application
+  if (waitStatus(STATUS_ERASE_OK, 10000) == RESP_OK)
+    logM("Erase Success");
+  else
+    logM("Erase Failed");
+}
+
+void reportProgress(File &f, long total)
+{
+  client.loop(); // Keep MQTT alive
+  client.publish(topicStatus.c_str(), String("Progress: " + String((f.position() * 100) / total) + "%").c_str());
+}
+
+// Image brute : blocs de taille adaptative ecrits a partir de ADDR_APP
+bool sendRawImage(File &f, long total)
+{
+  uint32_t addr = ADDR_APP;
+  uint8_t buf[CHUNK_MAX];
+  int pkts = 0;
+
+  while (f.available())
+  {
+    int len = f.read(buf, linkCtl.chunk);
+    mbedtls_sha256_update(&streamHash, buf, len);
+    if (!sendWithRetry(PROTO_CMD_MEM_WRITE, addr, buf, len))
+      return false;
+
+    addr += len;
+    if (++pkts % 20 == 0)
+      reportProgress(f, total);
+  }
+  return true;
+}
+
+// Lecture d'un conteneur : tout octet lu (entete, adresses, longueurs,
+// donnees) entre dans fileHash, le digest signe du fichier
+int hashedRead(File &f, uint8_t *buf, size_t n)
+{
+  int len = f.read(buf, n);
+  if (len > 0)
+    mbedtls_sha256_update(&fileHash, buf, len);
+  return len;
+}
+
+// Conteneur FWZ1 (tools/fwpack.py) : chaque record est transmis tel quel et
+// decompresse par le bootloader directement en Flash
+bool sendCompressedImage(File &f, long total)
+{
+  uint8_t buf[255];
+  int pkts = 0;
+
+  if (hashedRead(f, buf, 20) != 20) // Entete FWZ1
+    return false;
+  while (f.available())
+  {
+    uint32_t addr;
+    uint8_t clen;
+    if (hashedRead(f, (uint8_t *)&addr, 4) != 4 || hashedRead(f, &clen, 1) != 1 || hashedRead(f, buf, clen) != clen)
+    {
+      logM("FWZ1: truncated record");
+      return false;
+    }
+    mbedtls_sha256_update(&streamHash, buf, clen);
+    // Records de taille fixe (tools/fwpack.py --block) : seules les reprises s'appliquent
+    if (!sendWithRetry(PROTO_CMD_MEM_WRITE_LZ, addr, buf, clen))
+      return false;
+
+    if (++pkts % 20 == 0)
+      reportProgress(f, total);
+  }
+  return true;
+}
+
+// Conteneur FSG1 (tools/fwseg.py) : seuls les segments utiles sont envoyes,
+// chacun a sa propre adresse ; les trous et les zones 0xFF sont sautes
+bool sendSegmentedImage(File &f, long total)
+{
+  uint8_t buf[CHUNK_MAX];
+  uint32_t count = 0;
+  int pkts = 0;
+
+  if (hashedRead(f, buf, 12) != 12) // Entete FSG1
+    return false;
+  memcpy(&count, &buf[4], 4);
+  for (uint32_t s = 0; s < count; s++)
+  {
+    uint32_t addr, segLen;
+    if (hashedRead(f, (uint8_t *)&addr, 4) != 4 || hashedRead(f, (uint8_t *)&segLen, 4) != 4)
+    {
+      logM("FSG1: truncated segment");
+      return false;
+    }
+    while (segLen > 0)
+    {
+      int len = hashedRead(f, buf, min((uint32_t)linkCtl.chunk, segLen));
+      if (len <= 0)
+        return false;
+      mbedtls_sha256_update(&streamHash, buf, len);
+      if (!sendWithRetry(PROTO_CMD_MEM_WRITE, addr, buf, len))
+        return false;
+      addr += len;
+      segLen -= len;
+      if (++pkts % 20 == 0)
+        reportProgress(f, total);
+    }
+  }
+  return true;
+}
+
+// Taille de l'image telle qu'elle sera en Flash a partir de ADDR_APP
+uint32_t imageSize(File &f, bool packed, bool sparse)
+{
+  uint32_t size = f.size();
+
+  if (packed) // FWZ1 : taille de l'image brute dans l'entete
+  {
+    f.seek(8);
+    f.read((uint8_t *)&size, 4);
+  }
+  else if (sparse) // FSG1 : fin du dernier segment
+  {
+    uint32_t count = 0, addr = ADDR_APP, segLen = 0;
+    f.seek(4);
+    f.read((uint8_t *)&count, 4);
+    f.seek(12);
+    for (uint32_t s = 0; s < count; s++)
+    {
+      f.read((uint8_t *)&addr, 4);
+      f.read((uint8_t *)&segLen, 4);
+      f.seek(segLen, SeekCur);
+    }
+    size = addr + segLen - ADDR_APP;
+  }
+  return size;
+}
+
+// Signature ECDSA P-256 (DER, tools/fwsign.py) du SHA-256 du fichier image
+// (en-tete et table seulement pour un manifeste FMF1)
+bool verifySignature(const char *sigPath, const uint8_t *digest)
+{
+  uint8_t sig[MBEDTLS_ECDSA_MAX_LEN];
+  File f = LittleFS.open(sigPath, "r");
+  if (!f)
+    return false;
+  size_t sigLen = f.read(sig, sizeof(sig));
+  f.close();
+
+  mbedtls_pk_context pk;
+  mbedtls_pk_init(&pk);
+  bool ok = mbedtls_pk_parse_public_key(&pk, (const unsigned char *)FW_PUBLIC_KEY, sizeof(FW_PUBLIC_KEY)) == 0 &&
+            mbedtls_pk_verify(&pk, MBEDTLS_MD_SHA256, digest, 32, sig, sigLen) == 0;
+  mbedtls_pk_free(&pk);
+  return ok;
+}
+
+// staged : l'image est envoyee a UpdateAgent dans l'application en marche,
+// qui la depose en staging ; le bootloader l'installe au redemarrage final
+bool flashImage(const char *path, const char *sigPath, bool staged = false)
+{
+  File f = LittleFS.open(path, "r");
+  long total = f.size();
+  uint8_t magic[4] = {0};
+  f.read(magic, 4);
+  f.seek(0);
+  bool packed = memcmp(magic, "FWZ1", 4) == 0;
+  bool sparse = memcmp(magic, "FSG1", 4) == 0;
+  logM(String(staged ? "Staging " : "Flashing ") + String(total) + (packed ? " compressed" : sparse ? " sparse" : "") + " bytes...");
+
+  if (!staged)
+    resetSTM32();
+  else
+  {
+    if (packed)
+    {
+      logM("Stage: FWZ1 images need the bootloader, send a raw or FSG1 image");
+      f.close();
+      return false;
+    }
+    // Pas de reset : l'application continue de tourner pendant le transfert.
+    // La taille part avec l'effacement : l'agent refuse d'entree une image
+    // qui ne tient pas en staging
+    uint8_t sizeField[4];
+    Proto_Put_U32(sizeField, imageSize(f, packed, sparse));
+    f.seek(0);
+    portPurge();
+    sendPacket(PROTO_CMD_FLASH_ERASE, 0xFFFFFFFF, sizeField, sizeof(sizeField));
+    Response resp;
+    RespResult r = readResponse(5000, &resp);
+    if (r != RESP_OK || resp.len < 1 || resp.data[0] != STATUS_ERASE_OK)
+    {
+      logM(r == RESP_OK && resp.len >= 1 && resp.data[0] == STATUS_ERASE_REJECTED
+               ? "Stage: image larger than the target's staging area"
+               : "Stage: no update agent answering");
+      f.close();
+      return false;
+    }
+  }
+
+  // Le SHA-256 est calcule au fil de l'envoi, comme cote bootloader :
+  // aucune passe supplementaire sur l'image. Image brute : flux et fichier
+  // sont les memes octets ; FWZ1 / FSG1 : la signature couvre le fichier,
+  // adresses et tailles comprises, pas seulement les charges utiles
+  mbedtls_sha256_init(&streamHash);
+  mbedtls_sha256_starts(&streamHash, 0);
+  mbedtls_sha256_init(&fileHash);
+  mbedtls_sha256_starts(&fileHash, 0);
+  linkReset();
+
+  bool ok = packed   ? sendCompressedImage(f, total)
+            : sparse ? sendSegmentedImage(f, total)
+                     : sendRawImage(f, total);
+  linkReport();
+
+  uint8_t info[4 + 32], fileDigest[32];
+  mbedtls_sha256_finish(&streamHash, &info[4]);
+  mbedtls_sha256_free(&streamHash);
+  mbedtls_sha256_finish(&fileHash, fileDigest);
+  mbedtls_sha256_free(&fileHash);
+
+  // sigPath NULL : image relue sur la cible elle-meme (FILE_BACKUP), pas de signature
+  if (ok && REQUIRE_SIGNATURE && sigPath != NULL && !verifySignature(sigPath, packed || sparse ? fileDigest : &info[4]))
+  {
+    logM("Signature INVALID, image not marked bootable");
+    ok = false;
+  }
+
+  // Le bootloader compare ce digest au sien puis marque l'image demarrable :
+  // les prochains demarrages sautent directement a l'application
+  if (ok)
+  {
+    uint32_t size = imageSize(f, packed, sparse);
+    Proto_Put_U32(info, size);
+    if (commandWithRetry(PROTO_CMD_SET_APP_INFO, ADDR_APP, info, sizeof(info), STATUS_APP_SAVED) != RESP_OK)
+    {
+      logM("App info rejected");
+      ok = false;
+    }
+  }
+  f.close();
+  if (!ok)
+    return false;
+
+  logM(staged ? "Rebooting to install staged image..." : "Jumping to App...");
+  if (commandWithRetry(PROTO_CMD_GO_TO_ADDR, ADDR_APP, NULL, 0, STATUS_ADDR_VALID) != RESP_OK)
+    return false;
+  logM("Update FINISHED");
+  return true;
+}
+
+// La signature est recuperee avant de toucher a la cible
+bool downloadSignature(const String &url)
+{
+  peerForget(FILE_SIG);
+  LittleFS.remove(FILE_SIG);
+  return downloadFile(url + ".sig", FILE_SIG) || !REQUIRE_SIGNATURE;
+}
+
+// Image complete dans FILE_UPDATE, signature dans FILE_SIG
+bool prepareImage(const String &url)
+{
+  return downloadSignature(url) && downloadFile(url, FILE_UPDATE);
+}
+
+// Mise a jour delta : seul le patch est telecharge, l'image complete est
+// reconstruite localement a partir de FILE_CURRENT puis flashee normalement.
+bool preparePatch(const String &url)
+{
+  if (!LittleFS.exists(FILE_CURRENT))
+  {
+    logM("Patch: no base image, send a full update first");
+    return false;
+  }
+  if (!downloadSignature(url) || !downloadFile(url, FILE_PATCH))
+    return false;
+  bool ok = applyPatch(FILE_CURRENT, FILE_PATCH, FILE_UPDATE);
+  peerForget(FILE_PATCH);
+  LittleFS.remove(FILE_PATCH);
+  return ok;
+}
+
+// Les handlers suivants flashent l'image deja preparee (file de commandes)
+void handleUpload()
+{
+  if (flashImage(FILE_UPDATE, FILE_SIG))
+    commitCurrentImage();
+}
+
+// Mise a jour sans arret : seul le redemarrage final interrompt l'application
+void handleStage()
+{
+  if (flashImage(FILE_UPDATE, FILE_SIG, true))
+    commitCurrentImage();
+}
+
+// Retour local a l'application sauvegardee avant le dernier effacement :
+// ni telechargement ni signature, l'image vient de la cible
+void handleRollback()
+{
+  if (!LittleFS.exists(FILE_BACKUP))
+  {
+    logM("Rollback: no backup");
+    return;
+  }
+  handleErase();
+  if (flashImage(FILE_BACKUP, NULL))
+  {
+    // L'application en place redevient la base des patchs
+    moveFile(FILE_BACKUP, FILE_CURRENT);
+  }
+}
+
+// --- BUS MULTIPOINT (RS-485) ---
+// Plusieurs cibles sur la meme ligne, reset commun. Sans SELECT, chaque
+// bootloader se comporte en point a point : les commandes ci-dessus restent
+// valables avec une seule carte branchee.
+#define MAX_NODES 32
+#define BUS_REPLY_WINDOW 20 // ms d'ecoute apres une requete DISCOVER / SELECT
+#define BUS_WORD_PROGRAM_US 100 // tPROG x32 maximal (F401 : 16 us typique)
+#define BUS_CPU_US_PER_BYTE 1   // CRC + SHA-256 de la trame sur la cible
+#define BUS_GAP_MARGIN_US 500   // Decodage, dispersion entre noeuds
+#define BUS_ERASE_TIMEOUT 10000
+#define BUS_BITMAP_SIZE 512 // CBL_BUS_BITMAP_SIZE du bootloader
+
+uint32_t busNodes[MAX_NODES];
+int busNodeCount = 0;
+
+void busLoadNodes()
+{
+  File f = LittleFS.open(FILE_NODES, "r");
+  busNodeCount = 0;
+  if (!f)
+    return;
+  uint8_t id[4];
+  while (busNodeCount < MAX_NODES && f.read(id, 4) == 4)
+    busNodes[busNodeCount++] = Proto_Get_U32(id);
+  f.close();
+}
+
+void busSaveNodes()
+{
+  File f = LittleFS.open(FILE_NODES, "w");
+  for (int i = 0; i < busNodeCount; i++)
+  {
+    uint8_t id[4];
+    Proto_Put_U32(id, busNodes[i]);
+    f.write(id, 4);
+  }
+  f.close();
+}
+
+// Tout ce qui arrive pendant la fenetre d'ecoute
+size_t busCollect(uint8_t *buf, size_t max, uint32_t window)
+{
+  size_t n = 0;
+  uint32_t start = millis();
+  while (millis() - start < window)
+    if (portAvailable())
+    {
+      uint8_t b = portRead();
+      if (n < max)
+        buf[n] = b;
+      n++;
+    }
+  return n;
+}
+
+// Dichotomie sur les identifiants : une plage qui repond proprement contient
+// un seul noeud, une reponse brouillee (collision) est coupee en deux
+void busDiscover(uint32_t lo, uint32_t hi)
+{
+  uint8_t req[4], reply[16];
+  if (busNodeCount >= MAX_NODES)
+    return;
+  client.loop();
+  Proto_Put_U32(req, hi);
+  sendPacket(PROTO_CMD_DISCOVER, lo, req, sizeof(req));
+  size_t n = busCollect(reply, sizeof(reply), BUS_REPLY_WINDOW);
+  if (n == 0)
+    return;
+  if (n == 10 && reply[0] == PROTO_ACK && reply[1] == 8 &&
+      Proto_Crc(&reply[2], 4) == Proto_Get_U32(&reply[6]))
+  {
+    busNodes[busNodeCount++] = Proto_Get_U32(&reply[2]);
+    return;
+  }
+  if (lo == hi)
+  {
+    logM("Discover: garbled answers for node " + String(lo, HEX));
+    return;
+  }
+  uint32_t mid = lo + (hi - lo) / 2;
+  busDiscover(lo, mid);
+  busDiscover(mid + 1, hi);
+}
 
-// --- GLOBALS ---
-String gitURL = "https://raw.githubusercontent.com/youssef-bendhaou/projetsem/main/ota0.0.bin";
-WiFiClient espClient;
-PubSubClient client(espClient);
-bool doErase = false, doUpload = false;
+void handleDiscover()
+{
+  resetSTM32();
+  busNodeCount = 0;
+  uint32_t start = millis();
+  busDiscover(0, 0xFFFFFFFE); // PROTO_NODE_BROADCAST n'est jamais un identifiant
+  busSaveNodes();
+  String list = "";
+  for (int i = 0; i < busNodeCount; i++)
+    list += " " + String(busNodes[i], HEX);
+  logM("Discover: " + String(busNodeCount) + " nodes in " + String(millis() - start) + " ms:" + list);
+}
 
-// --- LOGGING (USB + MQTT) ---
-void logM(String msg)
+// Seul le noeud designe repondra ensuite
+bool busSelect(uint32_t node)
 {
-  Serial.println(msg);
-  if (client.connected())
-    client.publish(TOPIC_PUB, msg.c_str());
+  Response resp;
+  portPurge();
+  sendPacket(PROTO_CMD_SELECT, node, NULL, 0);
+  return readResponse(BUS_REPLY_WINDOW * 10, &resp) == RESP_OK && resp.len == 4 &&
+         Proto_Get_U32(resp.data) == node;
+}
+
+// Apres une trame diffusee, personne n'accuse reception : on attend que la
+// trame soit sortie (le tampon d'emission masquerait sa duree a la ligne),
+// puis le pire temps de traitement d'un noeud pour len octets de donnees.
+// Sans cela les octets suivants arrivent pendant la programmation et se perdent
+void busGap(uint8_t len)
+{
+  portFlush();
+  delayMicroseconds(((len + 3) / 4) * BUS_WORD_PROGRAM_US +
+                    (len + PROTO_OVERHEAD) * BUS_CPU_US_PER_BYTE + BUS_GAP_MARGIN_US);
+}
+
+// Tous les noeuds executent sans repondre ; bitmap en blocs de CHUNK_MAX
+void busBroadcast()
+{
+  uint8_t block[4];
+  Proto_Put_U32(block, CHUNK_MAX);
+  sendPacket(PROTO_CMD_SELECT, PROTO_NODE_BROADCAST, block, sizeof(block));
+  busGap(sizeof(block));
 }
 
-// --- OUTILS STM32 (CRC & Reset) ---
-uint32_t calcCRC(const uint8_t *data, size_t len)
+// Blocs absents du bitmap du noeud renvoyes avec accuse, puis validation
+bool busRepair(uint32_t node, File &f, uint32_t blocks, const uint8_t *info)
 {
-  uint32_t crc = 0xFFFFFFFF;
-  for (size_t i = 0; i < len; i++)
+  uint8_t bitmap[BUS_BITMAP_SIZE];
+  uint32_t bytes = (blocks + 7) / 8;
+  uint8_t buf[CHUNK_MAX];
+  int missing = 0;
+
+  if (!busSelect(node) || bytes > sizeof(bitmap))
+    return false;
+  for (uint32_t off = 0; off < bytes; off += PROTO_BITMAP_PAGE)
   {
-    crc ^= (uint32_t)data[i];
-    for (int j = 0; j < 32; j++)
-      crc = (crc & 0x80000000) ? (crc << 1) ^ 0x04C11DB7 : (crc << 1);
+    Response resp;
+    uint32_t want = min((uint32_t)PROTO_BITMAP_PAGE, bytes - off);
+    sendPacket(PROTO_CMD_GET_BITMAP, off, NULL, 0);
+    if (readResponse(RTO_MAX, &resp) != RESP_OK || resp.len < want)
+      return false;
+    memcpy(&bitmap[off], resp.data, want);
   }
-  return crc;
+
+  linkReset();
+  for (uint32_t b = 0; b < blocks; b++)
+  {
+    if (bitmap[b / 8] & (1 << (b % 8)))
+      continue;
+    missing++;
+    f.seek(b * CHUNK_MAX);
+    int len = f.read(buf, CHUNK_MAX);
+    if (!sendWithRetry(PROTO_CMD_MEM_WRITE, ADDR_APP + b * CHUNK_MAX, buf, len))
+      return false;
+  }
+
+  // Le bootloader hache l'image en Flash : les reparations arrivent dans le desordre
+  sendPacket(PROTO_CMD_SET_APP_INFO, ADDR_APP, info, 4 + 32);
+  bool ok = waitStatus(STATUS_APP_SAVED, 5000) == RESP_OK;
+  logM("Node " + String(node, HEX) + ": " + String(missing) + " blocks repaired, " + (ok ? "valid" : "REJECTED"));
+  return ok;
 }
 
-void resetSTM32()
+// Image brute diffusee une seule fois a tous les noeuds : la duree ne depend
+// presque plus du nombre de cartes, seules les reparations sont individuelles
+void handleFleet()
 {
-  logM(">>> Reset STM32...");
-  digitalWrite(PIN_RST, LOW);
-  delay(150);
-  digitalWrite(PIN_RST, HIGH);
-  delay(1000);
-  while (Serial1.available())
-    Serial1.read(); // Purge buffer
+  bool ok[MAX_NODES];
+  uint8_t buf[CHUNK_MAX], magic[4] = {0}, info[4 + 32];
+  int done = 0;
+
+  if (busNodeCount == 0)
+  {
+    logM("Fleet: no nodes, send 'nodes discover' first");
+    return;
+  }
+  File f = LittleFS.open(FILE_UPDATE, "r");
+  long total = f.size();
+  f.read(magic, 4);
+  f.seek(0);
+  if (memcmp(magic, "FWZ1", 4) == 0 || memcmp(magic, "FSG1", 4) == 0)
+  {
+    logM("Fleet: raw images only");
+    f.close();
+    return;
+  }
+  uint32_t start = millis();
+  resetSTM32();
+
+  // Effacement en parallele ; un noeud repond au SELECT une fois fini
+  busBroadcast();
+  sendPacket(PROTO_CMD_FLASH_ERASE, 0xFFFFFFFF, NULL, 0);
+  for (int i = 0; i < busNodeCount; i++)
+  {
+    ok[i] = false;
+    while (!ok[i] && millis() - start < BUS_ERASE_TIMEOUT)
+      ok[i] = busSelect(busNodes[i]);
+    if (!ok[i])
+      logM("Node " + String(busNodes[i], HEX) + ": no answer after erase");
+  }
+
+  logM("Fleet: broadcasting " + String(total) + " bytes to " + String(busNodeCount) + " nodes...");
+  busBroadcast();
+  mbedtls_sha256_init(&streamHash);
+  mbedtls_sha256_starts(&streamHash, 0);
+  uint32_t addr = ADDR_APP;
+  int pkts = 0;
+  while (f.available())
+  {
+    int len = f.read(buf, CHUNK_MAX);
+    mbedtls_sha256_update(&streamHash, buf, len);
+    sendPacket(PROTO_CMD_MEM_WRITE, addr, buf, len);
+    addr += len;
+    busGap(len);
+    if (++pkts % 50 == 0)
+      reportProgress(f, total);
+  }
+  mbedtls_sha256_finish(&streamHash, &info[4]);
+  mbedtls_sha256_free(&streamHash);
+  Proto_Put_U32(info, total);
+
+  if (REQUIRE_SIGNATURE && !verifySignature(FILE_SIG, &info[4]))
+  {
+    logM("Signature INVALID, no node marked bootable");
+    f.close();
+    return;
+  }
+
+  uint32_t blocks = (total + CHUNK_MAX - 1) / CHUNK_MAX;
+  for (int i = 0; i < busNodeCount; i++)
+  {
+    client.loop();
+    if (ok[i])
+      ok[i] = busRepair(busNodes[i], f, blocks, info);
+  }
+  f.close();
+
+  // Demarrage a la fin seulement : une application qui parle sur le bus
+  // ne gene plus aucune reparation
+  for (int i = 0; i < busNodeCount; i++)
+  {
+    if (!ok[i] || !busSelect(busNodes[i]))
+      continue;
+    sendPacket(PROTO_CMD_GO_TO_ADDR, ADDR_APP, NULL, 0);
+    if (waitStatus(STATUS_ADDR_VALID) == RESP_OK)
+      done++;
+  }
+  if (done == busNodeCount)
+    commitCurrentImage();
+  logM("Fleet: " + String(done) + "/" + String(busNodeCount) + " nodes updated in " + String(millis() - start) + " ms");
 }
 
-// --- COMMUNICATION UART ---
-void sendPacket(uint8_t cmd, uint32_t addr, uint8_t *payload, uint8_t len)
+// --- MANIFESTE MULTI-COMPOSANTS (FMF1) ---
+// Plusieurs regions Flash (application, configuration, tables...) decrites
+// par tools/fwmanifest.py, chacune avec sa version et son SHA-256. Seuls les
+// composants dont le hash differe de celui annonce par GET_COMPONENTS sont
+// effaces (leurs secteurs seulement) et reecrits.
+//   "FMF1" | nombre u8 | 3 octets reserves
+//   entree : id u8 | secteurs u8 | reserve u16 | version u32 | addr u32 |
+//            taille u32 | SHA-256 | nom[16]
+//   puis les contenus dans l'ordre des entrees
+// La signature (<url>.sig) porte sur le SHA-256 de l'entete et de la table.
+#define FMF_HEADER 8
+#define STATUS_COMP_SAVED 0x01 // APP_INFO_SAVED
+
+struct FmfEntry
 {
-  uint8_t buf[255];
-  buf[0] = 1 + 4 + 1 + len + 4; // Length field
-  buf[1] = cmd;
-  memcpy(&buf[2], &addr, 4); // Address (Little Endian natif ESP32)
-  buf[6] = len;
-  if (len > 0)
-    memcpy(&buf[7], payload, len);
+  uint8_t id;
+  uint8_t sectors; // Secteurs a effacer a partir de addr
+  uint16_t reserved;
+  uint32_t version, addr, size;
+  uint8_t sha[32];
+  char name[16];
+};
+static_assert(sizeof(FmfEntry) == 64, "FMF1 table entry");
+
+// Entete et table ; digest = SHA-256 signe
+bool manifestRead(File &f, FmfEntry *table, int *count, uint8_t *digest)
+{
+  uint8_t head[FMF_HEADER];
+  f.seek(0);
+  if (f.read(head, sizeof(head)) != sizeof(head) || memcmp(head, "FMF1", 4) != 0 ||
+      head[4] == 0 || head[4] > PROTO_MAX_COMPONENTS)
+    return false;
+  *count = head[4];
+  size_t tableSize = *count * sizeof(FmfEntry);
+  if (f.read((uint8_t *)table, tableSize) != tableSize)
+    return false;
 
-  uint32_t crc = calcCRC(&buf[1], 1 + 4 + 1 + len);
-  memcpy(&buf[7 + len], &crc, 4);
+  mbedtls_sha256_context ctx;
+  mbedtls_sha256_init(&ctx);
+  mbedtls_sha256_starts(&ctx, 0);
+  mbedtls_sha256_update(&ctx, head, sizeof(head));
+  mbedtls_sha256_update(&ctx, (const uint8_t *)table, tableSize);
+  mbedtls_sha256_finish(&ctx, digest);
+  mbedtls_sha256_free(&ctx);
 
-  Serial1.write(buf, buf[0] + 1);
+  // Apres le hash : le nom n'est qu'affiche
+  for (int i = 0; i < *count; i++)
+  {
+    if (table[i].sectors == 0 || table[i].sectors > 16)
+      return false;
+    table[i].name[sizeof(table[i].name) - 1] = 0;
+  }
+  return true;
 }
 
-bool waitACK(int timeout = 2000)
+// Table signee puis chaque contenu compare a son hash : le manifeste est
+// entierement verifie des le telechargement
+bool manifestVerify(const char *path, const char *sigPath)
 {
-  uint32_t start = millis();
-  while (millis() - start < timeout)
+  FmfEntry table[PROTO_MAX_COMPONENTS];
+  uint8_t digest[32], buf[512];
+  int count;
+  File f = LittleFS.open(path, "r");
+  bool ok = f && manifestRead(f, table, &count, digest) &&
+            (!REQUIRE_SIGNATURE || verifySignature(sigPath, digest));
+  for (int i = 0; ok && i < count; i++)
   {
-    if (Serial1.available() >= 2)
+    mbedtls_sha256_context ctx;
+    mbedtls_sha256_init(&ctx);
+    mbedtls_sha256_starts(&ctx, 0);
+    for (uint32_t left = table[i].size; ok && left > 0;)
     {
-      uint8_t ack = Serial1.read();
-      Serial1.read(); // Skip len byte
-      delay(5);
-      while (Serial1.available())
-        Serial1.read(); // Purge rest
-      return (ack == 0xCD);
+      int len = f.read(buf, min((uint32_t)sizeof(buf), left));
+      ok = len > 0;
+      if (ok)
+        mbedtls_sha256_update(&ctx, buf, len);
+      left -= ok ? len : 0;
     }
+    mbedtls_sha256_finish(&ctx, digest);
+    mbedtls_sha256_free(&ctx);
+    ok = ok && memcmp(digest, table[i].sha, 32) == 0;
+  }
+  f.close();
+  return ok;
+}
+
+// Composant deja en place : meme adresse, meme taille, meme prefixe de hash
+bool manifestUnchanged(const FmfEntry &e, const Response &resp)
+{
+  for (int i = 0; i + PROTO_COMP_INFO_SIZE <= resp.len; i += PROTO_COMP_INFO_SIZE)
+  {
+    const uint8_t *r = &resp.data[i];
+    if (r[0] == e.id)
+      return Proto_Get_U32(&r[5]) == e.addr && Proto_Get_U32(&r[9]) == e.size &&
+             Proto_Get_U32(&r[13]) == Proto_Get_U32(e.sha);
   }
   return false;
 }
 
-// --- TACHES FOTA ---
-bool downloadBin()
+bool manifestSendComponent(File &f, const FmfEntry &e)
 {
-  logM("Download: " + gitURL);
-  WiFiClientSecure sClient;
-  sClient.setInsecure();
-  HTTPClient http;
-  http.begin(sClient, gitURL);
+  uint8_t buf[CHUNK_MAX], info[12 + 32];
 
-  if (http.GET() == HTTP_CODE_OK)
+  // FLASH_ERASE : count = nombre de secteurs, les donnees ne sont pas lues
+  memset(buf, 0, e.sectors);
+  sendPacket(PROTO_CMD_FLASH_ERASE, e.addr, buf, e.sectors);
+  if (waitStatus(STATUS_ERASE_OK, 10000) != RESP_OK)
   {
-    File f = LittleFS.open("/update.bin", "w");
-    http.writeToStream(&f);
-    f.close();
-    http.end();
-    logM("Download OK");
-    return true;
+    logM("Manifest: erase failed @ " + String(e.addr, HEX));
+    return false;
   }
-  logM("Download Failed");
-  http.end();
-  return false;
+  linkReset();
+  uint32_t addr = e.addr;
+  for (uint32_t left = e.size; left > 0;)
+  {
+    int len = f.read(buf, min((uint32_t)linkCtl.chunk, left));
+    if (len <= 0 || !sendWithRetry(PROTO_CMD_MEM_WRITE, addr, buf, len))
+      return false;
+    addr += len;
+    left -= len;
+  }
+  linkReport();
+
+  // Le bootloader relit la region en Flash et la compare au hash signe
+  Proto_Put_U32(&info[0], e.id);
+  Proto_Put_U32(&info[4], e.version);
+  Proto_Put_U32(&info[8], e.size);
+  memcpy(&info[12], e.sha, 32);
+  sendPacket(PROTO_CMD_SET_COMP_INFO, e.addr, info, sizeof(info));
+  return waitStatus(STATUS_COMP_SAVED, 5000) == RESP_OK;
 }
 
-void handleErase()
+// Contenu de l'application (id 0) extrait vers FILE_CURRENT : base des patchs
+void manifestKeepApp(File &f, const FmfEntry &e, uint32_t offset)
 {
-  resetSTM32();
-  logM("Erasing Flash...");
-  sendPacket(0x15, 0xFFFFFFFF, NULL, 0); // Erase Cmd
-  if (waitACK(10000))
-    logM("Erase Success");
+  uint8_t buf[512];
+  File out = LittleFS.open(FILE_CURRENT ".tmp", "w");
+  f.seek(offset);
+  for (uint32_t left = e.size; out && left > 0;)
+  {
+    int len = f.read(buf, min((uint32_t)sizeof(buf), left));
+    if (len <= 0)
+      break;
+    out.write(buf, len);
+    left -= len;
+  }
+  bool ok = out && out.size() == e.size;
+  out.close();
+  if (ok)
+    moveFile(FILE_CURRENT ".tmp", FILE_CURRENT);
   else
-    logM("Erase Failed");
+    LittleFS.remove(FILE_CURRENT ".tmp");
 }
 
-void handleUpload()
+void handleManifest()
 {
-  if (!downloadBin())
+  FmfEntry table[PROTO_MAX_COMPONENTS];
+  uint8_t digest[32];
+  int count, sent = 0;
+  uint32_t bytes = 0, start = millis();
+  Response have;
+
+  File f = LittleFS.open(FILE_UPDATE, "r");
+  if (!f || !manifestRead(f, table, &count, digest))
+  {
+    logM("Manifest: not an FMF1 file");
+    f.close();
+    return;
+  }
+  resetSTM32();
+  sendPacket(PROTO_CMD_GET_COMPONENTS, 0, NULL, 0);
+  if (readResponse(RTO_MAX, &have) != RESP_OK)
+  {
+    logM("Manifest: bootloader without component support");
+    f.close();
     return;
+  }
 
-  File f = LittleFS.open("/update.bin", "r");
-  long total = f.size();
-  logM("Flashing " + String(total) + " bytes...");
+  bool ok = true, appChanged = false;
+  uint32_t offset = FMF_HEADER + count * sizeof(FmfEntry);
+  for (int i = 0; ok && i < count; i++)
+  {
+    const FmfEntry &e = table[i];
+    if (!manifestUnchanged(e, have))
+    {
+      logM("Manifest: " + String(e.name) + " v" + String(e.version) + ", " + String(e.size) + " bytes");
+      f.seek(offset);
+      ok = manifestSendComponent(f, e);
+      if (!ok)
+        logM("Manifest: " + String(e.name) + " REJECTED");
+      sent++;
+      bytes += e.size;
+      if (e.id == 0)
+      {
+        appChanged = ok;
+        if (ok)
+          manifestKeepApp(f, e, offset);
+      }
+    }
+    offset += e.size;
+    client.loop();
+  }
+  f.close();
+  logM("Manifest: " + String(sent) + "/" + String(count) + " components, " + String(bytes) + " bytes in " +
+       String(millis() - start) + " ms");
+  if (!ok)
+    return;
 
-  resetSTM32();
+  sendPacket(PROTO_CMD_GO_TO_ADDR, ADDR_APP, NULL, 0);
+  if (waitStatus(STATUS_ADDR_VALID) == RESP_OK)
+    logM(appChanged ? "Update FINISHED" : "Components updated, application restarted");
+  else
+    logM("Manifest: no valid application to start");
+}
 
-  uint32_t addr = ADDR_APP;
-  uint8_t buf[64];
-  int pkts = 0;
+// --- FILE DE COMMANDES PLANIFIEES ---
+// Chaque commande cible devient un job avec sa propre URL et, precede de
+// "at <debut>[-<fin>]" (secondes UTC), une fenetre de maintenance. Les
+// telechargements et la verification de signature se font des la reception ;
+// le flashage demarre a l'ouverture de la fenetre avec l'image deja en local.
+// Une commande identique a un job en attente ne fait que deplacer sa fenetre ;
+// une nouvelle image (http, stage, patch, fleet, rollback) remplace celle en
+// attente. La file est conservee dans FILE_JOBS a travers les redemarrages.
+#define MAX_JOBS 8
+#define JOB_URL_SIZE 200
+#define JOB_WINDOW 3600          // s, fenetre par defaut apres le debut
+#define JOB_RETRY_MS 60000       // Nouvelle tentative de telechargement
+#define NTP_SERVER "pool.ntp.org"
+#define TIME_VALID 1700000000    // En dessous, l'heure n'est pas encore synchronisee
 
-  while (f.available())
+enum JobKind : uint8_t
+{
+  JOB_ERASE,
+  JOB_UPLOAD,
+  JOB_STAGE,
+  JOB_PATCH,
+  JOB_FLEET,
+  JOB_BACKUP,
+  JOB_ROLLBACK,
+  JOB_DISCOVER,
+  JOB_MANIFEST
+};
+static const char *const JOB_NAMES[] = {"erase", "http", "stage", "patch", "fleet", "backup", "rollback", "nodes discover",
+                                        "manifest"};
+
+struct Job
+{
+  uint16_t id;
+  uint8_t kind;
+  uint8_t ready;     // Fichiers en local et verifies
+  uint32_t start;    // 0 : des que pret
+  uint32_t end;      // 0 : pas de limite
+  uint32_t retryMs;  // millis() de la prochaine tentative (non significatif apres reset)
+  char url[JOB_URL_SIZE];
+};
+Job jobs[MAX_JOBS];
+int jobCount = 0;
+uint16_t jobSeq = 0;
+
+// Jobs qui decident de l'image installee : le dernier recu l'emporte
+bool jobIsImage(uint8_t kind)
+{
+  return kind == JOB_UPLOAD || kind == JOB_STAGE || kind == JOB_PATCH || kind == JOB_FLEET ||
+         kind == JOB_ROLLBACK || kind == JOB_MANIFEST;
+}
+
+bool jobNeedsDownload(uint8_t kind)
+{
+  return kind == JOB_UPLOAD || kind == JOB_STAGE || kind == JOB_PATCH || kind == JOB_FLEET ||
+         kind == JOB_MANIFEST;
+}
+
+void jobSave()
+{
+  File f = LittleFS.open(FILE_JOBS, "w");
+  f.write((const uint8_t *)jobs, jobCount * sizeof(Job));
+  f.close();
+}
+
+void jobLoad()
+{
+  File f = LittleFS.open(FILE_JOBS, "r");
+  jobCount = 0;
+  if (!f)
+    return;
+  while (jobCount < MAX_JOBS && f.read((uint8_t *)&jobs[jobCount], sizeof(Job)) == sizeof(Job))
   {
-    int len = f.read(buf, 64);
-    while (Serial1.available())
-      Serial1.read();
-    sendPacket(0x16, addr, buf, len); // Write Cmd
+    jobs[jobCount].retryMs = 0;
+    jobSeq = max(jobSeq, jobs[jobCount].id);
+    jobCount++;
+  }
+  f.close();
+}
+
+int jobFind(uint16_t id)
+{
+  for (int i = 0; i < jobCount; i++)
+    if (jobs[i].id == id)
+      return i;
+  return -1;
+}
+
+void jobRemove(int i)
+{
+  memmove(&jobs[i], &jobs[i + 1], (jobCount - i - 1) * sizeof(Job));
+  jobCount--;
+}
+
+String jobDescribe(const Job &j)
+{
+  String s = "#" + String(j.id) + " " + JOB_NAMES[j.kind];
+  if (j.url[0])
+    s += " " + String(j.url);
+  if (j.start)
+    s += " at " + String(j.start) + "-" + String(j.end);
+  return s + (j.ready ? " (ready)" : "");
+}
 
-    if (!waitACK())
+void jobAdd(uint8_t kind, const String &url, uint32_t start, uint32_t end)
+{
+  if (url.length() >= JOB_URL_SIZE)
+  {
+    logM("Job: URL too long");
+    return;
+  }
+  for (int i = 0; i < jobCount; i++)
+  {
+    if (jobs[i].kind == kind && url == jobs[i].url)
     {
-      logM("Write Fail @ " + String(addr, HEX));
-      f.close();
+      // Doublon : fichiers deja telecharges conserves, seule la fenetre change
+      jobs[i].start = start;
+      jobs[i].end = end;
+      jobSave();
+      logM("Job merged: " + jobDescribe(jobs[i]));
       return;
     }
-
-    addr += len;
-    if (++pkts % 20 == 0)
+    if (jobIsImage(kind) && jobIsImage(jobs[i].kind))
     {
-      client.loop(); // Keep MQTT alive
-      client.publish(TOPIC_PUB, String("Progress: " + String((pkts * 64 * 100) / total) + "%").c_str());
+      logM("Job superseded: " + jobDescribe(jobs[i]));
+      jobRemove(i--);
     }
   }
+  if (jobCount == MAX_JOBS)
+  {
+    logM("Job queue full");
+    return;
+  }
+  Job &j = jobs[jobCount++];
+  memset(&j, 0, sizeof(j));
+  j.id = ++jobSeq;
+  j.kind = kind;
+  j.ready = !jobNeedsDownload(kind);
+  j.start = start;
+  j.end = end;
+  strlcpy(j.url, url.c_str(), sizeof(j.url));
+  jobSave();
+  logM("Job queued: " + jobDescribe(j));
+}
+
+// La signature porte sur le fichier (brut, FWZ1, FSG1) : verifiee des le
+// telechargement, puis de nouveau sur les octets relus a l'envoi. Un
+// manifeste FMF1 est verifie en entier ici.
+bool verifyPrepared()
+{
+  uint8_t magic[4] = {0}, digest[32];
+  uint32_t size;
+  File f = LittleFS.open(FILE_UPDATE, "r");
+  if (!f)
+    return false;
+  f.read(magic, 4);
   f.close();
+  if (memcmp(magic, "FMF1", 4) == 0)
+    return manifestVerify(FILE_UPDATE, FILE_SIG);
+  if (!REQUIRE_SIGNATURE)
+    return true;
+  return fileSHA256(FILE_UPDATE, digest, &size) && verifySignature(FILE_SIG, digest);
+}
+
+// Telechargement et verification d'un job dans une tache du coeur 0, creee pour
+// ce job puis supprimee : loop() continue de servir MQTT pendant ce temps. La
+// tache ne touche pas a jobs[] ; le resultat est repris par jobPrepareNext().
+#define PREP_STACK 16384         // TLS + verification ECDSA
+enum PrepState : uint8_t
+{
+  PREP_IDLE,
+  PREP_BUSY,
+  PREP_OK,
+  PREP_FAILED,
+  PREP_BAD // Signature invalide
+};
+volatile uint8_t prepState = PREP_IDLE;
+uint16_t prepId;
+uint8_t prepKind;
+char prepUrl[JOB_URL_SIZE];
+
+void prepTask(void *)
+{
+  bool ok = prepKind == JOB_PATCH ? preparePatch(prepUrl) : prepareImage(prepUrl);
+  bool bad = ok && !verifyPrepared();
+  prepState = bad ? PREP_BAD : ok ? PREP_OK : PREP_FAILED;
+  vTaskDelete(NULL);
+}
+
+// Un telechargement a la fois. Renvoie true tant qu'il est en cours et au
+// passage qui en reprend le resultat : aucun job ne s'execute pendant que
+// FILE_UPDATE / FILE_SIG sont reecrits.
+bool jobPrepareNext(uint32_t now, bool clockOk)
+{
+  if (prepState == PREP_BUSY)
+    return true;
+  if (prepState == PREP_IDLE)
+  {
+    int i = 0;
+    while (i < jobCount && (jobs[i].ready || (jobs[i].retryMs && (int32_t)(millis() - jobs[i].retryMs) < 0)))
+      i++;
+    if (i == jobCount)
+      return false;
+    prepId = jobs[i].id;
+    prepKind = jobs[i].kind;
+    strlcpy(prepUrl, jobs[i].url, sizeof(prepUrl));
+    prepState = PREP_BUSY;
+    if (xTaskCreatePinnedToCore(prepTask, "prep", PREP_STACK, NULL, 1, NULL, 0) != pdPASS)
+      prepState = PREP_FAILED;
+    return true;
+  }
+
+  bool ok = prepState == PREP_OK;
+  bool bad = prepState == PREP_BAD;
+  prepState = PREP_IDLE;
+  if (bad)
+    logM("Signature INVALID, job dropped");
+
+  // La file a pu changer pendant le telechargement (commandes MQTT)
+  int i = jobFind(prepId);
+  if (i < 0)
+    return true;
+  if (ok && !bad)
+  {
+    jobs[i].ready = 1;
+    logM("Job ready: " + jobDescribe(jobs[i]));
+  }
+  else if (bad || jobs[i].start == 0 || (clockOk && now > jobs[i].end))
+  {
+    if (!bad)
+      logM("Job dropped: " + jobDescribe(jobs[i]));
+    jobRemove(i);
+  }
+  else
+    jobs[i].retryMs = millis() + JOB_RETRY_MS;
+  jobSave();
+  return true;
+}
+
+void jobExecute(const Job &j)
+{
+  logM("Job start: " + jobDescribe(j));
+  traceBegin();
+  switch (j.kind)
+  {
+  case JOB_ERASE:
+    handleErase(strcmp(j.url, "backup") == 0);
+    break;
+  case JOB_UPLOAD:
+  case JOB_PATCH:
+    handleUpload();
+    break;
+  case JOB_STAGE:
+    handleStage();
+    break;
+  case JOB_FLEET:
+    handleFleet();
+    break;
+  case JOB_BACKUP:
+    handleBackup();
+    break;
+  case JOB_ROLLBACK:
+    handleRollback();
+    break;
+  case JOB_DISCOVER:
+    handleDiscover();
+    break;
+  case JOB_MANIFEST:
+    handleManifest();
+    break;
+  }
+  traceEnd();
+}
+
+// Jobs dus executes dans l'ordre de la file ; un job du mais pas encore pret
+// retient ceux qui le suivent
+void jobRun()
+{
+  uint32_t now = time(NULL);
+  bool clockOk = now >= TIME_VALID;
 
-  logM("Jumping to App...");
-  sendPacket(0x14, ADDR_APP, NULL, 0); // Jump Cmd
-  if (waitACK())
-    logM("Update FINISHED");
+  if (jobPrepareNext(now, clockOk))
+    return;
+  for (int i = 0; i < jobCount; i++)
+  {
+    Job &j = jobs[i];
+    if (j.start && (!clockOk || now < j.start))
+      continue;
+    if (j.start && now > j.end)
+    {
+      logM("Job window missed: " + jobDescribe(j));
+      jobRemove(i);
+      jobSave();
+      return;
+    }
+    if (!j.ready)
+      return;
+    Job run = j;
+    jobRemove(i);
+    jobSave();
+    jobExecute(run);
+    return;
+  }
 }
 
 // --- SYSTEME ---
 void mqttCallback(char *topic, byte *payload, unsigned int len)
 {
   String msg = "";
+  uint32_t start = 0, end = 0;
   for (unsigned int i = 0; i < len; i++)
     msg += (char)payload[i];
   Serial.println("MQTT: " + msg);
 
-  if (msg == "erase")
-    doErase = true;
+  // "at <debut>[-<fin>] <commande>" : commande planifiee (secondes UTC)
+  if (msg.startsWith("at "))
+  {
+    int sp = msg.indexOf(' ', 3);
+    if (sp < 0)
+    {
+      logM("Usage: at <utc start>[-<utc end>] <command>");
+      return;
+    }
+    String when = msg.substring(3, sp);
+    int dash = when.indexOf('-');
+    start = strtoul(when.c_str(), NULL, 10);
+    end = dash > 0 ? strtoul(when.c_str() + dash + 1, NULL, 10) : start + JOB_WINDOW;
+    msg = msg.substring(sp + 1);
+  }
+
+  if (msg == "erase" || msg == "erase backup")
+    jobAdd(JOB_ERASE, msg.substring(6), start, end);
   else if (msg.startsWith("http"))
+    jobAdd(JOB_UPLOAD, msg, start, end);
+  else if (msg.startsWith("patch http"))
+    jobAdd(JOB_PATCH, msg.substring(6), start, end);
+  else if (msg.startsWith("stage http"))
+    jobAdd(JOB_STAGE, msg.substring(6), start, end);
+  else if (msg.startsWith("fleet http"))
+    jobAdd(JOB_FLEET, msg.substring(6), start, end);
+  else if (msg.startsWith("manifest http"))
+    jobAdd(JOB_MANIFEST, msg.substring(9), start, end);
+  else if (msg == "nodes discover")
+    jobAdd(JOB_DISCOVER, "", start, end);
+  else if (msg == "nodes")
+  {
+    String list = "";
+    for (int i = 0; i < busNodeCount; i++)
+      list += " " + String(busNodes[i], HEX);
+    logM("Nodes: " + String(busNodeCount) + list);
+  }
+  else if (msg == "backup")
+    jobAdd(JOB_BACKUP, "", start, end);
+  else if (msg == "rollback")
+    jobAdd(JOB_ROLLBACK, "", start, end);
+  else if (msg == "jobs")
+  {
+    logM("Jobs: " + String(jobCount));
+    for (int i = 0; i < jobCount; i++)
+      logM("  " + jobDescribe(jobs[i]));
+  }
+  else if (msg == "jobs clear")
+  {
+    jobCount = 0;
+    jobSave();
+    logM("Jobs cleared");
+  }
+  else if (msg == "trace on" || msg == "trace off")
+  {
+    traceEnabled = (msg == "trace on");
+    logM(String("Trace ") + (traceEnabled ? "enabled" : "disabled"));
+  }
+  else if (msg.startsWith("trace upload http"))
+  {
+    traceURL = msg.substring(13);
+    doTraceUpload = true;
+  }
+}
+
+uint32_t wifiCacheCRC()
+{
+  return esp_rom_crc32_le(0, (const uint8_t *)&wifiCache, offsetof(WifiCache, crc));
+}
+
+bool waitWifi(uint32_t timeout)
+{
+  uint32_t start = millis();
+  while (WiFi.status() != WL_CONNECTED)
+  {
+    if (millis() - start > timeout)
+      return false;
+    delay(10);
+  }
+  return true;
+}
+
+void connectWifi()
+{
+  uint32_t start = millis();
+  WiFi.persistent(false); // Pas d'ecriture NVS a chaque connexion
+  WiFi.mode(WIFI_STA);
+
+  if (wifiCache.magic == WIFI_CACHE_MAGIC && wifiCache.crc == wifiCacheCRC())
+  {
+    WiFi.config(IPAddress(wifiCache.ip), IPAddress(wifiCache.gateway),
+                IPAddress(wifiCache.mask), IPAddress(wifiCache.dns));
+    WiFi.begin(SSID_NAME, SSID_PASS, wifiCache.channel, wifiCache.bssid);
+    wifiFast = waitWifi(WIFI_FAST_TIMEOUT);
+    if (!wifiFast)
+    {
+      // AP change ou bail perdu : scan et DHCP complets
+      wifiCache.magic = 0;
+      WiFi.disconnect();
+      WiFi.config(INADDR_NONE, INADDR_NONE, INADDR_NONE);
+    }
+  }
+
+  if (!wifiFast)
   {
-    gitURL = msg;
-    doUpload = true;
+    WiFi.begin(SSID_NAME, SSID_PASS);
+    waitWifi(UINT32_MAX);
   }
+
+  wifiCache.magic = WIFI_CACHE_MAGIC;
+  wifiCache.channel = WiFi.channel();
+  memcpy(wifiCache.bssid, WiFi.BSSID(), 6);
+  wifiCache.ip = WiFi.localIP();
+  wifiCache.gateway = WiFi.gatewayIP();
+  wifiCache.mask = WiFi.subnetMask();
+  wifiCache.dns = WiFi.dnsIP();
+  wifiCache.crc = wifiCacheCRC();
+  wifiMs = millis() - start;
 }
 
 void setup()
 {
+  loopTask = xTaskGetCurrentTaskHandle();
+  logQueue = xQueueCreate(LOG_QUEUE, LOG_LINE);
   pinMode(PIN_RST, OUTPUT);
   digitalWrite(PIN_RST, HIGH);
   Serial.begin(115200);
-  Serial1.begin(115200, SERIAL_8N1, PIN_RX, PIN_TX);
+  portBegin();
   LittleFS.begin(true);
+  busLoadNodes();
+  jobLoad();
 
-  WiFi.begin(SSID_NAME, SSID_PASS);
-  while (WiFi.status() != WL_CONNECTED)
-    delay(500);
+  char id[13];
+  snprintf(id, sizeof(id), "%012llX", ESP.getEfuseMac());
+  deviceId = id;
+  topicCmd = String(TOPIC_ROOT) + "/" + deviceId + "/cmd";
+  topicStatus = String(TOPIC_ROOT) + "/" + deviceId + "/status";
+  topicPresence = String(TOPIC_ROOT) + "/" + deviceId + "/presence";
+  Serial.println("Device ID: " + deviceId);
+
+  connectWifi();
+  peerBegin();
+  configTime(0, 0, NTP_SERVER); // Heure UTC des fenetres de maintenance
 
   client.setServer(MQTT_SERVER, 1883);
   client.setCallback(mqttCallback);
@@ -207,25 +2556,35 @@ void loop()
 {
   if (!client.connected())
   {
-    if (client.connect(("ESP32-" + String(random(0xffff), HEX)).c_str()))
+    // ID stable + session persistante : le broker garde l'abonnement et les
+    // commandes QoS 1 arrivees pendant la deconnexion.
+    // "offline" retenu publie par le broker si la passerelle disparait
+    if (client.connect(("fota-" + deviceId).c_str(), NULL, NULL,
+                       topicPresence.c_str(), 1, true, "offline", false))
     {
-      client.subscribe(TOPIC_SUB);
-      logM("Ready");
+      client.subscribe(topicCmd.c_str(), 1);
+      client.publish(topicPresence.c_str(), "online", true);
+      if (!reportedReady)
+      {
+        reportedReady = true;
+        logM("Ready in " + String(millis()) + " ms (wifi " + String(wifiMs) + " ms, " +
+             (wifiFast ? "cached" : "full scan") + ")");
+      }
+      else
+        logM("Ready");
     }
     else
       delay(2000);
   }
   client.loop();
+  logFlush();
 
-  if (doErase)
-  {
-    doErase = false;
-    handleErase();
-  }
-  if (doUpload)
+  jobRun();
+
+  if (doTraceUpload)
   {
-    doUpload = false;
-    handleUpload();
+    doTraceUpload = false;
+    handleTraceUpload();
   }
   delay(10);
 }
\ No newline at end of file
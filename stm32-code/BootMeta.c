@@ -0,0 +1,288 @@
+/*
+ * BootMeta.c
+ *
+ *  Journal de metadonnees de demarrage : les enregistrements sont ajoutes a la
+ *  suite dans le secteur, le dernier valide fait foi. Le secteur n'est efface
+ *  que lorsqu'il est plein. Les composants du manifeste FMF1 partagent le
+ *  journal : le dernier enregistrement de chaque id fait foi. Une demande
+ *  d'installation du staging occupe deux emplacements (BootMeta_Span).
+ */
+#include "BootMeta.h"
+#include "FlashDriver.h"
+#include <string.h>
+
+#define BOOTMETA_SLOT(i)   ((const BootMeta_Record *)(BOOTMETA_ADDRESS + (i) * sizeof(BootMeta_Record)))
+
+_Static_assert(sizeof(BootMeta_Component) == sizeof(BootMeta_Record),
+               "Component and boot records share the journal slots");
+_Static_assert(sizeof(BootMeta_Staged) == 2 * sizeof(BootMeta_Record),
+               "A staging request takes two journal slots");
+
+static uint32_t BootMeta_Span(uint32_t i);
+static uint8_t BootMeta_SlotIsErased(const BootMeta_Record *Slot);
+static HAL_StatusTypeDef BootMeta_ProgramWord(const uint32_t *Address, uint32_t Value);
+static HAL_StatusTypeDef BootMeta_ProgramRecord(const BootMeta_Record *Slot, const uint32_t *Src, uint32_t Slots);
+static HAL_StatusTypeDef BootMeta_Write(const uint32_t *Src, uint32_t Slots);
+
+/* Emplacements occupes par l'enregistrement qui commence en i */
+static uint32_t BootMeta_Span(uint32_t i){
+    return (BOOTMETA_SLOT(i)->Magic == BOOTMETA_STAGED_MAGIC) ? 2U : 1U;
+}
+
+static uint8_t BootMeta_SlotIsErased(const BootMeta_Record *Slot){
+    const uint32_t *Word = (const uint32_t *)Slot;
+
+    for(uint32_t i = 0; i < sizeof(BootMeta_Record) / 4; i++){
+        if(Word[i] != 0xFFFFFFFFU) return 0;
+    }
+    return 1;
+}
+
+static HAL_StatusTypeDef BootMeta_ProgramWord(const uint32_t *Address, uint32_t Value){
+    HAL_StatusTypeDef Hal_status = HAL_ERROR;
+
+    FlashDrv_Unlock();
+    Hal_status = FlashDrv_Program_Word((uint32_t)Address, Value);
+    FlashDrv_Lock();
+    return Hal_status;
+}
+
+/* Dernier enregistrement complet du journal, ou NULL si aucun */
+const BootMeta_Record *BootMeta_Get(void){
+    const BootMeta_Record *Active = NULL;
+
+    for(uint32_t i = 0; i < BOOTMETA_RECORD_COUNT; i += BootMeta_Span(i)){
+        const BootMeta_Record *Slot = BOOTMETA_SLOT(i);
+
+        if(Slot->Magic == BOOTMETA_MAGIC){
+            Active = Slot;
+        }
+        else if(BootMeta_SlotIsErased(Slot)){
+            break;
+        }
+    }
+    return Active;
+}
+
+/* Decision rapide : aucune relecture de l'image, seul le marqueur en cache compte */
+uint8_t BootMeta_IsAppBootable(void){
+    const BootMeta_Record *Record = BootMeta_Get();
+
+    return (Record != NULL) &&
+           (Record->App_Valid == BOOTMETA_APP_VALID) &&
+           (Record->Update_Request == BOOTMETA_NO_REQUEST);
+}
+
+/* Magic en dernier : un enregistrement interrompu n'est jamais pris en compte */
+static HAL_StatusTypeDef BootMeta_ProgramRecord(const BootMeta_Record *Slot, const uint32_t *Src, uint32_t Slots){
+    HAL_StatusTypeDef Hal_status = HAL_OK;
+
+    for(uint32_t i = 1; (i < Slots * sizeof(BootMeta_Record) / 4) && (Hal_status == HAL_OK); i++){
+        if(Src[i] != 0xFFFFFFFFU){
+            Hal_status = BootMeta_ProgramWord((const uint32_t *)Slot + i, Src[i]);
+        }
+    }
+    if(Hal_status == HAL_OK){
+        Hal_status = BootMeta_ProgramWord(&Slot->Magic, Src[0]);
+    }
+    return Hal_status;
+}
+
+/*
+ * Ajoute un enregistrement (demarrage, composant ou staging, Magic en Src[0])
+ * de Slots emplacements. Journal plein : le secteur est efface puis les etats
+ * encore utiles (dernier enregistrement de demarrage, composants valides,
+ * demande d'installation en cours) sont recopies avant le nouveau.
+ */
+static HAL_StatusTypeDef BootMeta_Write(const uint32_t *Src, uint32_t Slots){
+    HAL_StatusTypeDef Hal_status = HAL_OK;
+    const BootMeta_Record *Slot = NULL;
+    const BootMeta_Record *Active;
+    const BootMeta_Staged *Staged;
+    const BootMeta_Component *List[BOOTMETA_MAX_COMPONENTS];
+    BootMeta_Record Keep[BOOTMETA_MAX_COMPONENTS + 1];
+    BootMeta_Staged Keep_Staged;
+    uint32_t Kept = 0, Count, Next = 0;
+
+    for(uint32_t i = 0; i + Slots <= BOOTMETA_RECORD_COUNT; i += BootMeta_Span(i)){
+        if(BootMeta_SlotIsErased(BOOTMETA_SLOT(i))){
+            Slot = BOOTMETA_SLOT(i);
+            break;
+        }
+    }
+    if(Slot != NULL) return BootMeta_ProgramRecord(Slot, Src, Slots);
+
+    /* Copies en RAM avant l'effacement ; l'enregistrement remplace par le
+     * nouveau n'est pas garde */
+    Active = BootMeta_Get();
+    if((Src[0] != BOOTMETA_MAGIC) && (Active != NULL)){
+        Keep[Kept++] = *Active;
+    }
+    Count = BootMeta_ListComponents(List, BOOTMETA_MAX_COMPONENTS);
+    for(uint32_t i = 0; i < Count; i++){
+        if((Src[0] == BOOTMETA_COMP_MAGIC) && (List[i]->Id == ((const BootMeta_Component *)Src)->Id)) continue;
+        memcpy(&Keep[Kept++], List[i], sizeof(BootMeta_Record));
+    }
+    Staged = (Src[0] != BOOTMETA_STAGED_MAGIC) ? BootMeta_GetStaged() : NULL;
+    if(Staged != NULL){
+        Keep_Staged = *Staged;
+    }
+
+    FlashDrv_Unlock();
+    Hal_status = FlashDrv_Erase(BOOTMETA_SECTOR, 1);
+    FlashDrv_Lock();
+
+    for(uint32_t i = 0; (i < Kept) && (Hal_status == HAL_OK); i++){
+        Hal_status = BootMeta_ProgramRecord(BOOTMETA_SLOT(Next++), (const uint32_t *)&Keep[i], 1);
+    }
+    if((Staged != NULL) && (Hal_status == HAL_OK)){
+        Hal_status = BootMeta_ProgramRecord(BOOTMETA_SLOT(Next), (const uint32_t *)&Keep_Staged, 2);
+        Next += 2;
+    }
+    if(Hal_status != HAL_OK) return Hal_status;
+    return BootMeta_ProgramRecord(BOOTMETA_SLOT(Next), Src, Slots);
+}
+
+HAL_StatusTypeDef BootMeta_Append(const BootMeta_Record *Record){
+    BootMeta_Record Copy = *Record;
+
+    Copy.Magic = BOOTMETA_MAGIC;
+    return BootMeta_Write((const uint32_t *)&Copy, 1);
+}
+
+HAL_StatusTypeDef BootMeta_SetComponent(const BootMeta_Component *Component){
+    BootMeta_Component Copy = *Component;
+
+    Copy.Magic = BOOTMETA_COMP_MAGIC;
+    return BootMeta_Write((const uint32_t *)&Copy, 1);
+}
+
+/*
+ * Dernier etat de chaque composant, dans l'ordre du journal : un
+ * enregistrement plus recent remplace le precedent, un composant invalide
+ * (region effacee depuis) disparait de la liste.
+ */
+uint32_t BootMeta_ListComponents(const BootMeta_Component **pList, uint32_t Max){
+    uint32_t Count = 0;
+
+    for(uint32_t i = 0; i < BOOTMETA_RECORD_COUNT; i += BootMeta_Span(i)){
+        const BootMeta_Component *Slot = (const BootMeta_Component *)BOOTMETA_SLOT(i);
+        uint32_t j = 0;
+
+        if(Slot->Magic != BOOTMETA_COMP_MAGIC){
+            if(BootMeta_SlotIsErased(BOOTMETA_SLOT(i))) break;
+            continue;
+        }
+        while((j < Count) && (pList[j]->Id != Slot->Id)) j++;
+        if(Slot->Valid != BOOTMETA_APP_VALID){
+            if(j < Count){
+                pList[j] = pList[--Count];
+            }
+        }
+        else if(j < Count){
+            pList[j] = Slot;
+        }
+        else if(Count < Max){
+            pList[Count++] = Slot;
+        }
+    }
+    return Count;
+}
+
+/* Appele a chaque effacement de la zone application */
+HAL_StatusTypeDef BootMeta_Invalidate(void){
+    const BootMeta_Record *Record = BootMeta_Get();
+
+    if((Record == NULL) || (Record->App_Valid == 0)) return HAL_OK;
+    return BootMeta_ProgramWord(&Record->App_Valid, 0);
+}
+
+/*
+ * Effacement de [Start, End) : seuls l'application et les composants qui
+ * recouvrent la plage perdent leur marqueur. Une region de configuration
+ * effacee laisse l'application demarrable.
+ */
+HAL_StatusTypeDef BootMeta_InvalidateRange(uint32_t Start, uint32_t End){
+    HAL_StatusTypeDef Hal_status = HAL_OK;
+    const BootMeta_Record *Record = BootMeta_Get();
+
+    if((Record != NULL) && (Record->App_Valid != 0)){
+        /* Taille inconnue (0xFFFFFFFF) : toute la Flash est a l'application */
+        uint32_t App_End = (Record->App_Size < FLASH_GEO_SIZE) ? BOOTMETA_APP_ADDRESS + Record->App_Size
+                                                                : FLASH_GEO_END;
+        if((Start < App_End) && (End > BOOTMETA_APP_ADDRESS)){
+            Hal_status = BootMeta_ProgramWord(&Record->App_Valid, 0);
+        }
+    }
+
+    for(uint32_t i = 0; (i < BOOTMETA_RECORD_COUNT) && (Hal_status == HAL_OK); i += BootMeta_Span(i)){
+        const BootMeta_Component *Slot = (const BootMeta_Component *)BOOTMETA_SLOT(i);
+
+        if(Slot->Magic != BOOTMETA_COMP_MAGIC){
+            if(BootMeta_SlotIsErased(BOOTMETA_SLOT(i))) break;
+            continue;
+        }
+        if((Slot->Valid != 0) && (Start < Slot->Address + Slot->Size) && (End > Slot->Address)){
+            Hal_status = BootMeta_ProgramWord(&Slot->Valid, 0);
+        }
+    }
+    return Hal_status;
+}
+
+/*
+ * Cote application : l'image en staging est complete et verifiee, le
+ * bootloader la recopie dans la zone application au prochain reset. Une
+ * nouvelle demande remplace la precedente.
+ */
+HAL_StatusTypeDef BootMeta_RequestSwap(uint32_t Size, const uint8_t *Digest){
+    BootMeta_Staged Staged;
+
+    memset(&Staged, 0xFF, sizeof(Staged));
+    Staged.Magic = BOOTMETA_STAGED_MAGIC;
+    Staged.Size = Size;
+    memcpy(Staged.Digest, Digest, sizeof(Staged.Digest));
+    return BootMeta_Write((const uint32_t *)&Staged, 2);
+}
+
+/* Derniere demande d'installation du journal, NULL si aucune n'est en cours */
+const BootMeta_Staged *BootMeta_GetStaged(void){
+    const BootMeta_Staged *Last = NULL;
+
+    for(uint32_t i = 0; i < BOOTMETA_RECORD_COUNT; i += BootMeta_Span(i)){
+        const BootMeta_Staged *Slot = (const BootMeta_Staged *)BOOTMETA_SLOT(i);
+
+        if(Slot->Magic == BOOTMETA_STAGED_MAGIC){
+            Last = Slot;
+        }
+        else if(BootMeta_SlotIsErased(BOOTMETA_SLOT(i))){
+            break;
+        }
+    }
+    return ((Last != NULL) && (Last->Pending == 0xFFFFFFFFU)) ? Last : NULL;
+}
+
+/* Recopies deja commencees : les bits passent a 0 en partant du bit 0 */
+uint32_t BootMeta_StagedAttempts(const BootMeta_Staged *Staged){
+    uint32_t Count = 0;
+
+    while((Count < 32U) && !(Staged->Attempts & (1U << Count))) Count++;
+    return Count;
+}
+
+/* Appele avant chaque recopie : une coupure compte aussi comme tentative */
+HAL_StatusTypeDef BootMeta_CountAttempt(const BootMeta_Staged *Staged){
+    return BootMeta_ProgramWord(&Staged->Attempts, Staged->Attempts << 1);
+}
+
+/* Demande installee ou abandonnee */
+HAL_StatusTypeDef BootMeta_ClearStaged(const BootMeta_Staged *Staged){
+    return BootMeta_ProgramWord(&Staged->Pending, 0);
+}
+
+/* Cote application : demande au bootloader d'attendre une mise a jour au prochain reset */
+HAL_StatusTypeDef BootMeta_RequestUpdate(void){
+    const BootMeta_Record *Record = BootMeta_Get();
+
+    if(Record == NULL) return HAL_OK; /* Sans enregistrement, le bootloader attend deja */
+    return BootMeta_ProgramWord(&Record->Update_Request, 0);
+}
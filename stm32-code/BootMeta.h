@@ -0,0 +1,138 @@
+/*
+ * BootMeta.h
+ *
+ *  Persistent boot metadata (journal of fixed-size records in flash).
+ *  Shared by the bootloader and the application: the application only needs
+ *  BootMeta_RequestUpdate() to hand control back to the bootloader, or
+ *  BootMeta_RequestSwap() once UpdateAgent has filled the staging area.
+ */
+
+#ifndef INC_BOOTMETA_H_
+#define INC_BOOTMETA_H_
+
+#include <stdint.h>
+#include "stm32f4xx_hal.h"
+#include "FlashGeometry.h"
+
+#define BOOTMETA_APP_ADDRESS        0x08008000U   /* Debut du secteur 2 sur tous les F4 */
+
+/*
+ * L'application va du secteur 2 a BOOTMETA_APP_END. Le journal prend le
+ * dernier secteur (128 KB), le secteur 1 en BL_COMPACT (16 KB). BL_STAGING
+ * reserve en plus le secteur qui precede la fin de l'application aux images
+ * de UpdateAgent : a ne definir que si l'application l'embarque (capacites :
+ * README). Application et bootloader doivent etre compiles avec les memes
+ * options.
+ */
+#if !defined(BL_COMPACT)
+/* --- Emplacement : dernier secteur de la Flash (128 KB sur les F4) --- */
+#define BOOTMETA_ADDRESS        (FLASH_BASE + FLASH_GEO_LAST_SECTOR_BASE)
+#define BOOTMETA_SECTOR         FLASH_GEO_LAST_SECTOR
+#define BOOTMETA_SIZE           (FLASH_GEO_SIZE - FLASH_GEO_LAST_SECTOR_BASE)
+
+#if defined(BL_STAGING)
+/* --- Zone de staging : avant-dernier secteur --- */
+#define BOOTMETA_STAGING_ADDRESS    (FLASH_BASE + FLASH_GEO_PREV_SECTOR_BASE)
+#define BOOTMETA_STAGING_SECTOR     (FLASH_GEO_LAST_SECTOR - 1U)
+#define BOOTMETA_STAGING_SIZE       (FLASH_GEO_LAST_SECTOR_BASE - FLASH_GEO_PREV_SECTOR_BASE)
+#define BOOTMETA_APP_END            BOOTMETA_STAGING_ADDRESS
+#define BOOTMETA_APP_END_SECTOR     BOOTMETA_STAGING_SECTOR
+#else
+#define BOOTMETA_APP_END            BOOTMETA_ADDRESS
+#define BOOTMETA_APP_END_SECTOR     BOOTMETA_SECTOR
+#endif
+
+#else
+/*
+ * --- Build compact : le bootloader tient dans le secteur 0, le secteur 1
+ * (16 KB sur tous les F4) porte les metadonnees. L'application garde son
+ * adresse et va jusqu'a la fin de la Flash, ou jusqu'au staging (dernier
+ * secteur) avec BL_STAGING. ---
+ */
+#define BOOTMETA_ADDRESS        0x08004000U
+#define BOOTMETA_SECTOR         1U
+#define BOOTMETA_SIZE           (16U * 1024U)
+
+#if defined(BL_STAGING)
+#define BOOTMETA_STAGING_ADDRESS    (FLASH_BASE + FLASH_GEO_LAST_SECTOR_BASE)
+#define BOOTMETA_STAGING_SECTOR     FLASH_GEO_LAST_SECTOR
+#define BOOTMETA_STAGING_SIZE       (FLASH_GEO_SIZE - FLASH_GEO_LAST_SECTOR_BASE)
+#define BOOTMETA_APP_END            BOOTMETA_STAGING_ADDRESS
+#define BOOTMETA_APP_END_SECTOR     BOOTMETA_STAGING_SECTOR
+#else
+#define BOOTMETA_APP_END            (FLASH_BASE + FLASH_GEO_SIZE)
+#define BOOTMETA_APP_END_SECTOR     FLASH_GEO_SECTOR_COUNT
+#endif
+#endif
+
+#define BOOTMETA_MAGIC          0x464F5441U   /* "FOTA" */
+#define BOOTMETA_APP_VALID      0x56414C44U   /* "VALD" : image verifiee */
+#define BOOTMETA_NO_REQUEST     0xFFFFFFFFU   /* Efface = aucune demande */
+#define BOOTMETA_NO_VERSION     0xFFFFFFFFU   /* Image hors manifeste */
+#define BOOTMETA_COMP_MAGIC     0x434F4D50U   /* "COMP" */
+#define BOOTMETA_MAX_COMPONENTS 6             /* Hors application (PROTO_MAX_COMPONENTS - 1) */
+#define BOOTMETA_STAGED_MAGIC   0x53544147U   /* "STAG" */
+#define BOOTMETA_MAX_ATTEMPTS   3U            /* Recopies commencees avant abandon du staging */
+
+/*
+ * Un enregistrement = 8 mots. Les champs "drapeaux" passent seulement de
+ * 1 a 0, ils se modifient donc sur place sans effacer le secteur.
+ */
+typedef struct {
+    uint32_t Magic;
+    uint32_t App_Size;
+    uint32_t App_Hash;         /* 4 premiers octets du SHA-256 verifie du flux image */
+    uint32_t App_Valid;        /* BOOTMETA_APP_VALID, ou 0 apres effacement */
+    uint32_t Update_Request;   /* Ecrit a 0 par l'application pour rester en bootloader */
+    uint32_t Reserved_1;       /* Libres (efface) : la demande d'installation est un */
+    uint32_t Reserved_2;       /* enregistrement BootMeta_Staged */
+    uint32_t App_Version;      /* Version du manifeste FMF1, BOOTMETA_NO_VERSION sinon */
+} BootMeta_Record;
+
+/*
+ * Composant hors application (configuration, donnees) ecrit par un manifeste
+ * FMF1. Meme taille qu'un enregistrement de demarrage, dans le meme journal :
+ * seul Magic les distingue.
+ */
+typedef struct {
+    uint32_t Magic;            /* BOOTMETA_COMP_MAGIC */
+    uint32_t Id;
+    uint32_t Version;
+    uint32_t Address;
+    uint32_t Size;
+    uint32_t Hash;             /* 4 premiers octets du SHA-256 verifie */
+    uint32_t Valid;            /* BOOTMETA_APP_VALID, ou 0 apres effacement de la region */
+    uint32_t Reserved;
+} BootMeta_Component;
+
+/*
+ * Demande d'installation du staging (BootMeta_RequestSwap). Le SHA-256
+ * complet ne tient pas dans un emplacement : l'enregistrement en occupe deux
+ * consecutifs, que les parcours du journal sautent ensemble.
+ */
+typedef struct {
+    uint32_t Magic;            /* BOOTMETA_STAGED_MAGIC */
+    uint32_t Size;             /* Image verifiee en staging */
+    uint32_t Attempts;         /* Un bit passe a 0 par recopie commencee */
+    uint32_t Pending;          /* 0 une fois installee ou abandonnee */
+    uint32_t Reserved[4];
+    uint8_t  Digest[32];       /* SHA-256 des Size octets de staging */
+} BootMeta_Staged;
+
+#define BOOTMETA_RECORD_COUNT   (BOOTMETA_SIZE / sizeof(BootMeta_Record))
+
+const BootMeta_Record *BootMeta_Get(void);
+uint8_t BootMeta_IsAppBootable(void);
+HAL_StatusTypeDef BootMeta_Append(const BootMeta_Record *Record);
+HAL_StatusTypeDef BootMeta_Invalidate(void);
+HAL_StatusTypeDef BootMeta_InvalidateRange(uint32_t Start, uint32_t End);
+uint32_t BootMeta_ListComponents(const BootMeta_Component **pList, uint32_t Max);
+HAL_StatusTypeDef BootMeta_SetComponent(const BootMeta_Component *Component);
+HAL_StatusTypeDef BootMeta_RequestUpdate(void);
+HAL_StatusTypeDef BootMeta_RequestSwap(uint32_t Size, const uint8_t *Digest);
+const BootMeta_Staged *BootMeta_GetStaged(void);
+uint32_t BootMeta_StagedAttempts(const BootMeta_Staged *Staged);
+HAL_StatusTypeDef BootMeta_CountAttempt(const BootMeta_Staged *Staged);
+HAL_StatusTypeDef BootMeta_ClearStaged(const BootMeta_Staged *Staged);
+
+#endif /* INC_BOOTMETA_H_ */
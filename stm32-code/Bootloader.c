@@ -10,66 +10,163 @@
 
 
 static uint8_t Host_buffer[HOSTM_MAX_SIZE];
-static uint32_t BL_CRC_verify(uint8_t *pdata,uint32_t  DataLen , uint32_t HostCRC);
-static void BL_Get_Help(uint8_t *Host_buffer);
+static void BL_Get_Help(const Proto_Frame *pFrame);
 static void BL_Send_ACK(uint8_t dataLen);
 static void BL_Send_NACK();
-static void BL_Get_Version(uint8_t *Host_buffer);
-static void BL_Get_Chip_Identification_nNumber(uint8_t *Host_buffer);
-void BL_SendMessage(char *format,...);
+static void BL_Get_Version(const Proto_Frame *pFrame);
+static void BL_Get_Chip_Identification_nNumber(const Proto_Frame *pFrame);
 static uint8_t Perform_Flash_Erase(uint32_t PageAddress , uint8_t page_Number );
-static void BL_Flash_Erase(uint8_t *Host_buffer);
-static void BL_Write_Data(uint8_t *Host_buffer);
+static void BL_Flash_Erase(const Proto_Frame *pFrame);
+static void BL_Write_Data(const Proto_Frame *pFrame);
 static uint8_t BL_Address_Varification(uint32_t Address);
-static uint32_t GetSector(uint32_t Address);
-static uint8_t FlashMemory_Payload_Write(uint8_t* pdata, uint32_t StartAddress, uint8_t payloadlen);
-static void BL_Go_To_Addr(uint8_t *Host_buffer) ;
+static uint8_t FlashMemory_Payload_Write(const uint8_t* pdata, uint32_t StartAddress, uint8_t payloadlen);
+static HAL_StatusTypeDef BL_Flash_Put(uint32_t Address, uint8_t Data);
+static HAL_StatusTypeDef BL_Flash_Flush(void);
+static uint8_t BL_Flash_Get(uint32_t Address);
+static uint8_t BL_LZ_Decode(const uint8_t *pSrc, uint8_t SrcLen, uint32_t DestAddress);
+static void BL_Write_LZ_Data(const Proto_Frame *pFrame);
+static void BL_Go_To_Addr(const Proto_Frame *pFrame) ;
+static void BL_Jump_To_Application(uint32_t Jump_Address);
+static uint8_t BL_App_Vector_Is_Sane(uint32_t App_Address);
+static void BL_Stream_Reset(void);
+static void BL_Stream_Hash(uint32_t Address, const uint8_t *pData, uint8_t Len);
+static void BL_Stream_Hash_Record(uint32_t Address, const uint8_t *pData, uint8_t Len);
+static void BL_Set_App_Info(const Proto_Frame *pFrame);
+static uint8_t BL_Save_App(uint32_t Size, uint32_t Hash, uint32_t Version);
+static void BL_Set_Comp_Info(const Proto_Frame *pFrame);
+static void BL_Get_Components(const Proto_Frame *pFrame);
+#if defined(BL_STAGING)
+static uint8_t BL_Hash_Matches(uint32_t Address, uint32_t Size, const uint8_t *Expected);
+static void BL_Install_Staged(void);
+#endif
+static void BL_Mem_Read(const Proto_Frame *pFrame);
+static void BL_Tx_Put(const void *pData, uint16_t Len);
+static void BL_Tx_Flush(void);
+static uint8_t BL_Bus_Accepts(uint8_t Command);
+static void BL_Bus_Mark(uint32_t Address);
+static void BL_Select(const Proto_Frame *pFrame);
+static void BL_Get_Bitmap(const Proto_Frame *pFrame);
+static void BL_Discover(const Proto_Frame *pFrame);
 
 /* Définition d'un pointeur de fonction pour le saut */
 typedef void (*pFunction)(void);
 
+/* Mot Flash en cours d'assemblage : les octets sont regroupes par mot aligne
+ * pour etre programmes en FLASH_TYPEPROGRAM_WORD (4x moins d'operations). */
+static uint32_t Flash_Word_Address = 0xFFFFFFFFU;
+static uint8_t  Flash_Word_Data[4];
+static uint8_t  Flash_Word_Mask = 0;
+
+/* SHA-256 du flux image (charges utiles des trames d'ecriture, dans l'ordre),
+ * calcule a la reception : la verification finale ne relit pas la Flash. */
+static Sha256_Context Stream_Hash;
+static uint32_t Stream_End = 0;         /* Fin des octets deja haches */
+
+/* Session sur bus multipoint (common/FotaProto.h, PROTO_CMD_SELECT) */
+typedef enum{
+    BL_BUS_POINT = 0,     /* Aucun SELECT recu : liaison point a point, repond a tout */
+    BL_BUS_SELECTED,      /* Noeud selectionne : repond a tout */
+    BL_BUS_IDLE,          /* Autre noeud selectionne : n'ecoute que SELECT et DISCOVER */
+    BL_BUS_BROADCAST      /* Diffusion : efface et ecrit sans jamais repondre */
+} BL_Bus_Mode;
+
+static BL_Bus_Mode Bus_Mode = BL_BUS_POINT;
+static uint32_t Node_Id = 0;              /* CRC de l'UID 96 bits, fixe au demarrage */
+static uint32_t Bus_Block_Size = 0;       /* Granularite du bitmap, 0 = pas de suivi */
+static uint8_t Bus_Bitmap[CBL_BUS_BITMAP_SIZE];
+static uint8_t Bus_Flash_Hash = 0;        /* Ecritures diffusees depuis le dernier effacement : SET_APP_INFO relit la Flash */
+
+#if !defined(BL_COMPACT)
 extern CRC_HandleTypeDef hcrc;
-/* CORRECTION IMPORTANTE : Utilisation de UART1 au lieu de UART2 */
-extern UART_HandleTypeDef huart1;
+#endif
 
 BL_status BL_FeatchHostCommand() {
     BL_status status = BL_NACK;
     HAL_StatusTypeDef Hal_status = HAL_ERROR;
     uint8_t DataLen = 0;
+    uint32_t Byte_Timeout;
+    Proto_Frame Frame;
 
     memset(Host_buffer,0,HOSTM_MAX_SIZE);
 
-    /* Utilisation de huart1 */
-    Hal_status = HAL_UART_Receive(&huart1,Host_buffer,1,HAL_MAX_DELAY);
+    /* L'hote attend la fin de la reponse avant d'envoyer la trame suivante */
+    BL_Tx_Flush();
+
+    /* Liaison choisie dans Transport.h (USART1 ou SPI1) */
+    Hal_status = Transport_Receive(Host_buffer,1,HAL_MAX_DELAY);
     if(Hal_status != HAL_OK) return BL_NACK;
 
     DataLen = Host_buffer[0];
-    /* Utilisation de huart1 */
-    Hal_status = HAL_UART_Receive(&huart1,&Host_buffer[1],DataLen,HAL_MAX_DELAY);
-    if(Hal_status != HAL_OK) return BL_NACK;
+    /* Knocks en retard ou longueur hors buffer : on ignore l'octet */
+    if(DataLen >= HOSTM_MAX_SIZE) return BL_NACK;
+
+    /* Un octet perdu ne doit pas bloquer la cible ni lui faire manger le
+     * debut de la trame suivante : un silence dans la trame l'abandonne, et
+     * l'octet suivant est relu comme une longueur */
+    Byte_Timeout = (Bus_Mode == BL_BUS_POINT) ? CBL_POINT_BYTE_TIMEOUT_MS : CBL_BUS_BYTE_TIMEOUT_MS;
+    for(uint16_t i = 1; (i <= DataLen) && (Hal_status == HAL_OK); i++){
+        Hal_status = Transport_Receive(&Host_buffer[i],1,Byte_Timeout);
+    }
+    if(Hal_status != HAL_OK){
+        /* Point a point : l'hote renvoie tout de suite au lieu d'attendre son RTO */
+        if(Bus_Mode == BL_BUS_POINT) BL_Send_NACK();
+        return BL_NACK;
+    }
 
-    switch(Host_buffer[1]){
+    /* Taille et CRC controles une seule fois, les commandes lisent les champs decodes */
+    if(Proto_Decode(Host_buffer, (uint16_t)DataLen + 1, &Frame) != PROTO_OK){
+        /* Sur le bus, seul le noeud qui a la parole signale l'erreur */
+        if((Bus_Mode == BL_BUS_POINT) || (Bus_Mode == BL_BUS_SELECTED)) BL_Send_NACK();
+        return BL_NACK;
+    }
+    if(!BL_Bus_Accepts(Frame.Command)) return BL_NACK;
+
+    switch(Frame.Command){
         case CBL_GET_VER_CMD :
-            BL_Get_Version(Host_buffer);
+            BL_Get_Version(&Frame);
             break;
 
         case CBL_GET_HELP_CMD :
-            BL_Get_Help(Host_buffer);
+            BL_Get_Help(&Frame);
             break;
 
         case CBL_GET_CID_CMD :
-            BL_Get_Chip_Identification_nNumber(Host_buffer);
+            BL_Get_Chip_Identification_nNumber(&Frame);
             break;
 
         case CBL_FLASH_ERASE_CMD :
-            BL_Flash_Erase(Host_buffer);
+            BL_Flash_Erase(&Frame);
             break;
 
         case CBL_MEM_WRITE_CMD :
-            BL_Write_Data(Host_buffer);
+            BL_Write_Data(&Frame);
+            break;
+        case CBL_MEM_WRITE_LZ_CMD :
+            BL_Write_LZ_Data(&Frame);
             break;
         case CBL_GO_TO_ADDR_CMD :
-            BL_Go_To_Addr(Host_buffer);
+            BL_Go_To_Addr(&Frame);
+            break;
+        case CBL_SET_APP_INFO_CMD :
+            BL_Set_App_Info(&Frame);
+            break;
+        case CBL_MEM_READ_CMD :
+            BL_Mem_Read(&Frame);
+            break;
+        case CBL_SELECT_CMD :
+            BL_Select(&Frame);
+            break;
+        case CBL_GET_BITMAP_CMD :
+            BL_Get_Bitmap(&Frame);
+            break;
+        case CBL_DISCOVER_CMD :
+            BL_Discover(&Frame);
+            break;
+        case CBL_SET_COMP_INFO_CMD :
+            BL_Set_Comp_Info(&Frame);
+            break;
+        case CBL_GET_COMPONENTS_CMD :
+            BL_Get_Components(&Frame);
             break;
 
         default:
@@ -79,162 +176,165 @@ BL_status BL_FeatchHostCommand() {
     return BL_NACK;
 }
 
-void BL_SendMessage(char *format,...){
-    char message[100]={0};
-    va_list args;
-    va_start(args,format);
-    vsnprintf(message, sizeof(message), format, args);
-    /* Utilisation de huart1 */
-    HAL_UART_Transmit(&huart1,(uint8_t*)message,strlen(message),HAL_MAX_DELAY);
-    va_end(args);
+/* Reponse mise en file sur la liaison, sans attendre qu'elle parte */
+static void BL_Tx_Put(const void *pData, uint16_t Len){
+    /* Diffusion : tous les noeuds executent, aucun ne parle */
+    if(Bus_Mode == BL_BUS_BROADCAST) return;
+    Transport_Send((const uint8_t *)pData, Len);
 }
 
+static void BL_Tx_Flush(void){
+    Transport_Flush();
+}
+
+#if defined(PROTO_CRC_HW)
+/* Unite CRC par registres : un octet par ecriture de mot, comme la table de FotaProto.h */
+uint32_t Proto_Crc_Hw(const uint8_t *pData, uint32_t Len){
+    CRC->CR = CRC_CR_RESET;
+    while(Len--){
+        CRC->DR = *pData++;
+    }
+    return CRC->DR;
+}
+#endif
 
-static uint32_t BL_CRC_verify(uint8_t *pdata, uint32_t DataLen, uint32_t HostCRC){
-    return CRC_VERIFING_PASS;
+#if !defined(BL_COMPACT)
+/*
+ * Texte de diagnostic sans vsnprintf ni tampon de pile : les caracteres vont
+ * directement dans l'anneau. Formats reconnus : %s %c %d %u %x %X, avec une
+ * largeur completee par des zeros (%08X) ; les autres sont recopies tels quels.
+ */
+void BL_SendMessage(char *format,...){
+    const char *p = format;
+    va_list args;
 
-//    uint32_t crc_status = CRC_VERIFING_FAILED;
-//    uint32_t MCU_CRC = 0;
-//    uint32_t dataBuffer = 0;
-//
-//    __HAL_CRC_DR_RESET(&hcrc);
-//
-//    for(uint32_t count = 0; count < DataLen; count++){
-//        dataBuffer = (uint32_t)pdata[count];
-//        MCU_CRC = HAL_CRC_Accumulate(&hcrc, &dataBuffer, 1);
-//    }
-//
-//    __HAL_CRC_DR_RESET(&hcrc);
-//
-//    if(HostCRC == MCU_CRC){
-//        crc_status = CRC_VERIFING_PASS;
-//    } else {
-//        crc_status = CRC_VERIFING_FAILED;
-//    }
-//    return crc_status;
+    va_start(args,format);
+    while(*p != '\0'){
+        const char *Digit_Set = "0123456789ABCDEF";
+        const char *Run = p;
+        char Digits[10];
+        uint8_t Width = 0, n = 0;
+        uint32_t Value, Base = 10;
+
+        while((*p != '\0') && (*p != '%')) p++;
+        if(p > Run) BL_Tx_Put(Run, (uint16_t)(p - Run));
+        if(*p == '\0') break;
+
+        p++;
+        while((*p >= '0') && (*p <= '9')) Width = (uint8_t)(Width * 10 + (*p++ - '0'));
+        switch(*p){
+            case 's':{
+                const char *Text = va_arg(args, const char *);
+                BL_Tx_Put(Text, (uint16_t)strlen(Text));
+                p++;
+                continue;
+            }
+            case 'c':
+                Digits[0] = (char)va_arg(args, int);
+                BL_Tx_Put(Digits, 1);
+                p++;
+                continue;
+            case 'd':{
+                int32_t Signed = va_arg(args, int);
+                if(Signed < 0) BL_Tx_Put("-", 1);
+                Value = (Signed < 0) ? (0U - (uint32_t)Signed) : (uint32_t)Signed;
+                break;
+            }
+            case 'u':
+                Value = va_arg(args, unsigned int);
+                break;
+            case 'x':
+                Digit_Set = "0123456789abcdef";
+                /* fall through */
+            case 'X':
+                Value = va_arg(args, unsigned int);
+                Base = 16;
+                break;
+            case '\0':
+                continue;
+            default:    /* %% et formats non geres */
+                BL_Tx_Put(p, 1);
+                p++;
+                continue;
+        }
+        p++;
+
+        do{
+            Digits[n++] = Digit_Set[Value % Base];
+            Value /= Base;
+        }while((Value != 0) && (n < sizeof(Digits)));
+        while((n < Width) && (n < sizeof(Digits))) Digits[n++] = '0';
+        while(n > 0) BL_Tx_Put(&Digits[--n], 1);
+    }
+    va_end(args);
 }
+#endif /* BL_COMPACT */
 
 
 static void BL_Send_ACK(uint8_t dataLen){
 	uint8_t ACK_value[2]={0};
 	ACK_value[0]=SEND_ACK;
 	ACK_value[1]=dataLen;
-    /* Utilisation de huart1 */
-	HAL_UART_Transmit(&huart1, (uint8_t*)ACK_value,2,HAL_MAX_DELAY);
+	BL_Tx_Put(ACK_value, 2);
 }
 
 static void BL_Send_NACK(){
 	uint8_t ACK_value=SEND_NACK;
-    /* Utilisation de huart1 */
-	HAL_UART_Transmit(&huart1,&ACK_value,sizeof(ACK_value),HAL_MAX_DELAY);
+	BL_Tx_Put(&ACK_value, sizeof(ACK_value));
 }
 
-static void BL_Get_Version(uint8_t *Host_buffer){
+static void BL_Get_Version(const Proto_Frame *pFrame){
 	uint8_t Version[4]={CBL_VENDOR_ID,CBL_SW_MAJOR_VERSION,CBL_SW_MINOR_VERSION,CBL_SW_PATCH_VERSION};
-	uint16_t Host_Packet_Len=0;
-	uint32_t CRC_value = 0;
 
-	Host_Packet_Len=Host_buffer[0]+1;
-	CRC_value =*(uint32_t*)( Host_buffer + Host_Packet_Len-4);
-
-    if(CRC_VERIFING_PASS == BL_CRC_verify((uint8_t*)&Host_buffer[0],Host_Packet_Len-4,CRC_value)){
-		BL_Send_ACK(4);
-        /* Utilisation de huart1 */
-		HAL_UART_Transmit(&huart1,(uint8_t*)Version,sizeof(Version),HAL_MAX_DELAY);
-	}
-	else{
-		BL_Send_NACK();
-	}
+	(void)pFrame;
+	BL_Send_ACK(4);
+	BL_Tx_Put(Version, sizeof(Version));
 }
 
-static void BL_Get_Help(uint8_t *Host_buffer){
-	uint8_t BL_sppurted_CMS[6]={CBL_GET_VER_CMD,CBL_GET_HELP_CMD,CBL_GET_CID_CMD,CBL_GO_TO_ADDR_CMD,CBL_FLASH_ERASE_CMD,CBL_MEM_WRITE_CMD};
-	uint16_t Host_Packet_Len=0;
-	uint32_t CRC_value=0;
-	Host_Packet_Len=Host_buffer[0]+1;
-	CRC_value =*(uint32_t*)( Host_buffer + Host_Packet_Len-4);
-	if(CRC_VERIFING_PASS == BL_CRC_verify((uint8_t*)&Host_buffer[0],Host_Packet_Len-4,CRC_value)){
-		BL_Send_ACK(6);
-        /* Utilisation de huart1 */
-		HAL_UART_Transmit(&huart1,(uint8_t*)BL_sppurted_CMS, sizeof(BL_sppurted_CMS), HAL_MAX_DELAY);
-	}
-	else{
-		BL_Send_NACK();
+/* Liste construite depuis la table des commandes du codec */
+static void BL_Get_Help(const Proto_Frame *pFrame){
+	uint8_t BL_sppurted_CMS[PROTO_COMMAND_COUNT];
+	uint8_t Count = 0;
+	uint8_t Code;
+
+	(void)pFrame;
+	for(Code = PROTO_CMD_FIRST; Code <= PROTO_CMD_LAST; Code++){
+		if(Proto_Find(Code) != NULL){
+			BL_sppurted_CMS[Count++] = Code;
+		}
 	}
+	BL_Send_ACK(Count);
+	BL_Tx_Put(BL_sppurted_CMS, Count);
 }
 
-static void BL_Get_Chip_Identification_nNumber(uint8_t *Host_buffer){
+static void BL_Get_Chip_Identification_nNumber(const Proto_Frame *pFrame){
     uint16_t Chip_ID = 0;
-    uint16_t Host_Packet_Len = 0;
-    uint32_t CRC_value = 0;
-
-    Host_Packet_Len = Host_buffer[0] + 1;
-    memcpy(&CRC_value, Host_buffer + Host_Packet_Len - 4, sizeof(CRC_value));
 
-    if(CRC_VERIFING_PASS == BL_CRC_verify((uint8_t*)&Host_buffer[0], Host_Packet_Len - 4, CRC_value)){
-        Chip_ID = (uint16_t)(DBGMCU->IDCODE & 0x0FFFU);
-        BL_Send_ACK(2);
-        /* Utilisation de huart1 */
-        HAL_UART_Transmit(&huart1, (uint8_t *)&Chip_ID, 2, HAL_MAX_DELAY);
-    } else {
-        BL_Send_NACK();
-    }
-}
-
-static uint32_t GetSector(uint32_t Address)
-{
-    uint32_t sector = 0;
-    if((Address >= 0x08000000) && (Address < 0x08004000)){
-        sector = FLASH_SECTOR_0;
-    }
-    else if((Address >= 0x08004000) && (Address < 0x08008000)){
-        sector = FLASH_SECTOR_1;
-    }
-    else if((Address >= 0x08008000) && (Address < 0x0800C000)){
-        sector = FLASH_SECTOR_2;
-    }
-    else if((Address >= 0x0800C000) && (Address < 0x08010000)){
-        sector = FLASH_SECTOR_3;
-    }
-    else if((Address >= 0x08010000) && (Address < 0x08020000)){
-        sector = FLASH_SECTOR_4;
-    }
-    else if((Address >= 0x08020000) && (Address < 0x08040000)){
-        sector = FLASH_SECTOR_5;
-    }
-    else if((Address >= 0x08040000) && (Address < 0x08060000)){
-        sector = FLASH_SECTOR_6;
-    }
-    else if((Address >= 0x08060000) && (Address < 0x08080000)){
-        sector = FLASH_SECTOR_7;
-    }
-    else{
-       sector = 0xFFFFFFFF;
-    }
-    return sector;
+    (void)pFrame;
+    Chip_ID = (uint16_t)(DBGMCU->IDCODE & 0x0FFFU);
+    BL_Send_ACK(2);
+    BL_Tx_Put(&Chip_ID, 2);
 }
 
 static uint8_t Perform_Flash_Erase(uint32_t PageAddress, uint8_t page_Number) {
-    FLASH_EraseInitTypeDef pEraseInit;
-    uint32_t PageError = 0;
     uint8_t Pagestatus = INVALID_PAGE_NUMBER;
     HAL_StatusTypeDef Hal_Status = HAL_ERROR;
     uint32_t FirstSector = 0;
+    uint32_t SectorCount = 0;
 
     /* --- CAS 1 : SMART MASS ERASE --- */
     if (PageAddress == CBL_FLASH_MASS_ERASE) {
-        pEraseInit.TypeErase = FLASH_TYPEERASE_SECTORS;
-        pEraseInit.Banks = FLASH_BANK_1;
-        pEraseInit.VoltageRange = FLASH_VOLTAGE_RANGE_3;
-        /* Effacement Application (Secteurs 2 à 7) */
-        pEraseInit.Sector = FLASH_SECTOR_2;
-        pEraseInit.NbSectors = 6;
-
-        HAL_FLASH_Unlock();
-        Hal_Status = HAL_FLASHEx_Erase(&pEraseInit, &PageError);
-        HAL_FLASH_Lock();
-
-        if (Hal_Status == HAL_OK && PageError == 0xFFFFFFFFU) {
+        /* Effacement Application, staging et metadonnees restent */
+        if (!FlashGeo_SectorRange(CBL_APP_BASE, CBL_APP_END, &FirstSector, &SectorCount)) {
+            return UNSUCCESSFUL_ERASE;
+        }
+
+        BootMeta_InvalidateRange(CBL_APP_BASE, CBL_APP_END);
+        FlashDrv_Unlock();
+        Hal_Status = FlashDrv_Erase(FirstSector, SectorCount);
+        FlashDrv_Lock();
+
+        if (Hal_Status == HAL_OK) {
             return SUCCESSFUL_ERASE;
         } else {
             return UNSUCCESSFUL_ERASE;
@@ -242,23 +342,22 @@ static uint8_t Perform_Flash_Erase(uint32_t PageAddress, uint8_t page_Number) {
     }
 
     /* --- CAS 2 : EFFACEMENT PAR SECTEUR --- */
-    FirstSector = GetSector(PageAddress);
-
-    if (FirstSector == 0xFFFFFFFF) return INVALID_PAGE_NUMBER;
-    if (FirstSector < FLASH_SECTOR_2) return INVALID_PAGE_NUMBER; // Protection Bootloader
-    if ((FirstSector + page_Number) > CBL_FLASH_MAX_PAGE_NUMBER) return INVALID_PAGE_NUMBER;
-
-    pEraseInit.TypeErase = FLASH_TYPEERASE_SECTORS;
-    pEraseInit.Banks = FLASH_BANK_1;
-    pEraseInit.VoltageRange = FLASH_VOLTAGE_RANGE_3;
-    pEraseInit.Sector = FirstSector;
-    pEraseInit.NbSectors = page_Number;
-
-    HAL_FLASH_Unlock();
-    Hal_Status = HAL_FLASHEx_Erase(&pEraseInit, &PageError);
-    HAL_FLASH_Lock();
-
-    if (Hal_Status == HAL_OK && PageError == 0xFFFFFFFFU) {
+    FirstSector = FlashGeo_GetSector(PageAddress);
+
+    if (FirstSector == FLASH_GEO_INVALID_SECTOR) return INVALID_PAGE_NUMBER;
+    if (FirstSector < CBL_APP_FIRST_SECTOR) return INVALID_PAGE_NUMBER; // Protection Bootloader
+    if (page_Number == 0) return INVALID_PAGE_NUMBER;
+    if ((FirstSector + page_Number) > BOOTMETA_APP_END_SECTOR) return INVALID_PAGE_NUMBER; // Protection staging et metadonnees
+
+    /* Seuls l'application et les composants de ces secteurs perdent leur marqueur */
+    BootMeta_InvalidateRange(FlashGeo_SectorAddress(FirstSector),
+                             FlashGeo_SectorAddress(FirstSector + page_Number - 1U) +
+                             FlashGeo_SectorSize(FirstSector + page_Number - 1U));
+    FlashDrv_Unlock();
+    Hal_Status = FlashDrv_Erase(FirstSector, page_Number);
+    FlashDrv_Lock();
+
+    if (Hal_Status == HAL_OK) {
         Pagestatus = SUCCESSFUL_ERASE;
     } else {
         Pagestatus = UNSUCCESSFUL_ERASE;
@@ -267,61 +366,202 @@ static uint8_t Perform_Flash_Erase(uint32_t PageAddress, uint8_t page_Number) {
     return Pagestatus;
 }
 
-static void BL_Flash_Erase(uint8_t *Host_buffer) {
+/* Count = nombre de secteurs ; adresse CBL_FLASH_MASS_ERASE pour toute l'application */
+static void BL_Flash_Erase(const Proto_Frame *pFrame) {
     uint8_t Erase_status = UNSUCCESSFUL_ERASE;
-    uint16_t Host_Packet_Len = 0;
-    uint32_t CRC_value = 0;
 
-    Host_Packet_Len = Host_buffer[0] + 1;
-    CRC_value = *(uint32_t*)(Host_buffer + Host_Packet_Len - 4);
+    /* Un effacement ouvre une nouvelle session de mise a jour : le flux
+     * recu redevient l'image, sauf ecritures diffusees a venir */
+    BL_Stream_Reset();
+    Bus_Flash_Hash = 0;
 
-    if (CRC_VERIFING_PASS == BL_CRC_verify((uint8_t*)&Host_buffer[0], Host_Packet_Len - 4, CRC_value)) {
-        uint32_t PageAddress = *((uint32_t*)&Host_buffer[2]);
-        uint8_t NumberOfSectors = Host_buffer[6];
+    Erase_status = Perform_Flash_Erase(pFrame->Address, pFrame->Count);
 
-        Erase_status = Perform_Flash_Erase(PageAddress, NumberOfSectors);
+    BL_Send_ACK(1);
+    BL_Tx_Put(&Erase_status, 1);
+}
 
-        BL_Send_ACK(1);
-        /* Utilisation de huart1 */
-        HAL_UART_Transmit(&huart1, (uint8_t *)&Erase_status, 1, HAL_MAX_DELAY);
+/*
+ * Programme le mot en attente : en WORD si les 4 octets sont presents,
+ * sinon octet par octet (debut/fin de trame non alignes).
+ * La zone est effacee avant ecriture : les octets 0xFF ne sont pas programmes.
+ */
+static HAL_StatusTypeDef BL_Flash_Flush(void)
+{
+    HAL_StatusTypeDef Hal_status = HAL_OK;
+    uint32_t Word = 0;
 
-    } else {
-        BL_Send_NACK();
+    if(Flash_Word_Mask == 0x0F)
+    {
+        memcpy(&Word, Flash_Word_Data, 4);
+        if(Word != 0xFFFFFFFFU)
+        {
+            Hal_status = FlashDrv_Program_Word(Flash_Word_Address, Word);
+        }
+    }
+    else
+    {
+        for(uint8_t i = 0; (i < 4) && (Hal_status == HAL_OK); i++)
+        {
+            if((Flash_Word_Mask & (1U << i)) && (Flash_Word_Data[i] != 0xFF))
+            {
+                Hal_status = FlashDrv_Program_Byte(Flash_Word_Address + i, Flash_Word_Data[i]);
+            }
+        }
     }
+    Flash_Word_Address = 0xFFFFFFFFU;
+    Flash_Word_Mask = 0;
+    return Hal_status;
 }
 
-static uint8_t FlashMemory_Payload_Write(uint8_t* pdata, uint32_t StartAddress, uint8_t payloadlen)
+/* Ajoute un octet au mot en cours ; le mot part en Flash des qu'il est complet */
+static HAL_StatusTypeDef BL_Flash_Put(uint32_t Address, uint8_t Data)
 {
-    HAL_StatusTypeDef Hal_status = HAL_ERROR;
+    HAL_StatusTypeDef Hal_status = HAL_OK;
+    uint32_t Word_Address = Address & ~3U;
+
+    if((Flash_Word_Mask != 0) && (Word_Address != Flash_Word_Address))
+    {
+        Hal_status = BL_Flash_Flush();
+    }
+    Flash_Word_Address = Word_Address;
+    Flash_Word_Data[Address & 3U] = Data;
+    Flash_Word_Mask |= (uint8_t)(1U << (Address & 3U));
+
+    if((Hal_status == HAL_OK) && (Flash_Word_Mask == 0x0F))
+    {
+        Hal_status = BL_Flash_Flush();
+    }
+    return Hal_status;
+}
+
+/* Lecture coherente avec le mot pas encore programme (references LZ proches) */
+static uint8_t BL_Flash_Get(uint32_t Address)
+{
+    if(((Address & ~3U) == Flash_Word_Address) && (Flash_Word_Mask & (1U << (Address & 3U))))
+    {
+        return Flash_Word_Data[Address & 3U];
+    }
+    return *(volatile uint8_t *)Address;
+}
+
+static uint8_t FlashMemory_Payload_Write(const uint8_t* pdata, uint32_t StartAddress, uint8_t payloadlen)
+{
+    HAL_StatusTypeDef Hal_status = HAL_OK;
     uint8_t payload_status = FLASH_PAYLOAD_WRITE_FAILED;
 
-    HAL_FLASH_Unlock();
+    FlashDrv_Unlock();
+
+    for(uint8_t i = 0; (i < payloadlen) && (Hal_status == HAL_OK); i++)
+    {
+        Hal_status = BL_Flash_Put(StartAddress + i, pdata[i]);
+    }
+    if(Hal_status == HAL_OK)
+    {
+        Hal_status = BL_Flash_Flush();
+    }
+    else
+    {
+        Flash_Word_Mask = 0;
+    }
+    FlashDrv_Lock();
+
+    if(Hal_status == HAL_OK)
+    {
+        payload_status = FLASH_PAYLOAD_WRITE_PASSED;
+    }
+    return payload_status;
+}
+
+/*
+ * Decompresse un bloc LZ (sequences LZ4 : token | literals | offset | match)
+ * directement en Flash. Les references arriere sont relues dans la Flash deja
+ * programmee : la fenetre de decompression ne coute aucune RAM.
+ */
+static uint8_t BL_LZ_Decode(const uint8_t *pSrc, uint8_t SrcLen, uint32_t DestAddress)
+{
+    HAL_StatusTypeDef Hal_status = HAL_OK;
+    const uint8_t *pEnd = pSrc + SrcLen;
+    uint32_t Dest = DestAddress;
+
+    FlashDrv_Unlock();
 
-    for(uint8_t i = 0; i < payloadlen; i++)
+    while((pSrc < pEnd) && (Hal_status == HAL_OK))
     {
-        uint32_t current_address = StartAddress + i;
-        Hal_status = HAL_FLASH_Program(FLASH_TYPEPROGRAM_BYTE, current_address, pdata[i]);
+        uint8_t Token = *pSrc++;
+        uint32_t Length = Token >> 4;
+        uint32_t Offset = 0;
 
-        if(Hal_status != HAL_OK)
+        /* Literals */
+        if(Length == 15)
+        {
+            uint8_t Extra = 0;
+            do {
+                if(pSrc >= pEnd) { Hal_status = HAL_ERROR; break; }
+                Extra = *pSrc++;
+                Length += Extra;
+            } while(Extra == 255);
+        }
+        if((Hal_status != HAL_OK) || (Length > (uint32_t)(pEnd - pSrc)) ||
+           (Dest + Length > CBL_APP_END))
         {
-            payload_status = FLASH_PAYLOAD_WRITE_FAILED;
+            Hal_status = HAL_ERROR;
             break;
         }
-        else
+        while(Length-- && (Hal_status == HAL_OK))
         {
-            payload_status = FLASH_PAYLOAD_WRITE_PASSED;
+            Hal_status = BL_Flash_Put(Dest++, *pSrc++);
+        }
+
+        /* Un bloc se termine toujours par des literals */
+        if(pSrc >= pEnd) break;
+
+        /* Match */
+        if((pEnd - pSrc) < 2) { Hal_status = HAL_ERROR; break; }
+        Offset = (uint32_t)pSrc[0] | ((uint32_t)pSrc[1] << 8);
+        pSrc += 2;
+        Length = (Token & 0x0F) + CBL_LZ_MIN_MATCH;
+        if((Token & 0x0F) == 15)
+        {
+            uint8_t Extra = 0;
+            do {
+                if(pSrc >= pEnd) { Hal_status = HAL_ERROR; break; }
+                Extra = *pSrc++;
+                Length += Extra;
+            } while(Extra == 255);
+        }
+        if((Hal_status != HAL_OK) || (Offset == 0) || (Offset > Dest - CBL_APP_BASE) ||
+           (Dest + Length > CBL_APP_END))
+        {
+            Hal_status = HAL_ERROR;
+            break;
+        }
+        while(Length-- && (Hal_status == HAL_OK))
+        {
+            Hal_status = BL_Flash_Put(Dest, BL_Flash_Get(Dest - Offset));
+            Dest++;
         }
     }
-    HAL_FLASH_Lock();
-    return payload_status;
+
+    if(Hal_status == HAL_OK)
+    {
+        Hal_status = BL_Flash_Flush();
+    }
+    else
+    {
+        Flash_Word_Mask = 0;
+    }
+    FlashDrv_Lock();
+
+    return (Hal_status == HAL_OK) ? FLASH_PAYLOAD_WRITE_PASSED : FLASH_PAYLOAD_WRITE_FAILED;
 }
 
 static uint8_t BL_Address_Varification(uint32_t Address){
     uint8_t Adress_varify = ADDRESS_IS_INVALID;
 
-    if(Address >= FLASH_BASE && Address <= STM32F401_FLASH_END)
+    if(Address >= FLASH_BASE && Address < FLASH_GEO_END)
     {
-        if (Address < 0x08008000)
+        if ((Address < CBL_APP_BASE) || (Address >= CBL_APP_END))
         {
             Adress_varify = ADDRESS_IS_INVALID;
         }
@@ -330,7 +570,7 @@ static uint8_t BL_Address_Varification(uint32_t Address){
             Adress_varify = ADDRESS_IS_VALID;
         }
     }
-    else if(Address >= SRAM_BASE && Address <= STM32F401_SRAM_END)
+    else if(Address >= SRAM_BASE && Address < FLASH_GEO_SRAM_END)
     {
         Adress_varify = ADDRESS_IS_VALID;
     }
@@ -342,92 +582,482 @@ static uint8_t BL_Address_Varification(uint32_t Address){
 }
 
 
-static void BL_Write_Data(uint8_t *Host_buffer){
+static void BL_Write_Data(const Proto_Frame *pFrame){
     uint8_t payload_status = FLASH_PAYLOAD_WRITE_FAILED;
     uint8_t Adress_varify = ADDRESS_IS_INVALID;
-    uint32_t Adress_Host = 0;
-    uint8_t DataLen = 0;
-    uint16_t Host_Packet_Len = 0;
-    uint32_t CRC_value = 0;
 
-    Host_Packet_Len = Host_buffer[0] + 1;
-    CRC_value = *(uint32_t*)(Host_buffer + Host_Packet_Len - 4);
+    BL_Send_ACK(1);
 
-    if(CRC_VERIFING_PASS == BL_CRC_verify((uint8_t*)&Host_buffer[0], Host_Packet_Len - 4, CRC_value)){
+    Adress_varify = BL_Address_Varification(pFrame->Address);
 
-        BL_Send_ACK(1);
+    if((Adress_varify == ADDRESS_IS_VALID) && Proto_Data_Ok(pFrame)){
+        BL_Stream_Hash(pFrame->Address, pFrame->pData, pFrame->Count);
+        payload_status = FlashMemory_Payload_Write(pFrame->pData, pFrame->Address, pFrame->Count);
+        if(payload_status == FLASH_PAYLOAD_WRITE_PASSED) BL_Bus_Mark(pFrame->Address);
+    }
+    BL_Tx_Put(&payload_status, 1);
+}
 
-        Adress_Host = *((uint32_t*)&Host_buffer[2]);
-        DataLen = Host_buffer[6];
+/*
+ * Meme trame que CBL_MEM_WRITE_CMD : l'adresse est celle du premier octet
+ * decompresse, la longueur celle du bloc compresse.
+ */
+static void BL_Write_LZ_Data(const Proto_Frame *pFrame){
+    uint8_t payload_status = FLASH_PAYLOAD_WRITE_FAILED;
 
-        Adress_varify = BL_Address_Varification(Adress_Host);
+    BL_Send_ACK(1);
 
-        if(Adress_varify == ADDRESS_IS_VALID){
-            payload_status = FlashMemory_Payload_Write(&Host_buffer[7], Adress_Host, DataLen);
-            /* Utilisation de huart1 */
-            HAL_UART_Transmit(&huart1, &payload_status, 1, HAL_MAX_DELAY);
-        }
-        else{
-            payload_status = FLASH_PAYLOAD_WRITE_FAILED;
-            /* Utilisation de huart1 */
-            HAL_UART_Transmit(&huart1, &payload_status, 1, HAL_MAX_DELAY);
-        }
-    }
-    else{
-        BL_Send_NACK();
+    if((pFrame->Address >= CBL_APP_BASE) && (pFrame->Address < CBL_APP_END) && Proto_Data_Ok(pFrame)){
+        BL_Stream_Hash_Record(pFrame->Address, pFrame->pData, pFrame->Count);
+        payload_status = BL_LZ_Decode(pFrame->pData, pFrame->Count, pFrame->Address);
     }
+    BL_Tx_Put(&payload_status, 1);
 }
 
-static void BL_Go_To_Addr(uint8_t *Host_buffer) {
+static void BL_Go_To_Addr(const Proto_Frame *pFrame) {
     uint8_t addr_status = ADDRESS_IS_INVALID;
-    uint32_t Jump_Address = 0;
-    uint16_t Host_Packet_Len = 0;
-    uint32_t CRC_value = 0;
 
-    Jump_Address = *((uint32_t*)&Host_buffer[2]);
-    Host_Packet_Len = Host_buffer[0] + 1;
-    CRC_value = *(uint32_t*)(Host_buffer + Host_Packet_Len - 4);
+    BL_Send_ACK(1);
+
+    addr_status = BL_Address_Varification(pFrame->Address);
+
+    BL_Tx_Put(&addr_status, 1);
+
+    if(addr_status == ADDRESS_IS_VALID){
+        BL_Jump_To_Application(pFrame->Address);
+    }
+}
+
+static void BL_Jump_To_Application(uint32_t Jump_Address) {
+    uint32_t MSP_Value = *(volatile uint32_t *)Jump_Address;
+    uint32_t Reset_Handler_Address = *(volatile uint32_t *)(Jump_Address + 4);
 
-    if(CRC_VERIFING_PASS == BL_CRC_verify((uint8_t*)&Host_buffer[0], Host_Packet_Len - 4, CRC_value)){
+    pFunction Jump_To_Application = (pFunction)Reset_Handler_Address;
 
-        BL_Send_ACK(1);
+#if !defined(BL_COMPACT)
+    HAL_CRC_DeInit(&hcrc);
+#else
+    __HAL_RCC_CRC_CLK_DISABLE();
+#endif
 
-        addr_status = BL_Address_Varification(Jump_Address);
+    /* Statut ADDRESS_IS_VALID encore en file, puis liaison desactivee avant le saut */
+    Transport_DeInit();
 
-        if(addr_status == ADDRESS_IS_VALID){
+    HAL_RCC_DeInit();
 
-            /* Utilisation de huart1 */
-            HAL_UART_Transmit(&huart1, &addr_status, 1, HAL_MAX_DELAY);
+    SysTick->CTRL = 0;
+    SysTick->LOAD = 0;
+    SysTick->VAL  = 0;
 
-            uint32_t MSP_Value = *(volatile uint32_t *)Jump_Address;
-            uint32_t Reset_Handler_Address = *(volatile uint32_t *)(Jump_Address + 4);
+    __disable_irq();
 
-            pFunction Jump_To_Application = (pFunction)Reset_Handler_Address;
+    SCB->VTOR = Jump_Address;
+    __set_MSP(MSP_Value);
+    __enable_irq();
+    Jump_To_Application();
+}
+
+/* Controle minimal de la table des vecteurs : MSP en SRAM, Reset_Handler Thumb dans l'application */
+static uint8_t BL_App_Vector_Is_Sane(uint32_t App_Address) {
+    uint32_t MSP_Value = *(volatile uint32_t *)App_Address;
+    uint32_t Reset_Handler_Address = *(volatile uint32_t *)(App_Address + 4);
 
-            HAL_CRC_DeInit(&hcrc);
+    return (MSP_Value > SRAM_BASE) && (MSP_Value <= FLASH_GEO_SRAM_END) &&
+           (Reset_Handler_Address & 1U) &&
+           (Reset_Handler_Address > App_Address) && (Reset_Handler_Address < CBL_APP_END);
+}
 
-            /* CORRECTION : Désactivation de HUART1 avant le saut */
-            HAL_UART_DeInit(&huart1);
+static void BL_Stream_Reset(void) {
+    Sha256_Init(&Stream_Hash);
+    Stream_End = 0;
+}
 
-            HAL_RCC_DeInit();
+/* Les trames arrivent par adresses croissantes. Une retransmission, que
+ * l'hote a pu redecouper plus court apres une perte, repasse sur des octets
+ * deja haches : seuls ceux au-dela de Stream_End entrent dans le hash. */
+static void BL_Stream_Hash(uint32_t Address, const uint8_t *pData, uint8_t Len) {
+    uint32_t Skip = (Address < Stream_End) ? (Stream_End - Address) : 0;
+
+    if(Skip < Len){
+        Sha256_Update(&Stream_Hash, pData + Skip, Len - Skip);
+        Stream_End = Address + Len;
+    }
+}
 
-            SysTick->CTRL = 0;
-            SysTick->LOAD = 0;
-            SysTick->VAL  = 0;
+/* Record FWZ1 : jamais redecoupe, et sa longueur compressee ne dit rien des
+ * adresses couvertes ; seule l'adresse de depart signale une retransmission. */
+static void BL_Stream_Hash_Record(uint32_t Address, const uint8_t *pData, uint8_t Len) {
+    if(Address >= Stream_End){
+        Sha256_Update(&Stream_Hash, pData, Len);
+        Stream_End = Address + 1;
+    }
+}
 
-            __disable_irq();
+/*
+ * Fin de transfert : l'hote envoie la taille de l'image et le SHA-256 du flux
+ * (la passerelle a deja verifie la signature du fichier). Il est compare au
+ * hash calcule pendant la reception, puis le resultat est mis en cache dans
+ * les metadonnees pour que les demarrages suivants n'aient plus a relire
+ * l'application.
+ */
+static void BL_Set_App_Info(const Proto_Frame *pFrame) {
+    uint8_t info_status = APP_INFO_DIGEST_FAILED;
+    Sha256_Context Final_Hash = Stream_Hash;
+    uint8_t Digest[SHA256_DIGEST_SIZE];
+    uint32_t Size, Hash;
+
+    BL_Send_ACK(1);
+
+    if((pFrame->Count == 4 + SHA256_DIGEST_SIZE) && Proto_Data_Ok(pFrame)){
+        Size = Proto_Get_U32(pFrame->pData);
+        /* Diffusion puis reparations dans le desordre : le flux recu n'est
+         * pas l'image, on hache l'image en Flash (image brute uniquement) */
+        if(Bus_Flash_Hash && (Size <= (CBL_APP_END - CBL_APP_BASE))){
+            Sha256_Init(&Final_Hash);
+            Sha256_Update(&Final_Hash, (const uint8_t *)CBL_APP_BASE, Size);
+        }
+        Sha256_Final(&Final_Hash, Digest);
+        memcpy(&Hash, Digest, 4);
 
-            SCB->VTOR = Jump_Address;
-            __set_MSP(MSP_Value);
-            __enable_irq();
-            Jump_To_Application();
+        if(memcmp(Digest, pFrame->pData + 4, SHA256_DIGEST_SIZE) == 0){
+            info_status = BL_Save_App(Size, Hash, BOOTMETA_NO_VERSION);
         }
-        else{
-            /* Utilisation de huart1 */
-            HAL_UART_Transmit(&huart1, &addr_status, 1, HAL_MAX_DELAY);
+    }
+    BL_Tx_Put(&info_status, 1);
+}
+
+/* Application verifiee : nouvel enregistrement de demarrage */
+static uint8_t BL_Save_App(uint32_t Size, uint32_t Hash, uint32_t Version) {
+    BootMeta_Record Record;
+
+    if((Size == 0) || (Size > (CBL_APP_END - CBL_APP_BASE)) || !BL_App_Vector_Is_Sane(CBL_APP_BASE)){
+        return APP_INFO_DIGEST_FAILED;
+    }
+    memset(&Record, 0xFF, sizeof(Record));
+    Record.Magic = BOOTMETA_MAGIC;
+    Record.App_Size = Size;
+    Record.App_Hash = Hash;
+    Record.App_Valid = BOOTMETA_APP_VALID;
+    Record.Update_Request = BOOTMETA_NO_REQUEST;
+    Record.App_Version = Version;
+    return (BootMeta_Append(&Record) == HAL_OK) ? APP_INFO_SAVED : APP_INFO_DIGEST_FAILED;
+}
+
+/*
+ * Fin d'ecriture d'un composant du manifeste : addr = debut de la region,
+ * data = id | version | taille | SHA-256. Les composants sont ecrits dans un
+ * ordre quelconque, le hash est donc calcule sur la region en Flash. L'id 0
+ * est l'application et suit les regles de SET_APP_INFO.
+ */
+static void BL_Set_Comp_Info(const Proto_Frame *pFrame) {
+    uint8_t info_status = APP_INFO_DIGEST_FAILED;
+    const BootMeta_Component *List[BOOTMETA_MAX_COMPONENTS];
+    BootMeta_Component Component;
+    uint8_t Digest[SHA256_DIGEST_SIZE];
+    uint32_t Count, i;
+
+    BL_Send_ACK(1);
+
+    if((pFrame->Count == 12 + SHA256_DIGEST_SIZE) && Proto_Data_Ok(pFrame)){
+        memset(&Component, 0xFF, sizeof(Component));
+        Component.Id = Proto_Get_U32(pFrame->pData);
+        Component.Version = Proto_Get_U32(pFrame->pData + 4);
+        Component.Address = pFrame->Address;
+        Component.Size = Proto_Get_U32(pFrame->pData + 8);
+
+        if((Component.Address >= CBL_APP_BASE) && (Component.Address < CBL_APP_END) &&
+           (Component.Size > 0) && (Component.Size <= CBL_APP_END - Component.Address)){
+            Sha256_Context Ctx;
+
+            Sha256_Init(&Ctx);
+            Sha256_Update(&Ctx, (const uint8_t *)Component.Address, Component.Size);
+            Sha256_Final(&Ctx, Digest);
+            memcpy(&Component.Hash, Digest, 4);
+
+            if(memcmp(Digest, pFrame->pData + 12, SHA256_DIGEST_SIZE) == 0){
+                if(Component.Id == 0){
+                    /* L'application ne se deplace pas */
+                    if(Component.Address == CBL_APP_BASE){
+                        info_status = BL_Save_App(Component.Size, Component.Hash, Component.Version);
+                    }
+                }
+                else{
+                    /* Table pleine : un nouvel id n'a pas de place dans le journal */
+                    Count = BootMeta_ListComponents(List, BOOTMETA_MAX_COMPONENTS);
+                    for(i = 0; (i < Count) && (List[i]->Id != Component.Id); i++){}
+                    Component.Valid = BOOTMETA_APP_VALID;
+                    if(((i < Count) || (Count < BOOTMETA_MAX_COMPONENTS)) &&
+                       (BootMeta_SetComponent(&Component) == HAL_OK)){
+                        info_status = APP_INFO_SAVED;
+                    }
+                }
+            }
         }
     }
+    BL_Tx_Put(&info_status, 1);
+}
+
+/* Application valide (id 0) puis composants valides, PROTO_COMP_INFO_SIZE octets chacun */
+static void BL_Get_Components(const Proto_Frame *pFrame) {
+    const BootMeta_Record *Active = BootMeta_Get();
+    const BootMeta_Component *List[BOOTMETA_MAX_COMPONENTS];
+    uint8_t Reply[PROTO_MAX_COMPONENTS * PROTO_COMP_INFO_SIZE];
+    uint8_t *p = Reply;
+    uint32_t Count;
+
+    (void)pFrame;
+    if((Active != NULL) && (Active->App_Valid == BOOTMETA_APP_VALID)){
+        p[0] = 0;
+        Proto_Put_U32(&p[1], Active->App_Version);
+        Proto_Put_U32(&p[5], CBL_APP_BASE);
+        Proto_Put_U32(&p[9], Active->App_Size);
+        Proto_Put_U32(&p[13], Active->App_Hash);
+        p += PROTO_COMP_INFO_SIZE;
+    }
+    Count = BootMeta_ListComponents(List, BOOTMETA_MAX_COMPONENTS);
+    for(uint32_t i = 0; i < Count; i++){
+        p[0] = (uint8_t)List[i]->Id;
+        Proto_Put_U32(&p[1], List[i]->Version);
+        Proto_Put_U32(&p[5], List[i]->Address);
+        Proto_Put_U32(&p[9], List[i]->Size);
+        Proto_Put_U32(&p[13], List[i]->Hash);
+        p += PROTO_COMP_INFO_SIZE;
+    }
+    BL_Send_ACK((uint8_t)(p - Reply));
+    BL_Tx_Put(Reply, (uint16_t)(p - Reply));
+}
+
+/*
+ * Relecture de [Address, Address + Longueur) : statut et taille de
+ * l'application valide (0 sinon), puis la plage en blocs ACK | n | data | crc
+ * envoyes a la suite, sans attendre l'hote entre deux blocs. Une longueur
+ * nulle ne renvoie que l'en-tete (taille de l'application a sauvegarder).
+ * Chaque bloc porte son CRC : l'hote relance la lecture depuis le premier
+ * bloc corrompu au lieu de tout reprendre.
+ */
+static void BL_Mem_Read(const Proto_Frame *pFrame) {
+    const BootMeta_Record *Active = BootMeta_Get();
+    uint8_t Reply[5];
+    uint8_t Block_Head[2];
+    uint8_t Block_Crc[PROTO_CRC_SIZE];
+    uint32_t Address = pFrame->Address;
+    uint32_t Length = 0;
+    uint32_t App_Size = 0;
+
+    Reply[0] = ADDRESS_IS_INVALID;
+    if((pFrame->Count == 4) && Proto_Data_Ok(pFrame)){
+        Length = Proto_Get_U32(pFrame->pData);
+        /* Flash uniquement, la RAM du bootloader n'a rien a faire chez l'hote */
+        if((Address >= FLASH_BASE) && (Address <= FLASH_GEO_END) && (Length <= FLASH_GEO_END - Address)){
+            Reply[0] = ADDRESS_IS_VALID;
+        }
+    }
+    if((Active != NULL) && (Active->App_Valid == BOOTMETA_APP_VALID)){
+        App_Size = Active->App_Size;
+    }
+    Proto_Put_U32(&Reply[1], App_Size);
+
+    BL_Send_ACK(sizeof(Reply));
+    BL_Tx_Put(Reply, sizeof(Reply));
+    if(Reply[0] != ADDRESS_IS_VALID) return;
+
+    Block_Head[0] = SEND_ACK;
+    while(Length > 0){
+        Block_Head[1] = (Length > PROTO_READ_BLOCK) ? PROTO_READ_BLOCK : (uint8_t)Length;
+        Proto_Put_U32(Block_Crc, Proto_Crc((const uint8_t *)Address, Block_Head[1]));
+
+        BL_Tx_Put(Block_Head, sizeof(Block_Head));
+        BL_Tx_Put((const uint8_t *)Address, Block_Head[1]);
+        BL_Tx_Put(Block_Crc, sizeof(Block_Crc));
+
+        Address += Block_Head[1];
+        Length -= Block_Head[1];
+    }
+}
+
+/* Trames a traiter selon l'etat de la session sur le bus */
+static uint8_t BL_Bus_Accepts(uint8_t Command) {
+    switch(Bus_Mode){
+        case BL_BUS_IDLE:
+            return (Command == CBL_SELECT_CMD) || (Command == CBL_DISCOVER_CMD);
+        case BL_BUS_BROADCAST:
+            return (Command == CBL_SELECT_CMD) || (Command == CBL_FLASH_ERASE_CMD) ||
+                   (Command == CBL_MEM_WRITE_CMD);
+        default:
+            return 1;
+    }
+}
+
+/* Bloc ecrit : note dans le bitmap si l'adresse tombe sur un debut de bloc */
+static void BL_Bus_Mark(uint32_t Address) {
+    uint32_t Block;
+
+    /* Recu en diffusion : les reparations suivront dans le desordre */
+    if(Bus_Mode == BL_BUS_BROADCAST) Bus_Flash_Hash = 1;
+    if((Bus_Block_Size == 0) || (Address < CBL_APP_BASE) ||
+       ((Address - CBL_APP_BASE) % Bus_Block_Size != 0)){
+        return;
+    }
+    Block = (Address - CBL_APP_BASE) / Bus_Block_Size;
+    if(Block < CBL_BUS_BITMAP_SIZE * 8U){
+        Bus_Bitmap[Block / 8U] |= (uint8_t)(1U << (Block % 8U));
+    }
+}
+
+/*
+ * Diffusion (addr = PROTO_NODE_BROADCAST) : nouveau bitmap, aucune reponse.
+ * Sinon seul le noeud designe repond, avec son identifiant.
+ */
+static void BL_Select(const Proto_Frame *pFrame) {
+    uint8_t Reply[4];
+
+    if(pFrame->Address == PROTO_NODE_BROADCAST){
+        Bus_Mode = BL_BUS_BROADCAST;
+        Bus_Block_Size = 0;
+        if((pFrame->Count == 4) && Proto_Data_Ok(pFrame)){
+            Bus_Block_Size = Proto_Get_U32(pFrame->pData);
+        }
+        memset(Bus_Bitmap, 0, sizeof(Bus_Bitmap));
+        return;
+    }
+    if(pFrame->Address != Node_Id){
+        Bus_Mode = BL_BUS_IDLE;
+        return;
+    }
+    Bus_Mode = BL_BUS_SELECTED;
+    Proto_Put_U32(Reply, Node_Id);
+    BL_Send_ACK(sizeof(Reply));
+    BL_Tx_Put(Reply, sizeof(Reply));
+}
+
+/* Page du bitmap a partir de l'octet addr, vide au-dela de la fin */
+static void BL_Get_Bitmap(const Proto_Frame *pFrame) {
+    uint32_t Offset = pFrame->Address;
+    uint8_t Len = 0;
+
+    if(Offset < CBL_BUS_BITMAP_SIZE){
+        Len = (CBL_BUS_BITMAP_SIZE - Offset > PROTO_BITMAP_PAGE) ? PROTO_BITMAP_PAGE
+                                                                  : (uint8_t)(CBL_BUS_BITMAP_SIZE - Offset);
+    }
+    BL_Send_ACK(Len);
+    if(Len > 0) BL_Tx_Put(&Bus_Bitmap[Offset], Len);
+}
+
+/* Reponse si l'identifiant est dans [addr, data] ; le CRC revele les collisions */
+static void BL_Discover(const Proto_Frame *pFrame) {
+    uint8_t Reply[8];
+
+    if((pFrame->Count != 4) || !Proto_Data_Ok(pFrame)) return;
+    if((Node_Id < pFrame->Address) || (Node_Id > Proto_Get_U32(pFrame->pData))) return;
+
+    Proto_Put_U32(&Reply[0], Node_Id);
+    Proto_Put_U32(&Reply[4], Proto_Crc(Reply, 4));
+    BL_Send_ACK(sizeof(Reply));
+    BL_Tx_Put(Reply, sizeof(Reply));
+}
+
+#if defined(BL_STAGING)
+/* SHA-256 complet d'une zone Flash compare a celui de la demande */
+static uint8_t BL_Hash_Matches(uint32_t Address, uint32_t Size, const uint8_t *Expected) {
+    Sha256_Context Ctx;
+    uint8_t Digest[SHA256_DIGEST_SIZE];
+
+    Sha256_Init(&Ctx);
+    Sha256_Update(&Ctx, (const uint8_t *)Address, Size);
+    Sha256_Final(&Ctx, Digest);
+    return memcmp(Digest, Expected, SHA256_DIGEST_SIZE) == 0;
+}
+
+/*
+ * Image deposee en staging par UpdateAgent pendant que l'application
+ * tournait : seule la recopie reste a faire ici. Le staging n'est jamais
+ * efface par la recopie, une coupure pendant celle-ci la fait reprendre au
+ * demarrage suivant. Chaque recopie commencee est comptee dans la demande :
+ * apres BOOTMETA_MAX_ATTEMPTS echecs, la demande est abandonnee et le
+ * bootloader attend une mise a jour (l'application a deja ete effacee).
+ */
+static void BL_Install_Staged(void) {
+    const BootMeta_Staged *Staged = BootMeta_GetStaged();
+    const BootMeta_Record *Active;
+    BootMeta_Record Record;
+    HAL_StatusTypeDef Hal_status = HAL_OK;
+    uint32_t Size, First, Sectors;
+
+    if(Staged == NULL) return;
+    Size = Staged->Size;
+
+    /* Staging corrompu : on abandonne la demande, l'application en place reste */
+    if((Size == 0) || (Size > BOOTMETA_STAGING_SIZE) || (Size > CBL_APP_END - CBL_APP_BASE) ||
+       !BL_Hash_Matches(BOOTMETA_STAGING_ADDRESS, Size, Staged->Digest) ||
+       (BootMeta_StagedAttempts(Staged) >= BOOTMETA_MAX_ATTEMPTS)){
+        BootMeta_ClearStaged(Staged);
+        return;
+    }
+
+    /* Seuls les secteurs de l'image sont effaces : les composants au-dela restent */
+    if((BootMeta_CountAttempt(Staged) != HAL_OK) ||
+       !FlashGeo_SectorRange(CBL_APP_BASE, CBL_APP_BASE + Size, &First, &Sectors) ||
+       (Perform_Flash_Erase(CBL_APP_BASE, (uint8_t)Sectors) != SUCCESSFUL_ERASE)) return;
+
+    FlashDrv_Unlock();
+    for(uint32_t Offset = 0; (Offset < Size) && (Hal_status == HAL_OK); Offset += 4){
+        Hal_status = FlashDrv_Program_Word(CBL_APP_BASE + Offset,
+                                           *(volatile uint32_t *)(BOOTMETA_STAGING_ADDRESS + Offset));
+    }
+    FlashDrv_Lock();
+
+    if((Hal_status != HAL_OK) || !BL_Hash_Matches(CBL_APP_BASE, Size, Staged->Digest) ||
+       !BL_App_Vector_Is_Sane(CBL_APP_BASE)){
+        return;
+    }
+
+    Active = BootMeta_Get();
+    if(Active != NULL){
+        Record = *Active;
+    }
     else{
-        BL_Send_NACK();
+        memset(&Record, 0xFF, sizeof(Record));
+    }
+    Record.App_Size = Size;
+    memcpy(&Record.App_Hash, Staged->Digest, 4);
+    Record.App_Valid = BOOTMETA_APP_VALID;
+    Record.Update_Request = BOOTMETA_NO_REQUEST;
+    Record.App_Version = BOOTMETA_NO_VERSION;
+    if(BootMeta_Append(&Record) == HAL_OK){
+        Staged = BootMeta_GetStaged();     /* Le journal a pu etre compacte */
+        if(Staged != NULL) BootMeta_ClearStaged(Staged);
     }
 }
+#endif /* BL_STAGING */
+
+/*
+ * Decision de demarrage, appelee une fois depuis main() avant la boucle de
+ * commandes. Application valide en cache et aucune demande de mise a jour :
+ * l'hote dispose de CBL_BOOT_KNOCK_WINDOW_MS pour envoyer CBL_KNOCK_BYTE,
+ * sinon saut direct a l'application. Sans application valide, on reste en
+ * bootloader (les knocks sont alors ignores par BL_FeatchHostCommand()).
+ */
+void BL_Boot(void) {
+    uint8_t Knock = 0;
+
+    BL_Stream_Reset();
+#if defined(PROTO_CRC_HW)
+    __HAL_RCC_CRC_CLK_ENABLE();     /* Sans MX_CRC_Init() ni HAL_CRC_MspInit() */
+#endif
+    Node_Id = Proto_Crc((const uint8_t *)UID_BASE, 12);
+#if defined(BL_STAGING)
+    BL_Install_Staged();
+#endif
+
+    if(!BootMeta_IsAppBootable() || !BL_App_Vector_Is_Sane(CBL_APP_BASE)) return;
+
+    if((Transport_Receive(&Knock, 1, CBL_BOOT_KNOCK_WINDOW_MS) == HAL_OK) &&
+       (Knock == CBL_KNOCK_BYTE)){
+        BL_Send_ACK(0);
+        /* Vide la fin de la rafale de knocks avant d'attendre les trames */
+        while(Transport_Receive(&Knock, 1, CBL_KNOCK_IDLE_MS) == HAL_OK);
+        return;
+    }
+
+    BL_Jump_To_Application(CBL_APP_BASE);
+}
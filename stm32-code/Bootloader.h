@@ -10,30 +10,52 @@
 #ifndef INC_BOOTLOADER_H_
 #define INC_BOOTLOADER_H_
 
+/* Build compact : CRC des trames par l'unite materielle, sans la table de 1 KB */
+#if defined(BL_COMPACT) && !defined(PROTO_CRC_HW)
+#define PROTO_CRC_HW
+#endif
+
 #include "string.h"
 #include "stdio.h"
 #include <stdint.h>
 #include <stdarg.h>
 #include "stm32f4xx_hal.h"
-
-/* --- Commandes du Bootloader --- */
-#define CBL_GET_VER_CMD       0x10
-#define CBL_GET_HELP_CMD      0x11
-#define CBL_GET_CID_CMD       0x12
-#define CBL_GO_TO_ADDR_CMD    0x14
-#define CBL_FLASH_ERASE_CMD   0x15
-#define CBL_MEM_WRITE_CMD     0x16
+#include "BootMeta.h"
+#include "Sha256.h"
+#include "FlashDriver.h"
+#include "FotaProto.h"
+#include "Transport.h"
+
+/* --- Commandes du Bootloader (codes et format de trame : common/FotaProto.h) --- */
+#define CBL_GET_VER_CMD       PROTO_CMD_GET_VER
+#define CBL_GET_HELP_CMD      PROTO_CMD_GET_HELP
+#define CBL_GET_CID_CMD       PROTO_CMD_GET_CID
+#define CBL_GO_TO_ADDR_CMD    PROTO_CMD_GO_TO_ADDR
+#define CBL_FLASH_ERASE_CMD   PROTO_CMD_FLASH_ERASE
+#define CBL_MEM_WRITE_CMD     PROTO_CMD_MEM_WRITE
+#define CBL_MEM_WRITE_LZ_CMD  PROTO_CMD_MEM_WRITE_LZ   /* Bloc compresse (tools/fwpack.py), decompresse a la volee */
+#define CBL_SET_APP_INFO_CMD  PROTO_CMD_SET_APP_INFO   /* Taille + SHA-256 du flux image : valide l'application */
+#define CBL_MEM_READ_CMD      PROTO_CMD_MEM_READ       /* Relecture d'une plage Flash en blocs PROTO_READ_BLOCK */
+#define CBL_SELECT_CMD        PROTO_CMD_SELECT         /* Bus multipoint : noeud selectionne ou diffusion muette */
+#define CBL_GET_BITMAP_CMD    PROTO_CMD_GET_BITMAP     /* Blocs recus pendant la diffusion */
+#define CBL_DISCOVER_CMD      PROTO_CMD_DISCOVER       /* Noeuds dont l'identifiant est dans une plage */
+#define CBL_SET_COMP_INFO_CMD PROTO_CMD_SET_COMP_INFO  /* Composant d'un manifeste FMF1 ecrit et verifie */
+#define CBL_GET_COMPONENTS_CMD PROTO_CMD_GET_COMPONENTS /* Application et composants valides */
+
+/* --- Demarrage rapide --- */
+#define CBL_KNOCK_BYTE            PROTO_KNOCK  /* Jamais une longueur de trame valide (>= HOSTM_MAX_SIZE) */
+#define CBL_BOOT_KNOCK_WINDOW_MS  5     /* Fenetre laissee a l'hote avant le saut automatique */
+#define CBL_KNOCK_IDLE_MS         2     /* Ligne muette = fin de la rafale de knocks */
 
 /* --- Réponses ACK/NACK --- */
-#define SEND_NACK   0xAB
-#define SEND_ACK    0xCD
-
-/* --- Status CRC --- */
-#define CRC_VERIFING_FAILED   0x00
-#define CRC_VERIFING_PASS     0X01
+#define SEND_NACK   PROTO_NACK
+#define SEND_ACK    PROTO_ACK
 
 /* --- Paramètres Buffer --- */
-#define HOSTM_MAX_SIZE        200
+#define HOSTM_MAX_SIZE        PROTO_MAX_FRAME
+#define CBL_BUS_BITMAP_SIZE   512   /* 4096 blocs : toute la Flash en blocs de 128 octets */
+#define CBL_BUS_BYTE_TIMEOUT_MS 2   /* Bus : silence dans une trame = trame abandonnee */
+#define CBL_POINT_BYTE_TIMEOUT_MS 5 /* Point a point : idem, marge pour les adaptateurs USB-serie (paquets de 1 ms) */
 
 /* --- Version --- */
 #define CBL_VENDOR_ID         100
@@ -41,8 +63,8 @@
 #define CBL_SW_MINOR_VERSION  1
 #define CBL_SW_PATCH_VERSION  0
 
-/* --- Paramètres Flash STM32F401RE --- */
-#define CBL_FLASH_MAX_PAGE_NUMBER   8
+/* --- Paramètres Flash (reference choisie dans FlashGeometry.h) --- */
+#define CBL_FLASH_MAX_PAGE_NUMBER   FLASH_GEO_SECTOR_COUNT
 
 /*
  * CRITIQUE : Doit être 0xFFFFFFFF pour correspondre à l'adresse envoyée par l'ESP32
@@ -62,11 +84,25 @@
 #define ADDRESS_IS_INVALID          0x00
 #define ADDRESS_IS_VALID            0x01
 
-/* --- Mapping Mémoire STM32F401 --- */
-#define STM32F401_SRAM_SIZE     (96 * 1024)
-#define STM32F401_FLASH_SIZE    (512 * 1024)
-#define STM32F401_SRAM_END      (SRAM_BASE + STM32F401_SRAM_SIZE)
-#define STM32F401_FLASH_END     (FLASH_BASE + STM32F401_FLASH_SIZE)
+/* --- Decompression LZ (format bloc LZ4 : token, literals, offset 16 bits) --- */
+#define CBL_LZ_MIN_MATCH            4
+
+/*
+ * --- Zone application : du secteur 2 au journal (dernier secteur) ---
+ * Avec BL_STAGING, elle s'arrete au secteur de staging qui recoit les images
+ * de UpdateAgent. En BL_COMPACT, le journal est en secteur 1 et la zone va
+ * jusqu'a la fin de la Flash ou au staging (BootMeta.h).
+ */
+#define CBL_APP_FIRST_SECTOR        2U
+#define CBL_APP_BASE                BOOTMETA_APP_ADDRESS
+#define CBL_APP_END                 BOOTMETA_APP_END
+#define CBL_APP_SECTOR_COUNT        (BOOTMETA_APP_END_SECTOR - CBL_APP_FIRST_SECTOR)
+
+_Static_assert(CBL_APP_END > CBL_APP_BASE, "No room left for the application");
+
+#define APP_INFO_DIGEST_FAILED      0x00
+#define APP_INFO_SAVED              0x01
+
 
 /* --- Enum Status --- */
 typedef enum{
@@ -75,8 +111,11 @@ typedef enum{
 } BL_status;
 
 /* --- Prototypes Publics (Appelés par main.c) --- */
+#if !defined(BL_COMPACT)
 void BL_SendMessage(char *format,...);
+#endif
 BL_status BL_FeatchHostCommand();
+void BL_Boot(void);
 
 /*
  * Note : Les autres fonctions (Perform_Flash_Erase, BL_Write_Data, etc.)
@@ -85,94 +124,3 @@ BL_status BL_FeatchHostCommand();
  */
 
 #endif /* INC_BOOTLOADER_H_ */
-
-
-
-
-///*
-// * Bootloader.h
-// *
-// *  Created on: Dec 5, 2025
-// *      Author: hendb
-// */
-//
-//#ifndef INC_BOOTLOADER_H_
-//#define INC_BOOTLOADER_H_
-//
-//#include "string.h"
-//#include "stdio.h"
-//#include <stdint.h>
-//#include <stdarg.h>
-//#include "stm32f4xx_hal.h"
-//
-//
-//
-//#define CBL_GET_VER_CMD    0x10
-//#define CBL_GET_HELP_CMD    0x11
-//#define CBL_GET_CID_CMD    0x12
-//#define CBL_GO_TO_ADDR_CMD    0x14
-//#define CBL_FLASH_ERASE_CMD    0x15
-//#define CBL_MEM_WRITE_CMD    0x16
-//
-//#define SEND_NACK   0xAB
-//#define SEND_ACK   0xCD
-//
-//
-//
-//
-//
-//
-//
-//#define CRC_VERIFING_FAILED   0x00
-//#define CRC_VERIFING_PASS     0X01
-//#define HOSTM_MAX_SIZE     200
-//
-//#define CBL_VENDOR_ID    	  100
-//#define CBL_SW_MAJOR_VERSION  1
-//#define CBL_SW_MINOR_VERSION  1
-//#define CBL_SW_PATCH_VERSION  0
-//
-//
-//#define CBL_FLASH_MAX_PAGE_NUMBER   8
-//#define CBL_FLASH_MASS_ERASE        0xFF
-//
-//#define HAL_SUCCESSFUL_ERASE 0xFFFFFFFFU
-//
-//#define INVALID_PAGE_NUMBER           0x00
-//#define VALID_PAGE_NUMBER             0x01
-//#define UNSUCCESSFUL_ERASE            0x02
-//#define SUCCESSFUL_ERASE              0x03
-//
-//#define FLASH_PAYLOAD_WRITE_FAILED    0x00
-//#define FLASH_PAYLOAD_WRITE_PASSED    0x01
-//
-//#define  ADDRESS_IS_INVALID   0x00
-//#define  ADDRESS_IS_VALID     0x01
-//
-//#define STM32F401_SRAM_SIZE     (96 * 1024)
-//#define STM32F401_FLASH_SIZE     (512* 1024)
-//#define STM32F401_SRAM_END      (	SRAM_BASE  + STM32F401_SRAM_SIZE)
-//#define STM32F401_FLASH_END     (FLASH_BASE   + STM32F401_FLASH_SIZE)
-//
-//
-//
-//
-//
-//typedef enum{
-//	BL_NACK=0,
-//	BL_ACK
-//}BL_status;
-//
-//
-//
-//
-//void BL_SendMessage(char *format,...);
-//static void BL_Go_To_Addr(uint8_t *Host_buffer) ;
-//BL_status BL_FeatchHostCommand();
-//static uint8_t Perform_Flash_Erase(uint32_t PageAddress, uint8_t page_Number);
-///* Dans Bootloader.h */
-//static uint8_t FlashMemory_Payload_Write(uint8_t* pdata, uint32_t StartAddress, uint8_t payloadlen);
-//static uint32_t BL_CRC_verify(uint8_t *pdata,uint32_t  DataLen , uint32_t HostCRC);
-//static void BL_Get_Help(uint8_t *Host_buffer);
-//
-//#endif /* INC_BOOTLOADER_H_ */
@@ -0,0 +1,131 @@
+/*
+ * FlashDriver.c
+ *
+ *  Programmation et effacement Flash (FlashDriver.h). Les appelants
+ *  deverrouillent avec FlashDrv_Unlock() et reverrouillent avec
+ *  FlashDrv_Lock() autour d'une serie d'operations, comme avec la HAL.
+ */
+#include "FlashDriver.h"
+
+#if !defined(BL_COMPACT)
+
+HAL_StatusTypeDef FlashDrv_Unlock(void){
+    return HAL_FLASH_Unlock();
+}
+
+void FlashDrv_Lock(void){
+    HAL_FLASH_Lock();
+}
+
+HAL_StatusTypeDef FlashDrv_Program_Word(uint32_t Address, uint32_t Data){
+    return HAL_FLASH_Program(FLASH_TYPEPROGRAM_WORD, Address, Data);
+}
+
+HAL_StatusTypeDef FlashDrv_Program_Byte(uint32_t Address, uint8_t Data){
+    return HAL_FLASH_Program(FLASH_TYPEPROGRAM_BYTE, Address, Data);
+}
+
+/* HAL_OK seulement si tous les secteurs sont effaces */
+HAL_StatusTypeDef FlashDrv_Erase(uint32_t First_Sector, uint32_t Count){
+    FLASH_EraseInitTypeDef EraseInit;
+    uint32_t SectorError = 0;
+    HAL_StatusTypeDef Hal_status;
+
+    EraseInit.TypeErase = FLASH_TYPEERASE_SECTORS;
+    EraseInit.Banks = FLASH_BANK_1;
+    EraseInit.VoltageRange = FLASH_VOLTAGE_RANGE_3;
+    EraseInit.Sector = First_Sector;
+    EraseInit.NbSectors = Count;
+
+    Hal_status = HAL_FLASHEx_Erase(&EraseInit, &SectorError);
+    return ((Hal_status == HAL_OK) && (SectorError == 0xFFFFFFFFU)) ? HAL_OK : HAL_ERROR;
+}
+
+#else /* BL_COMPACT */
+
+/* Memes drapeaux que HAL_FLASH_Program / HAL_FLASHEx_Erase, sans la structure pFlash */
+#define FLASHDRV_ERRORS  (FLASH_FLAG_OPERR | FLASH_FLAG_WRPERR | FLASH_FLAG_PGAERR | \
+                          FLASH_FLAG_PGPERR | FLASH_FLAG_PGSERR)
+
+static HAL_StatusTypeDef FlashDrv_Wait(void);
+static HAL_StatusTypeDef FlashDrv_Program(uint32_t Address, uint32_t Data, uint32_t Psize);
+static void FlashDrv_Flush_Caches(void);
+
+/* Fin de l'operation en cours ; les drapeaux (ecriture de 1) sont effaces au passage */
+static HAL_StatusTypeDef FlashDrv_Wait(void){
+    uint32_t Status;
+
+    while(FLASH->SR & FLASH_SR_BSY);
+    Status = FLASH->SR;
+    FLASH->SR = Status & (FLASHDRV_ERRORS | FLASH_FLAG_EOP);
+    return (Status & FLASHDRV_ERRORS) ? HAL_ERROR : HAL_OK;
+}
+
+static HAL_StatusTypeDef FlashDrv_Program(uint32_t Address, uint32_t Data, uint32_t Psize){
+    HAL_StatusTypeDef Status = FlashDrv_Wait();
+
+    if(Status != HAL_OK) return Status;
+    FLASH->CR = (FLASH->CR & ~FLASH_CR_PSIZE) | Psize | FLASH_CR_PG;
+    if(Psize == FLASH_PSIZE_WORD){
+        *(volatile uint32_t *)Address = Data;
+    }
+    else{
+        *(volatile uint8_t *)Address = (uint8_t)Data;
+    }
+    Status = FlashDrv_Wait();
+    FLASH->CR &= ~FLASH_CR_PG;
+    return Status;
+}
+
+/* Comme FLASH_FlushCaches() : plus de ligne de cache sur un secteur efface */
+static void FlashDrv_Flush_Caches(void){
+    if(FLASH->ACR & FLASH_ACR_ICEN){
+        FLASH->ACR &= ~FLASH_ACR_ICEN;
+        FLASH->ACR |= FLASH_ACR_ICRST;
+        FLASH->ACR &= ~FLASH_ACR_ICRST;
+        FLASH->ACR |= FLASH_ACR_ICEN;
+    }
+    if(FLASH->ACR & FLASH_ACR_DCEN){
+        FLASH->ACR &= ~FLASH_ACR_DCEN;
+        FLASH->ACR |= FLASH_ACR_DCRST;
+        FLASH->ACR &= ~FLASH_ACR_DCRST;
+        FLASH->ACR |= FLASH_ACR_DCEN;
+    }
+}
+
+HAL_StatusTypeDef FlashDrv_Unlock(void){
+    if(FLASH->CR & FLASH_CR_LOCK){
+        FLASH->KEYR = FLASH_KEY1;
+        FLASH->KEYR = FLASH_KEY2;
+    }
+    return (FLASH->CR & FLASH_CR_LOCK) ? HAL_ERROR : HAL_OK;
+}
+
+void FlashDrv_Lock(void){
+    FLASH->CR |= FLASH_CR_LOCK;
+}
+
+HAL_StatusTypeDef FlashDrv_Program_Word(uint32_t Address, uint32_t Data){
+    return FlashDrv_Program(Address, Data, FLASH_PSIZE_WORD);
+}
+
+HAL_StatusTypeDef FlashDrv_Program_Byte(uint32_t Address, uint8_t Data){
+    return FlashDrv_Program(Address, Data, FLASH_PSIZE_BYTE);
+}
+
+/* Secteur par secteur en x32 (plage de tension 3, comme le build HAL) */
+HAL_StatusTypeDef FlashDrv_Erase(uint32_t First_Sector, uint32_t Count){
+    HAL_StatusTypeDef Status = FlashDrv_Wait();
+
+    for(uint32_t Sector = First_Sector; (Sector < First_Sector + Count) && (Status == HAL_OK); Sector++){
+        FLASH->CR = (FLASH->CR & ~(FLASH_CR_PSIZE | FLASH_CR_SNB)) |
+                    FLASH_PSIZE_WORD | FLASH_CR_SER | (Sector << FLASH_CR_SNB_Pos);
+        FLASH->CR |= FLASH_CR_STRT;
+        Status = FlashDrv_Wait();
+        FLASH->CR &= ~(FLASH_CR_SER | FLASH_CR_SNB);
+    }
+    FlashDrv_Flush_Caches();
+    return Status;
+}
+
+#endif /* BL_COMPACT */
@@ -0,0 +1,22 @@
+/*
+ * FlashDriver.h
+ *
+ *  Flash program / erase used by the bootloader and BootMeta. Default build:
+ *  thin wrappers over HAL_FLASH / HAL_FLASHEx. BL_COMPACT: direct FLASH
+ *  register access, so the HAL flash driver is not linked (see README,
+ *  "Compact build").
+ */
+
+#ifndef INC_FLASHDRIVER_H_
+#define INC_FLASHDRIVER_H_
+
+#include <stdint.h>
+#include "stm32f4xx_hal.h"
+
+HAL_StatusTypeDef FlashDrv_Unlock(void);
+void FlashDrv_Lock(void);
+HAL_StatusTypeDef FlashDrv_Program_Word(uint32_t Address, uint32_t Data);
+HAL_StatusTypeDef FlashDrv_Program_Byte(uint32_t Address, uint8_t Data);
+HAL_StatusTypeDef FlashDrv_Erase(uint32_t First_Sector, uint32_t Count);
+
+#endif /* INC_FLASHDRIVER_H_ */
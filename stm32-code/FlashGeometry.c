@@ -0,0 +1,51 @@
+/*
+ * FlashGeometry.c
+ *
+ *  Tables de la reference selectionnee dans FlashGeometry.h.
+ */
+#include "FlashGeometry.h"
+
+static const uint8_t FlashGeo_Map[] = { FLASH_GEO_MAP };
+static const uint32_t FlashGeo_Bases[] = { FLASH_GEO_BASES };
+
+_Static_assert(sizeof(FlashGeo_Map) == FLASH_GEO_SIZE / FLASH_GEO_GRANULE,
+               "FLASH_GEO_MAP must cover the whole flash");
+_Static_assert(sizeof(FlashGeo_Bases) / sizeof(FlashGeo_Bases[0]) == FLASH_GEO_SECTOR_COUNT + 1U,
+               "FLASH_GEO_BASES needs one start per sector plus the end of flash");
+
+/* Secteur contenant Address, ou FLASH_GEO_INVALID_SECTOR hors Flash */
+uint32_t FlashGeo_GetSector(uint32_t Address){
+    if((Address < FLASH_BASE) || (Address >= FLASH_GEO_END)){
+        return FLASH_GEO_INVALID_SECTOR;
+    }
+    return FlashGeo_Map[(Address - FLASH_BASE) / FLASH_GEO_GRANULE];
+}
+
+uint32_t FlashGeo_SectorAddress(uint32_t Sector){
+    if(Sector >= FLASH_GEO_SECTOR_COUNT){
+        return FLASH_GEO_INVALID_SECTOR;
+    }
+    return FLASH_BASE + FlashGeo_Bases[Sector];
+}
+
+uint32_t FlashGeo_SectorSize(uint32_t Sector){
+    if(Sector >= FLASH_GEO_SECTOR_COUNT){
+        return 0;
+    }
+    return FlashGeo_Bases[Sector + 1U] - FlashGeo_Bases[Sector];
+}
+
+/*
+ * Secteurs a effacer pour couvrir [Start, End). Retourne 0 si la plage est
+ * vide ou sort de la Flash.
+ */
+uint8_t FlashGeo_SectorRange(uint32_t Start, uint32_t End, uint32_t *First, uint32_t *Count){
+    uint32_t Last;
+
+    if(End <= Start) return 0;
+    *First = FlashGeo_GetSector(Start);
+    Last = FlashGeo_GetSector(End - 1U);
+    if((*First == FLASH_GEO_INVALID_SECTOR) || (Last == FLASH_GEO_INVALID_SECTOR)) return 0;
+    *Count = Last - *First + 1U;
+    return 1;
+}
@@ -0,0 +1,109 @@
+/*
+ * FlashGeometry.h
+ *
+ *  Flash / SRAM geometry of the supported STM32F4 parts, selected at compile
+ *  time from the CubeMX device define. Adding a part is one entry below.
+ *  Address-to-sector lookup is a single read in a table holding one byte per
+ *  16 KB granule, whatever the number of sectors.
+ */
+
+#ifndef INC_FLASHGEOMETRY_H_
+#define INC_FLASHGEOMETRY_H_
+
+#include <stdint.h>
+#include "stm32f4xx_hal.h"
+
+#define FLASH_GEO_GRANULE           (16U * 1024U)   /* Plus petit secteur F4 : unite de la table */
+#define FLASH_GEO_INVALID_SECTOR    0xFFFFFFFFU
+
+/*
+ * Briques communes aux F4 mono-banque : secteurs 0-3 de 16 KB, secteur 4 de
+ * 64 KB, puis secteurs de 128 KB (8 granules chacun).
+ */
+#define FG_X4(s)        s, s, s, s
+#define FG_X8(s)        FG_X4(s), FG_X4(s)
+#define FG_F4_MAP_HEAD  0, 1, 2, 3, FG_X4(4)
+#define FG_F4_BASE_16K  0x00000U, 0x04000U, 0x08000U, 0x0C000U
+#define FG_F4_BASE_HEAD FG_F4_BASE_16K, 0x10000U, 0x20000U
+
+/*
+ * Une entree par reference :
+ *  SIZE / SRAM_SIZE   : tailles en octets
+ *  SECTOR_COUNT       : nombre de secteurs
+ *  MAP                : secteur de chaque granule de 16 KB
+ *  LOW_BASES          : offset de debut de chaque secteur sauf les deux derniers
+ *  PREV_SECTOR_BASE   : offset de l'avant-dernier secteur (staging avec
+ *                       BL_STAGING)
+ *  LAST_SECTOR_BASE   : offset du dernier secteur (metadonnees de demarrage,
+ *                       staging en BL_COMPACT + BL_STAGING : BootMeta.h)
+ */
+#if defined(STM32F401xE)
+#define FLASH_GEO_PART              "STM32F401xE"
+#define FLASH_GEO_SIZE              (512U * 1024U)
+#define FLASH_GEO_SRAM_SIZE         (96U * 1024U)
+#define FLASH_GEO_SECTOR_COUNT      8U
+#define FLASH_GEO_MAP               FG_F4_MAP_HEAD, FG_X8(5), FG_X8(6), FG_X8(7)
+#define FLASH_GEO_LOW_BASES         FG_F4_BASE_HEAD
+#define FLASH_GEO_PREV_SECTOR_BASE  0x40000U
+#define FLASH_GEO_LAST_SECTOR_BASE  0x60000U
+
+#elif defined(STM32F401xC)
+#define FLASH_GEO_PART              "STM32F401xC"
+#define FLASH_GEO_SIZE              (256U * 1024U)
+#define FLASH_GEO_SRAM_SIZE         (64U * 1024U)
+#define FLASH_GEO_SECTOR_COUNT      6U
+#define FLASH_GEO_MAP               FG_F4_MAP_HEAD, FG_X8(5)
+#define FLASH_GEO_LOW_BASES         FG_F4_BASE_16K
+#define FLASH_GEO_PREV_SECTOR_BASE  0x10000U
+#define FLASH_GEO_LAST_SECTOR_BASE  0x20000U
+
+#elif defined(STM32F411xE)
+#define FLASH_GEO_PART              "STM32F411xE"
+#define FLASH_GEO_SIZE              (512U * 1024U)
+#define FLASH_GEO_SRAM_SIZE         (128U * 1024U)
+#define FLASH_GEO_SECTOR_COUNT      8U
+#define FLASH_GEO_MAP               FG_F4_MAP_HEAD, FG_X8(5), FG_X8(6), FG_X8(7)
+#define FLASH_GEO_LOW_BASES         FG_F4_BASE_HEAD
+#define FLASH_GEO_PREV_SECTOR_BASE  0x40000U
+#define FLASH_GEO_LAST_SECTOR_BASE  0x60000U
+
+#elif defined(STM32F446xx)
+/* F446RE ; la variante 256 KB partage la meme define CMSIS et n'est pas deployee */
+#define FLASH_GEO_PART              "STM32F446xE"
+#define FLASH_GEO_SIZE              (512U * 1024U)
+#define FLASH_GEO_SRAM_SIZE         (128U * 1024U)
+#define FLASH_GEO_SECTOR_COUNT      8U
+#define FLASH_GEO_MAP               FG_F4_MAP_HEAD, FG_X8(5), FG_X8(6), FG_X8(7)
+#define FLASH_GEO_LOW_BASES         FG_F4_BASE_HEAD
+#define FLASH_GEO_PREV_SECTOR_BASE  0x40000U
+#define FLASH_GEO_LAST_SECTOR_BASE  0x60000U
+
+#else
+#error "FlashGeometry.h : reference STM32 non decrite"
+#endif
+
+/*
+ * Table complete construite a partir des deux derniers secteurs : les
+ * offsets de staging et de metadonnees ne peuvent pas diverger de la table
+ * utilisee par FlashGeo_GetSector() (nombre d'entrees verifie dans
+ * FlashGeometry.c).
+ */
+#define FLASH_GEO_BASES             FLASH_GEO_LOW_BASES, FLASH_GEO_PREV_SECTOR_BASE, \
+                                    FLASH_GEO_LAST_SECTOR_BASE, FLASH_GEO_SIZE
+
+#define FLASH_GEO_END               (FLASH_BASE + FLASH_GEO_SIZE)
+#define FLASH_GEO_SRAM_END          (SRAM_BASE + FLASH_GEO_SRAM_SIZE)
+#define FLASH_GEO_LAST_SECTOR       (FLASH_GEO_SECTOR_COUNT - 1U)
+
+_Static_assert(FLASH_GEO_SIZE % FLASH_GEO_GRANULE == 0, "Flash size must be a whole number of granules");
+_Static_assert(FLASH_GEO_SECTOR_COUNT <= FLASH_GEO_SIZE / FLASH_GEO_GRANULE, "More sectors than granules");
+_Static_assert(FLASH_GEO_LAST_SECTOR_BASE % FLASH_GEO_GRANULE == 0, "Last sector not granule aligned");
+_Static_assert(FLASH_GEO_LAST_SECTOR_BASE < FLASH_GEO_SIZE, "Last sector outside flash");
+_Static_assert(FLASH_GEO_PREV_SECTOR_BASE < FLASH_GEO_LAST_SECTOR_BASE, "Sectors out of order");
+
+uint32_t FlashGeo_GetSector(uint32_t Address);
+uint32_t FlashGeo_SectorAddress(uint32_t Sector);
+uint32_t FlashGeo_SectorSize(uint32_t Sector);
+uint8_t FlashGeo_SectorRange(uint32_t Start, uint32_t End, uint32_t *First, uint32_t *Count);
+
+#endif /* INC_FLASHGEOMETRY_H_ */
@@ -0,0 +1,98 @@
+/*
+ * Sha256.c
+ *
+ *  SHA-256 logiciel (le STM32F401 n'a pas de peripherique HASH).
+ */
+#include <string.h>
+#include "Sha256.h"
+
+#define ROR(x, n)   (((x) >> (n)) | ((x) << (32 - (n))))
+
+static const uint32_t Sha256_K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static void Sha256_Transform(Sha256_Context *Ctx, const uint8_t *pBlock){
+    uint32_t W[64];
+    uint32_t a, b, c, d, e, f, g, h;
+
+    for(uint8_t i = 0; i < 16; i++){
+        W[i] = ((uint32_t)pBlock[4 * i] << 24) | ((uint32_t)pBlock[4 * i + 1] << 16) |
+               ((uint32_t)pBlock[4 * i + 2] << 8) | (uint32_t)pBlock[4 * i + 3];
+    }
+    for(uint8_t i = 16; i < 64; i++){
+        uint32_t s0 = ROR(W[i - 15], 7) ^ ROR(W[i - 15], 18) ^ (W[i - 15] >> 3);
+        uint32_t s1 = ROR(W[i - 2], 17) ^ ROR(W[i - 2], 19) ^ (W[i - 2] >> 10);
+        W[i] = W[i - 16] + s0 + W[i - 7] + s1;
+    }
+
+    a = Ctx->State[0]; b = Ctx->State[1]; c = Ctx->State[2]; d = Ctx->State[3];
+    e = Ctx->State[4]; f = Ctx->State[5]; g = Ctx->State[6]; h = Ctx->State[7];
+
+    for(uint8_t i = 0; i < 64; i++){
+        uint32_t S1 = ROR(e, 6) ^ ROR(e, 11) ^ ROR(e, 25);
+        uint32_t t1 = h + S1 + ((e & f) ^ (~e & g)) + Sha256_K[i] + W[i];
+        uint32_t S0 = ROR(a, 2) ^ ROR(a, 13) ^ ROR(a, 22);
+        uint32_t t2 = S0 + ((a & b) ^ (a & c) ^ (b & c));
+        h = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+
+    Ctx->State[0] += a; Ctx->State[1] += b; Ctx->State[2] += c; Ctx->State[3] += d;
+    Ctx->State[4] += e; Ctx->State[5] += f; Ctx->State[6] += g; Ctx->State[7] += h;
+}
+
+void Sha256_Init(Sha256_Context *Ctx){
+    static const uint32_t H0[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    memcpy(Ctx->State, H0, sizeof(H0));
+    Ctx->Length = 0;
+    Ctx->Fill = 0;
+}
+
+void Sha256_Update(Sha256_Context *Ctx, const uint8_t *pData, uint32_t Len){
+    Ctx->Length += Len;
+    while(Len > 0){
+        uint32_t n = SHA256_BLOCK_SIZE - Ctx->Fill;
+        if(n > Len) n = Len;
+        memcpy(&Ctx->Block[Ctx->Fill], pData, n);
+        Ctx->Fill += (uint8_t)n;
+        pData += n;
+        Len -= n;
+        if(Ctx->Fill == SHA256_BLOCK_SIZE){
+            Sha256_Transform(Ctx, Ctx->Block);
+            Ctx->Fill = 0;
+        }
+    }
+}
+
+void Sha256_Final(Sha256_Context *Ctx, uint8_t Digest[SHA256_DIGEST_SIZE]){
+    uint64_t Bits = Ctx->Length * 8;
+
+    Ctx->Block[Ctx->Fill++] = 0x80;
+    if(Ctx->Fill > SHA256_BLOCK_SIZE - 8){
+        memset(&Ctx->Block[Ctx->Fill], 0, SHA256_BLOCK_SIZE - Ctx->Fill);
+        Sha256_Transform(Ctx, Ctx->Block);
+        Ctx->Fill = 0;
+    }
+    memset(&Ctx->Block[Ctx->Fill], 0, SHA256_BLOCK_SIZE - 8 - Ctx->Fill);
+    for(uint8_t i = 0; i < 8; i++){
+        Ctx->Block[SHA256_BLOCK_SIZE - 1 - i] = (uint8_t)(Bits >> (8 * i));
+    }
+    Sha256_Transform(Ctx, Ctx->Block);
+
+    for(uint8_t i = 0; i < 8; i++){
+        Digest[4 * i]     = (uint8_t)(Ctx->State[i] >> 24);
+        Digest[4 * i + 1] = (uint8_t)(Ctx->State[i] >> 16);
+        Digest[4 * i + 2] = (uint8_t)(Ctx->State[i] >> 8);
+        Digest[4 * i + 3] = (uint8_t)(Ctx->State[i]);
+    }
+}
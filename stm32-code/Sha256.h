@@ -0,0 +1,27 @@
+/*
+ * Sha256.h
+ *
+ *  Compact incremental SHA-256 (FIPS 180-4) used to hash the image as it is
+ *  received, so verification needs no second pass over flash.
+ */
+
+#ifndef INC_SHA256_H_
+#define INC_SHA256_H_
+
+#include <stdint.h>
+
+#define SHA256_DIGEST_SIZE   32
+#define SHA256_BLOCK_SIZE    64
+
+typedef struct {
+    uint32_t State[8];
+    uint64_t Length;                    /* Octets traites */
+    uint8_t  Block[SHA256_BLOCK_SIZE];
+    uint8_t  Fill;
+} Sha256_Context;
+
+void Sha256_Init(Sha256_Context *Ctx);
+void Sha256_Update(Sha256_Context *Ctx, const uint8_t *pData, uint32_t Len);
+void Sha256_Final(Sha256_Context *Ctx, uint8_t Digest[SHA256_DIGEST_SIZE]);
+
+#endif /* INC_SHA256_H_ */
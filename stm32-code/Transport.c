@@ -0,0 +1,312 @@
+/*
+ * Transport.c
+ *
+ *  Liaison passerelle <-> bootloader selectionnee dans Transport.h.
+ *  Transport_Send() ne fait que mettre en file ; Transport_Flush() attend que
+ *  tout soit parti. Transport_Receive() bloque au plus Timeout ms.
+ */
+#include "Transport.h"
+#include <string.h>
+
+#if !defined(CBL_TRANSPORT_SPI) && !defined(BL_COMPACT)
+
+/* Anneau d'emission vide par interruption : les reponses partent pendant
+ * que la commande suivante (programmation Flash...) s'execute. Seule la
+ * boucle principale ecrit Tx_Head, seule l'interruption avance Tx_Tail. */
+static uint8_t Tx_Ring[CBL_TX_RING_SIZE];
+static volatile uint16_t Tx_Head = 0;
+static volatile uint16_t Tx_Tail = 0;
+static volatile uint16_t Tx_Busy = 0;     /* Octets confies a HAL_UART_Transmit_IT, 0 = UART libre */
+
+extern UART_HandleTypeDef huart1;
+
+/* Portion contigue suivante de l'anneau, si l'UART est libre (interruptions masquees ou depuis l'ISR) */
+static void Uart_Kick(void){
+    uint16_t Head = Tx_Head;
+    uint16_t Tail = Tx_Tail;
+    uint16_t Len;
+
+    if((Tx_Busy != 0) || (Head == Tail)) return;
+    Len = (Head > Tail) ? (Head - Tail) : (CBL_TX_RING_SIZE - Tail);
+    Tx_Busy = Len;
+    /* Reception en cours (verrou HAL) : relance au prochain Uart_Start() */
+    if(HAL_UART_Transmit_IT(&huart1, &Tx_Ring[Tail], Len) != HAL_OK){
+        Tx_Busy = 0;
+    }
+}
+
+static void Uart_Start(void){
+    __disable_irq();
+    Uart_Kick();
+    __enable_irq();
+}
+
+void HAL_UART_TxCpltCallback(UART_HandleTypeDef *huart){
+    if(huart != &huart1) return;
+    Tx_Tail = (Tx_Tail + Tx_Busy) % CBL_TX_RING_SIZE;
+    Tx_Busy = 0;
+    Uart_Kick();
+}
+
+/* Apres MX_USART1_UART_Init() : l'anneau ne se vide que par l'interruption */
+void Transport_Init(void){
+    HAL_NVIC_SetPriority(USART1_IRQn, 0, 0);
+    HAL_NVIC_EnableIRQ(USART1_IRQn);
+}
+
+HAL_StatusTypeDef Transport_Receive(uint8_t *pData, uint16_t Len, uint32_t Timeout){
+    return HAL_UART_Receive(&huart1, pData, Len, Timeout);
+}
+
+/* Copie dans l'anneau ; n'attend que si celui-ci est plein */
+void Transport_Send(const uint8_t *pData, uint16_t Len){
+    uint16_t Head = Tx_Head;
+
+    while(Len > 0){
+        uint16_t Next = (Head + 1U) % CBL_TX_RING_SIZE;
+        if(Next == Tx_Tail){
+            Tx_Head = Head;
+            Transport_Flush();
+            continue;
+        }
+        Tx_Ring[Head] = *pData++;
+        Head = Next;
+        Len--;
+    }
+    Tx_Head = Head;
+    Uart_Start();
+}
+
+/*
+ * Tout est sorti, dernier bit compris (rappel sur TC). Si l'interruption ne
+ * fait plus avancer l'anneau pendant CBL_TX_FLUSH_TIMEOUT_MS, le transfert
+ * en cours est annule et le reste part en emission bloquante.
+ */
+void Transport_Flush(void){
+    uint32_t Start = HAL_GetTick();
+    uint16_t Tail = Tx_Tail;
+    uint16_t Left;
+
+    while((Tx_Busy != 0) || (Tx_Head != Tx_Tail)){
+        Uart_Start();
+        if(Tx_Tail != Tail){
+            Tail = Tx_Tail;
+            Start = HAL_GetTick();
+        }
+        else if(HAL_GetTick() - Start >= CBL_TX_FLUSH_TIMEOUT_MS){
+            break;
+        }
+    }
+    if((Tx_Busy == 0) && (Tx_Head == Tx_Tail)) return;
+
+    /* Octets deja passes dans DR : Tx_Busy moins ce que la HAL n'a pas emis */
+    __disable_irq();
+    Left = (Tx_Busy != 0) ? huart1.TxXferCount : 0U;
+    HAL_UART_AbortTransmit(&huart1);
+    Tx_Tail = (Tx_Tail + Tx_Busy - Left) % CBL_TX_RING_SIZE;
+    Tx_Busy = 0;
+    __enable_irq();
+
+    while(Tx_Head != Tx_Tail){
+        uint16_t Head = Tx_Head;
+        uint16_t Len = (Head > Tx_Tail) ? (Head - Tx_Tail) : (CBL_TX_RING_SIZE - Tx_Tail);
+
+        HAL_UART_Transmit(&huart1, &Tx_Ring[Tx_Tail], Len, HAL_MAX_DELAY);
+        Tx_Tail = (Tx_Tail + Len) % CBL_TX_RING_SIZE;
+    }
+}
+
+void Transport_DeInit(void){
+    Transport_Flush();
+    HAL_UART_DeInit(&huart1);
+}
+
+#elif !defined(CBL_TRANSPORT_SPI)
+
+/* Build compact : USART1 par registres (PA9 TX, PA10 RX, AF7), sans
+ * HAL_UART. Meme anneau d'emission, vide octet par octet par l'interruption
+ * TXE ; la reception reste en scrutation. */
+static uint8_t Tx_Ring[CBL_TX_RING_SIZE];
+static volatile uint16_t Tx_Head = 0;
+static volatile uint16_t Tx_Tail = 0;
+
+void Transport_Init(void){
+    GPIO_InitTypeDef Gpio = {0};
+
+    __HAL_RCC_GPIOA_CLK_ENABLE();
+    __HAL_RCC_USART1_CLK_ENABLE();
+    Gpio.Pin = GPIO_PIN_9 | GPIO_PIN_10;
+    Gpio.Mode = GPIO_MODE_AF_PP;
+    Gpio.Pull = GPIO_NOPULL;
+    Gpio.Speed = GPIO_SPEED_FREQ_VERY_HIGH;
+    Gpio.Alternate = GPIO_AF7_USART1;
+    HAL_GPIO_Init(GPIOA, &Gpio);
+
+    /* 8N1, surechantillonnage x16 : BRR = PCLK2 / debit, arrondi */
+    USART1->BRR = (HAL_RCC_GetPCLK2Freq() + CBL_UART_BAUDRATE / 2U) / CBL_UART_BAUDRATE;
+    USART1->CR1 = USART_CR1_UE | USART_CR1_TE | USART_CR1_RE;
+    HAL_NVIC_SetPriority(USART1_IRQn, 0, 0);
+    HAL_NVIC_EnableIRQ(USART1_IRQn);
+}
+
+/* Remplace celui de stm32f4xx_it.c ("Generate IRQ handler" decoche pour USART1) */
+void USART1_IRQHandler(void){
+    if((USART1->CR1 & USART_CR1_TXEIE) && (USART1->SR & USART_SR_TXE)){
+        if(Tx_Tail != Tx_Head){
+            USART1->DR = Tx_Ring[Tx_Tail];
+            Tx_Tail = (Tx_Tail + 1U) % CBL_TX_RING_SIZE;
+        }
+        else{
+            USART1->CR1 &= ~USART_CR1_TXEIE;
+        }
+    }
+}
+
+/* RXNE en scrutation ; lire DR efface aussi un debordement (ORE) */
+HAL_StatusTypeDef Transport_Receive(uint8_t *pData, uint16_t Len, uint32_t Timeout){
+    uint32_t Start = HAL_GetTick();
+
+    while(Len > 0){
+        if(USART1->SR & USART_SR_RXNE){
+            *pData++ = (uint8_t)USART1->DR;
+            Len--;
+        }
+        else if((Timeout != HAL_MAX_DELAY) && (HAL_GetTick() - Start >= Timeout)){
+            return HAL_TIMEOUT;
+        }
+    }
+    return HAL_OK;
+}
+
+/* Copie dans l'anneau ; n'attend que si celui-ci est plein. L'interruption
+ * ne fait que couper TXEIE, le remettre ici est toujours sur. */
+void Transport_Send(const uint8_t *pData, uint16_t Len){
+    uint16_t Head = Tx_Head;
+
+    while(Len > 0){
+        uint16_t Next = (Head + 1U) % CBL_TX_RING_SIZE;
+        if(Next == Tx_Tail){
+            Tx_Head = Head;
+            USART1->CR1 |= USART_CR1_TXEIE;
+            continue;
+        }
+        Tx_Ring[Head] = *pData++;
+        Head = Next;
+        Len--;
+    }
+    Tx_Head = Head;
+    USART1->CR1 |= USART_CR1_TXEIE;
+}
+
+/* Anneau vide et dernier octet sorti (TC) */
+void Transport_Flush(void){
+    while((Tx_Head != Tx_Tail) || !(USART1->SR & USART_SR_TC));
+}
+
+void Transport_DeInit(void){
+    Transport_Flush();
+    HAL_NVIC_DisableIRQ(USART1_IRQn);
+    __HAL_RCC_USART1_FORCE_RESET();
+    __HAL_RCC_USART1_RELEASE_RESET();
+}
+
+#else /* CBL_TRANSPORT_SPI */
+
+/* SPI1 esclave, NSS materiel, DMA RX et TX (CubeMX) */
+static uint8_t Spi_Tx[CBL_SPI_XFER_SIZE];
+static uint8_t Spi_Rx[CBL_SPI_XFER_SIZE];
+static uint16_t Tx_Fill = 0;              /* Octets en attente dans Spi_Tx[1..] */
+
+/* Flux recu, consomme par Transport_Receive() */
+static uint8_t Rx_Ring[CBL_SPI_RX_SIZE];
+static uint16_t Rx_Head = 0;
+static uint16_t Rx_Tail = 0;
+
+extern SPI_HandleTypeDef hspi1;
+
+/*
+ * Un echange : le DMA est arme avec les octets en attente, la ligne ready
+ * levee, puis on attend que le maitre ait cadence les CBL_SPI_XFER_SIZE
+ * octets. Sans maitre dans le delai, l'echange est annule et les octets a
+ * emettre restent en attente.
+ */
+static HAL_StatusTypeDef Spi_Exchange(uint32_t Timeout){
+    uint32_t Start = HAL_GetTick();
+    uint16_t Free = (Rx_Tail + CBL_SPI_RX_SIZE - Rx_Head - 1U) % CBL_SPI_RX_SIZE;
+    uint8_t Count;
+
+    /* Le maitre n'envoie une trame qu'apres la reponse a la precedente :
+     * le flux recu a toujours la place d'un echange */
+    if(Free < CBL_SPI_XFER_SIZE - 1U) return HAL_BUSY;
+
+    Spi_Tx[0] = (uint8_t)Tx_Fill;
+    memset(&Spi_Tx[1 + Tx_Fill], 0xFF, CBL_SPI_XFER_SIZE - 1U - Tx_Fill);
+    if(HAL_SPI_TransmitReceive_DMA(&hspi1, Spi_Tx, Spi_Rx, CBL_SPI_XFER_SIZE) != HAL_OK) return HAL_ERROR;
+    HAL_GPIO_WritePin(CBL_SPI_READY_PORT, CBL_SPI_READY_PIN, GPIO_PIN_SET);
+
+    while(HAL_SPI_GetState(&hspi1) != HAL_SPI_STATE_READY){
+        if((Timeout != HAL_MAX_DELAY) && (HAL_GetTick() - Start >= Timeout)){
+            HAL_GPIO_WritePin(CBL_SPI_READY_PORT, CBL_SPI_READY_PIN, GPIO_PIN_RESET);
+            HAL_SPI_Abort(&hspi1);
+            return HAL_TIMEOUT;
+        }
+    }
+    HAL_GPIO_WritePin(CBL_SPI_READY_PORT, CBL_SPI_READY_PIN, GPIO_PIN_RESET);
+
+    Tx_Fill = 0;
+    Count = Spi_Rx[0];
+    if(Count > CBL_SPI_XFER_SIZE - 1U) Count = 0;    /* Maitre absent (MISO flottant) */
+    for(uint8_t i = 0; i < Count; i++){
+        Rx_Ring[Rx_Head] = Spi_Rx[1 + i];
+        Rx_Head = (Rx_Head + 1U) % CBL_SPI_RX_SIZE;
+    }
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef Transport_Receive(uint8_t *pData, uint16_t Len, uint32_t Timeout){
+    uint32_t Start = HAL_GetTick();
+
+    while(Len > 0){
+        if(Rx_Tail != Rx_Head){
+            *pData++ = Rx_Ring[Rx_Tail];
+            Rx_Tail = (Rx_Tail + 1U) % CBL_SPI_RX_SIZE;
+            Len--;
+            continue;
+        }
+        if(Timeout == HAL_MAX_DELAY){
+            Spi_Exchange(HAL_MAX_DELAY);
+        }
+        else{
+            uint32_t Elapsed = HAL_GetTick() - Start;
+            if((Elapsed >= Timeout) || (Spi_Exchange(Timeout - Elapsed) == HAL_TIMEOUT)) return HAL_TIMEOUT;
+        }
+    }
+    return HAL_OK;
+}
+
+/* Un echange des que le tampon d'emission est plein */
+void Transport_Send(const uint8_t *pData, uint16_t Len){
+    while(Len > 0){
+        uint16_t Chunk = CBL_SPI_XFER_SIZE - 1U - Tx_Fill;
+        if(Chunk > Len) Chunk = Len;
+        memcpy(&Spi_Tx[1 + Tx_Fill], pData, Chunk);
+        Tx_Fill += Chunk;
+        pData += Chunk;
+        Len -= Chunk;
+        if(Tx_Fill == CBL_SPI_XFER_SIZE - 1U) Spi_Exchange(HAL_MAX_DELAY);
+    }
+}
+
+void Transport_Flush(void){
+    while(Tx_Fill > 0){
+        Spi_Exchange(HAL_MAX_DELAY);
+    }
+}
+
+void Transport_DeInit(void){
+    Transport_Flush();
+    HAL_GPIO_WritePin(CBL_SPI_READY_PORT, CBL_SPI_READY_PIN, GPIO_PIN_RESET);
+    HAL_SPI_DeInit(&hspi1);
+}
+
+#endif /* CBL_TRANSPORT_SPI */
@@ -0,0 +1,43 @@
+/*
+ * Transport.h
+ *
+ *  Byte link between the gateway and the bootloader command handlers. The
+ *  handlers only see a byte stream; the physical link is picked at compile
+ *  time: USART1 (default) or SPI1 slave with a ready line (CBL_TRANSPORT_SPI).
+ *  main() calls Transport_Init() for USART1, which enables its interrupt;
+ *  with BL_COMPACT, USART1 is driven through its registers instead of
+ *  HAL_UART and Transport_Init() also sets it up.
+ *
+ *  SPI: the master clocks fixed CBL_SPI_XFER_SIZE-byte full-duplex exchanges,
+ *  only while the ready line is high. Each direction carries
+ *  n u8 | n stream bytes | 0xFF padding, so one exchange both delivers the
+ *  next host frame and returns any pending reply bytes.
+ */
+
+#ifndef INC_TRANSPORT_H_
+#define INC_TRANSPORT_H_
+
+#include <stdint.h>
+#include "stm32f4xx_hal.h"
+#include "FotaProto.h"
+
+#define CBL_TX_RING_SIZE          512   /* UART : anneau vide par interruption (USART1 global interrupt) */
+#define CBL_UART_BAUDRATE         115200U   /* BL_COMPACT : debit programme par Transport_Init() */
+#define CBL_TX_FLUSH_TIMEOUT_MS   100U  /* Sans progression de l'anneau : emission bloquante */
+
+#define CBL_SPI_XFER_SIZE         (PROTO_MAX_FRAME + 1)   /* Une trame complete par echange */
+#define CBL_SPI_RX_SIZE           512
+#ifndef CBL_SPI_READY_PORT
+#define CBL_SPI_READY_PORT        GPIOB
+#define CBL_SPI_READY_PIN         GPIO_PIN_0   /* Sortie : DMA arme, le maitre peut cadencer */
+#endif
+
+#if !defined(CBL_TRANSPORT_SPI)
+void Transport_Init(void);
+#endif
+HAL_StatusTypeDef Transport_Receive(uint8_t *pData, uint16_t Len, uint32_t Timeout);
+void Transport_Send(const uint8_t *pData, uint16_t Len);
+void Transport_Flush(void);
+void Transport_DeInit(void);
+
+#endif /* INC_TRANSPORT_H_ */
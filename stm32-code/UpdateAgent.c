@@ -0,0 +1,251 @@
+/*
+ * UpdateAgent.c
+ *
+ *  Reception en tache de fond des trames de mise a jour dans l'application.
+ *  Le DMA remplit Rx_Ring en continu ; UpdateAgent_Poll(), appelee depuis la
+ *  boucle principale, decoupe les trames, les decode avec FotaProto.h et les
+ *  execute. Les adresses recues sont celles de la zone application : elles
+ *  sont relogees dans la zone de staging, l'image et son hash de flux sont
+ *  donc identiques a ceux d'une mise a jour par le bootloader.
+ *
+ *  Le DMA de reception doit etre configure en mode circulaire, priorite
+ *  basse (CubeMX). Sur les F4 mono-banque, le CPU attend pendant les
+ *  ecritures Flash : ~16 us par mot, et 1 a 2 s pour l'effacement du secteur
+ *  de staging en debut de session.
+ */
+#include "UpdateAgent.h"
+#include <string.h>
+
+static UART_HandleTypeDef *Agent_Uart = NULL;
+static uint8_t Rx_Ring[UPDATE_AGENT_RX_SIZE];
+static uint16_t Rx_Tail = 0;
+
+static uint8_t Frame[PROTO_MAX_FRAME];
+static uint16_t Frame_Fill = 0;
+static uint32_t Frame_Tick = 0;
+
+static Sha256_Context Stream_Hash;
+static uint32_t Stream_End = 0;         /* Fin des octets deja haches */
+static uint8_t Staged = 0;
+
+static void Agent_Send(uint8_t Status, const uint8_t *pData, uint8_t Len);
+static void Agent_Handle(const Proto_Frame *pFrame);
+static uint8_t Agent_Erase(void);
+static uint8_t Agent_Write(uint32_t Address, const uint8_t *pData, uint8_t Len);
+static uint8_t Agent_Set_App_Info(const Proto_Frame *pFrame);
+
+void UpdateAgent_Init(UART_HandleTypeDef *huart){
+    Agent_Uart = huart;
+    Rx_Tail = 0;
+    Frame_Fill = 0;
+    Sha256_Init(&Stream_Hash);
+    HAL_UART_Receive_DMA(Agent_Uart, Rx_Ring, sizeof(Rx_Ring));
+}
+
+uint8_t UpdateAgent_IsStaged(void){
+    return Staged;
+}
+
+void UpdateAgent_Poll(void){
+    uint16_t Head;
+    Proto_Frame Decoded;
+
+    if(Agent_Uart == NULL) return;
+
+    /* Trame tronquee (octets perdus) : on se resynchronise sur la suivante */
+    if((Frame_Fill > 0) && (HAL_GetTick() - Frame_Tick > UPDATE_AGENT_FRAME_GAP_MS)){
+        Frame_Fill = 0;
+    }
+
+    Head = sizeof(Rx_Ring) - __HAL_DMA_GET_COUNTER(Agent_Uart->hdmarx);
+    if(Head == sizeof(Rx_Ring)) Head = 0;
+
+    while(Rx_Tail != Head){
+        uint8_t Byte = Rx_Ring[Rx_Tail];
+        Rx_Tail = (Rx_Tail + 1) % sizeof(Rx_Ring);
+
+        /* Knocks et octets parasites : jamais une longueur de trame */
+        if((Frame_Fill == 0) && (Byte >= PROTO_MAX_FRAME)) continue;
+
+        Frame[Frame_Fill++] = Byte;
+        Frame_Tick = HAL_GetTick();
+        if(Frame_Fill < (uint16_t)Frame[0] + 1) continue;
+
+        if(Proto_Decode(Frame, Frame_Fill, &Decoded) == PROTO_OK){
+            Agent_Handle(&Decoded);
+        }
+        else{
+            uint8_t Nack = PROTO_NACK;
+            HAL_UART_Transmit(Agent_Uart, &Nack, 1, UPDATE_AGENT_TX_TIMEOUT_MS);
+        }
+        Frame_Fill = 0;
+    }
+}
+
+/* ACK, longueur, donnees : meme forme de reponse que le bootloader */
+static void Agent_Send(uint8_t Status, const uint8_t *pData, uint8_t Len){
+    uint8_t Reply[2 + 4];
+
+    Reply[0] = PROTO_ACK;
+    if(pData == NULL){
+        Reply[1] = 1;
+        Reply[2] = Status;
+        Len = 1;
+    }
+    else{
+        Reply[1] = Len;
+        memcpy(&Reply[2], pData, Len);
+    }
+    HAL_UART_Transmit(Agent_Uart, Reply, 2 + Len, UPDATE_AGENT_TX_TIMEOUT_MS);
+}
+
+static void Agent_Handle(const Proto_Frame *pFrame){
+    static const uint8_t Version[4] = {UPDATE_AGENT_VENDOR_ID, UPDATE_AGENT_MAJOR_VERSION,
+                                       UPDATE_AGENT_MINOR_VERSION, UPDATE_AGENT_PATCH_VERSION};
+    uint8_t Nack = PROTO_NACK;
+
+    switch(pFrame->Command){
+        case PROTO_CMD_GET_VER:
+            Agent_Send(0, Version, sizeof(Version));
+            break;
+
+        case PROTO_CMD_FLASH_ERASE:
+            /* Quelle que soit l'adresse, seule la zone de staging est effacee.
+             * data = taille de l'image u32 : une image trop grande est
+             * refusee ici plutot qu'au milieu du transfert */
+            if((pFrame->Count == 4) && Proto_Data_Ok(pFrame) &&
+               (Proto_Get_U32(pFrame->pData) > UPDATE_AGENT_MAX_IMAGE)){
+                Agent_Send(UPDATE_AGENT_ERASE_TOO_BIG, NULL, 0);
+                break;
+            }
+            Agent_Send(Agent_Erase(), NULL, 0);
+            break;
+
+        case PROTO_CMD_MEM_WRITE:
+            if(!Proto_Data_Ok(pFrame)){
+                Agent_Send(UPDATE_AGENT_WRITE_FAILED, NULL, 0);
+                break;
+            }
+            Agent_Send(Agent_Write(pFrame->Address, pFrame->pData, pFrame->Count), NULL, 0);
+            break;
+
+        case PROTO_CMD_SET_APP_INFO:
+            Agent_Send(Agent_Set_App_Info(pFrame), NULL, 0);
+            break;
+
+        case PROTO_CMD_GO_TO_ADDR:
+            /* Le bootloader installe l'image au redemarrage */
+            if(!Staged){
+                Agent_Send(UPDATE_AGENT_ADDR_INVALID, NULL, 0);
+                break;
+            }
+            Agent_Send(UPDATE_AGENT_ADDR_VALID, NULL, 0);
+            HAL_Delay(2);
+            HAL_NVIC_SystemReset();
+            break;
+
+        /* Pas de decompresseur LZ dans l'agent : la passerelle envoie l'image brute */
+        default:
+            HAL_UART_Transmit(Agent_Uart, &Nack, 1, UPDATE_AGENT_TX_TIMEOUT_MS);
+            break;
+    }
+}
+
+/* Nouvelle session : staging vide, hash de flux repart de zero */
+static uint8_t Agent_Erase(void){
+    FLASH_EraseInitTypeDef EraseInit;
+    uint32_t PageError = 0;
+    HAL_StatusTypeDef Hal_status;
+
+    Sha256_Init(&Stream_Hash);
+    Stream_End = 0;
+    Staged = 0;
+
+    EraseInit.TypeErase = FLASH_TYPEERASE_SECTORS;
+    EraseInit.Banks = FLASH_BANK_1;
+    EraseInit.VoltageRange = FLASH_VOLTAGE_RANGE_3;
+    EraseInit.Sector = BOOTMETA_STAGING_SECTOR;
+    EraseInit.NbSectors = 1;
+
+    HAL_FLASH_Unlock();
+    Hal_status = HAL_FLASHEx_Erase(&EraseInit, &PageError);
+    HAL_FLASH_Lock();
+
+    return ((Hal_status == HAL_OK) && (PageError == 0xFFFFFFFFU)) ? UPDATE_AGENT_ERASE_OK : UPDATE_AGENT_ERASE_FAILED;
+}
+
+static uint8_t Agent_Write(uint32_t Address, const uint8_t *pData, uint8_t Len){
+    HAL_StatusTypeDef Hal_status = HAL_OK;
+    uint32_t Dest;
+    uint32_t Skip;
+    uint8_t i = 0;
+
+    if((Address < BOOTMETA_APP_ADDRESS) ||
+       (Address - BOOTMETA_APP_ADDRESS + Len > UPDATE_AGENT_MAX_IMAGE)){
+        return UPDATE_AGENT_WRITE_FAILED;
+    }
+    /* Retransmission, eventuellement redecoupee : octets deja dans le hash */
+    Skip = (Address < Stream_End) ? (Stream_End - Address) : 0;
+    if(Skip < Len){
+        Sha256_Update(&Stream_Hash, pData + Skip, Len - Skip);
+        Stream_End = Address + Len;
+    }
+
+    Dest = BOOTMETA_STAGING_ADDRESS + (Address - BOOTMETA_APP_ADDRESS);
+    HAL_FLASH_Unlock();
+    while((i < Len) && (Hal_status == HAL_OK)){
+        if(((Dest + i) % 4 == 0) && (Len - i >= 4)){
+            uint32_t Word;
+            memcpy(&Word, &pData[i], 4);
+            if(Word != 0xFFFFFFFFU){
+                Hal_status = HAL_FLASH_Program(FLASH_TYPEPROGRAM_WORD, Dest + i, Word);
+            }
+            i += 4;
+        }
+        else{
+            if(pData[i] != 0xFF){
+                Hal_status = HAL_FLASH_Program(FLASH_TYPEPROGRAM_BYTE, Dest + i, pData[i]);
+            }
+            i++;
+        }
+    }
+    HAL_FLASH_Lock();
+
+    return (Hal_status == HAL_OK) ? UPDATE_AGENT_WRITE_PASSED : UPDATE_AGENT_WRITE_FAILED;
+}
+
+/*
+ * Meme controle que CBL_SET_APP_INFO_CMD cote bootloader, puis demande
+ * d'installation : le bootloader reverifie le SHA-256 complet du staging
+ * avant et apres la recopie.
+ */
+static uint8_t Agent_Set_App_Info(const Proto_Frame *pFrame){
+    Sha256_Context Final_Hash = Stream_Hash;
+    uint8_t Digest[SHA256_DIGEST_SIZE];
+    uint32_t Size, Msp, Reset_Handler;
+
+    if((pFrame->Count != 4 + SHA256_DIGEST_SIZE) || !Proto_Data_Ok(pFrame)) return UPDATE_AGENT_INFO_FAILED;
+
+    Size = Proto_Get_U32(pFrame->pData);
+    Sha256_Final(&Final_Hash, Digest);
+    if((Size == 0) || (Size > UPDATE_AGENT_MAX_IMAGE) ||
+       (memcmp(Digest, pFrame->pData + 4, SHA256_DIGEST_SIZE) != 0)){
+        return UPDATE_AGENT_INFO_FAILED;
+    }
+
+    /* Table des vecteurs de l'image, telle qu'elle sera apres recopie */
+    Msp = *(volatile uint32_t *)BOOTMETA_STAGING_ADDRESS;
+    Reset_Handler = *(volatile uint32_t *)(BOOTMETA_STAGING_ADDRESS + 4);
+    if((Msp <= SRAM_BASE) || (Msp > FLASH_GEO_SRAM_END) || !(Reset_Handler & 1U) ||
+       (Reset_Handler <= BOOTMETA_APP_ADDRESS) || (Reset_Handler >= BOOTMETA_APP_ADDRESS + Size)){
+        return UPDATE_AGENT_INFO_FAILED;
+    }
+
+    Sha256_Init(&Final_Hash);
+    Sha256_Update(&Final_Hash, (const uint8_t *)BOOTMETA_STAGING_ADDRESS, Size);
+    Sha256_Final(&Final_Hash, Digest);
+
+    if(BootMeta_RequestSwap(Size, Digest) != HAL_OK) return UPDATE_AGENT_INFO_FAILED;
+    Staged = 1;
+    return UPDATE_AGENT_INFO_SAVED;
+}
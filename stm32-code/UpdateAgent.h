@@ -0,0 +1,55 @@
+/*
+ * UpdateAgent.h
+ *
+ *  Background update agent linked into the application. It answers the
+ *  bootloader command set on the application's UART (circular DMA reception,
+ *  parsed from the main loop) and writes the image into the staging sector
+ *  while the application keeps running. Once the image is verified, a reset
+ *  lets the bootloader copy it into place: downtime is one reboot.
+ */
+
+#ifndef INC_UPDATEAGENT_H_
+#define INC_UPDATEAGENT_H_
+
+#include <stdint.h>
+#include "stm32f4xx_hal.h"
+#include "BootMeta.h"
+#include "Sha256.h"
+#include "FotaProto.h"
+
+#if !defined(BL_STAGING)
+#error "UpdateAgent needs a staging area: build the application and the bootloader with BL_STAGING"
+#endif
+
+#define UPDATE_AGENT_RX_SIZE        256   /* Tampon circulaire DMA */
+#define UPDATE_AGENT_FRAME_GAP_MS   50    /* Trame incomplete abandonnee apres ce silence */
+#define UPDATE_AGENT_TX_TIMEOUT_MS  10
+
+/* Plus grande image : le staging la recoit, la zone application aussi
+ * (F401RE : 128 KB ; F401xC : 32 KB, 96 KB en BL_COMPACT) */
+#define UPDATE_AGENT_APP_AREA       (BOOTMETA_APP_END - BOOTMETA_APP_ADDRESS)
+#define UPDATE_AGENT_MAX_IMAGE      ((BOOTMETA_STAGING_SIZE < UPDATE_AGENT_APP_AREA) ? \
+                                     BOOTMETA_STAGING_SIZE : UPDATE_AGENT_APP_AREA)
+
+/* GET_VER : le bit 7 du majeur distingue l'agent du bootloader */
+#define UPDATE_AGENT_VENDOR_ID      100
+#define UPDATE_AGENT_MAJOR_VERSION  0x81
+#define UPDATE_AGENT_MINOR_VERSION  0
+#define UPDATE_AGENT_PATCH_VERSION  0
+
+/* Memes statuts que le bootloader, la passerelle n'a qu'un seul decodeur */
+#define UPDATE_AGENT_WRITE_FAILED   0x00
+#define UPDATE_AGENT_WRITE_PASSED   0x01
+#define UPDATE_AGENT_ERASE_TOO_BIG  0x00  /* INVALID_PAGE_NUMBER : image hors UPDATE_AGENT_MAX_IMAGE */
+#define UPDATE_AGENT_ERASE_FAILED   0x02
+#define UPDATE_AGENT_ERASE_OK       0x03
+#define UPDATE_AGENT_INFO_FAILED    0x00
+#define UPDATE_AGENT_INFO_SAVED     0x01
+#define UPDATE_AGENT_ADDR_INVALID   0x00
+#define UPDATE_AGENT_ADDR_VALID     0x01
+
+void UpdateAgent_Init(UART_HandleTypeDef *huart);
+void UpdateAgent_Poll(void);
+uint8_t UpdateAgent_IsStaged(void);
+
+#endif /* INC_UPDATEAGENT_H_ */
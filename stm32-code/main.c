@@ -52,9 +52,11 @@ UART_HandleTypeDef huart2;
 /* Private function prototypes -----------------------------------------------*/
 void SystemClock_Config(void);
 static void MX_GPIO_Init(void);
+#if !defined(BL_COMPACT)
 static void MX_USART2_UART_Init(void);
 static void MX_USART1_UART_Init(void);
 static void MX_CRC_Init(void);
+#endif
 /* USER CODE BEGIN PFP */
 
 /* USER CODE END PFP */
@@ -120,11 +122,20 @@ int main(void)
 
   /* Initialize all configured peripherals */
   MX_GPIO_Init();
+#if !defined(BL_COMPACT)
   MX_USART2_UART_Init();
   MX_USART1_UART_Init();
   MX_CRC_Init();
+#endif
   /* USER CODE BEGIN 2 */
+#if !defined(CBL_TRANSPORT_SPI)
+  /* Interruption USART1 ; build compact : USART1 par registres, horloge CRC
+   * activee par BL_Boot() */
+  Transport_Init();
+#endif
   HAL_GPIO_WritePin(GPIOA, GPIO_PIN_5, GPIO_PIN_SET);
+  /* Saut direct a l'application si elle est valide et que l'hote ne frappe pas */
+  BL_Boot();
 
   /* USER CODE END 2 */
 
@@ -189,6 +200,7 @@ void SystemClock_Config(void)
   }
 }
 
+#if !defined(BL_COMPACT)
 /**
   * @brief CRC Initialization Function
   * @param None
@@ -280,6 +292,7 @@ static void MX_USART2_UART_Init(void)
   /* USER CODE END USART2_Init 2 */
 
 }
+#endif /* BL_COMPACT */
 
 /**
   * @brief GPIO Initialization Function
@@ -0,0 +1,295 @@
+#!/usr/bin/env python3
+"""
+blsim.py - Bootloader simulator over TCP, target of `uarttrace.py replay --tcp`.
+
+Answers the point-to-point command set of stm32-code/Bootloader.c with the
+same bytes as the target (STM32F401xE default layout without BL_STAGING:
+application in sectors 2-6 from 0x08008000, metadata in sector 7), on
+a flash model that only clears bits. Frames go through fotaproto.py.
+
+Each TCP connection is a power-on: with a valid application the simulator
+answers a knock with ACK 0 and stays in the bootloader, any other first byte
+"jumps" to the application and the connection goes silent. The flash and the
+application record survive reconnects (uarttrace.py reconnects on reset
+records). MEM_WRITE_LZ decodes the FWZ1 sequences of fwpack.py against the
+flash model, like BL_LZ_Decode().
+
+Not simulated: the multipoint bus (SELECT, GET_BITMAP, DISCOVER), FMF1
+components (SET_COMP_INFO) and the staged install; those commands get NACK.
+Timing is not modelled either (see fwbench.py).
+
+Usage:
+    blsim.py [--port 5555] [--image app.bin]     # --image: valid app at boot
+"""
+import argparse
+import hashlib
+import socketserver
+import struct
+
+import fotaproto
+
+FLASH_BASE = 0x08000000
+FLASH_SIZE = 512 * 1024
+SECTOR_BASES = [0x00000, 0x04000, 0x08000, 0x0C000, 0x10000, 0x20000, 0x40000, 0x60000, 0x80000]
+APP_FIRST_SECTOR = 2
+APP_END_SECTOR = 7                   # metadata sector (BOOTMETA_APP_END_SECTOR)
+APP_BASE = FLASH_BASE + SECTOR_BASES[APP_FIRST_SECTOR]
+APP_END = FLASH_BASE + SECTOR_BASES[APP_END_SECTOR]
+SRAM_BASE = 0x20000000
+SRAM_END = SRAM_BASE + 96 * 1024
+MASS_ERASE = 0xFFFFFFFF
+NO_VERSION = 0xFFFFFFFF
+CHIP_ID = 0x433                      # DBGMCU->IDCODE of the F401xD/E
+VERSION = bytes([100, 1, 1, 0])      # CBL_VENDOR_ID, major, minor, patch
+
+# Status bytes (Bootloader.h)
+INVALID_PAGE_NUMBER, UNSUCCESSFUL_ERASE, SUCCESSFUL_ERASE = 0x00, 0x02, 0x03
+WRITE_FAILED, WRITE_PASSED = 0x00, 0x01
+ADDRESS_INVALID, ADDRESS_VALID = 0x00, 0x01
+DIGEST_FAILED, APP_SAVED = 0x00, 0x01
+
+CMD = fotaproto.BY_NAME
+
+
+class Target:
+    """Flash, boot record and update session, shared by all connections."""
+
+    def __init__(self):
+        self.flash = bytearray(b"\xFF" * FLASH_SIZE)
+        self.app_size = 0                # 0 = no valid application
+        self.app_hash = 0
+        self.stream_reset()
+
+    def stream_reset(self):
+        self.stream = hashlib.sha256()
+        self.stream_end = 0
+
+    def load(self, image):
+        self.flash[APP_BASE - FLASH_BASE:APP_BASE - FLASH_BASE + len(image)] = image
+        self.app_size = len(image) if self.vector_sane() else 0
+        self.app_hash = struct.unpack("<I", hashlib.sha256(image).digest()[:4])[0]
+
+    def read(self, addr, n):
+        return bytes(self.flash[addr - FLASH_BASE:addr - FLASH_BASE + n])
+
+    def program(self, addr, data):
+        for i, b in enumerate(data):
+            if FLASH_BASE <= addr + i < FLASH_BASE + FLASH_SIZE:
+                self.flash[addr + i - FLASH_BASE] &= b
+
+    def vector_sane(self):
+        msp, reset = struct.unpack("<II", self.read(APP_BASE, 8))
+        return SRAM_BASE < msp <= SRAM_END and reset & 1 and APP_BASE < reset < APP_END
+
+    @staticmethod
+    def sector(addr):
+        offset = addr - FLASH_BASE
+        for i in range(len(SECTOR_BASES) - 1):
+            if SECTOR_BASES[i] <= offset < SECTOR_BASES[i + 1]:
+                return i
+        return None
+
+    def erase_sectors(self, first, count):
+        start, end = SECTOR_BASES[first], SECTOR_BASES[first + count]
+        self.flash[start:end] = b"\xFF" * (end - start)
+        # BootMeta_InvalidateRange(): the application loses its record
+        if start < APP_END - FLASH_BASE and end > APP_BASE - FLASH_BASE:
+            self.app_size = 0
+
+    def erase(self, addr, count):
+        if addr == MASS_ERASE:
+            self.erase_sectors(APP_FIRST_SECTOR, APP_END_SECTOR - APP_FIRST_SECTOR)
+            return SUCCESSFUL_ERASE
+        first = self.sector(addr)
+        if first is None or first < APP_FIRST_SECTOR or count == 0 or first + count > APP_END_SECTOR:
+            return INVALID_PAGE_NUMBER
+        self.erase_sectors(first, count)
+        return SUCCESSFUL_ERASE
+
+    def hash_stream(self, addr, data):
+        """BL_Stream_Hash(): bytes past stream_end only (retries may be re-split)."""
+        skip = max(0, self.stream_end - addr)
+        if skip < len(data):
+            self.stream.update(data[skip:])
+            self.stream_end = addr + len(data)
+
+    def hash_record(self, addr, data):
+        """BL_Stream_Hash_Record(): an FWZ1 record is never split."""
+        if addr >= self.stream_end:
+            self.stream.update(data)
+            self.stream_end = addr + 1
+
+    def lz_decode(self, blob, dest):
+        """BL_LZ_Decode() on the flash model; False on a malformed block."""
+        p = 0
+
+        def run(length):
+            nonlocal p
+            if length == 15:
+                while True:
+                    if p >= len(blob):
+                        raise ValueError
+                    length += blob[p]
+                    p += 1
+                    if blob[p - 1] != 255:
+                        break
+            return length
+
+        try:
+            while p < len(blob):
+                token = blob[p]
+                p += 1
+                length = run(token >> 4)
+                if length > len(blob) - p or dest + length > APP_END:
+                    return False
+                self.program(dest, blob[p:p + length])
+                p += length
+                dest += length
+                if p >= len(blob):
+                    break
+                if len(blob) - p < 2:
+                    return False
+                offset = blob[p] | (blob[p + 1] << 8)
+                p += 2
+                length = run(token & 0x0F) + 4
+                if offset == 0 or offset > dest - APP_BASE or dest + length > APP_END:
+                    return False
+                for _ in range(length):
+                    self.program(dest, self.read(dest - offset, 1))
+                    dest += 1
+        except ValueError:
+            return False
+        return True
+
+
+def address_ok(addr):
+    return APP_BASE <= addr < APP_END or SRAM_BASE <= addr < SRAM_END
+
+
+def ack(payload):
+    return bytes([fotaproto.ACK, len(payload)]) + payload
+
+
+def execute(target, cmd, addr, count, data):
+    """Reply bytes to one decoded frame, and True if the target jumped."""
+    data_ok = count <= len(data)         # Proto_Data_Ok()
+    data = data[:count]
+    if cmd == CMD["GET_VER"]:
+        return ack(VERSION), False
+    if cmd == CMD["GET_HELP"]:
+        return ack(bytes(sorted(fotaproto.COMMANDS))), False
+    if cmd == CMD["GET_CID"]:
+        return ack(struct.pack("<H", CHIP_ID)), False
+    if cmd == CMD["FLASH_ERASE"]:
+        target.stream_reset()
+        return ack(bytes([target.erase(addr, count)])), False
+    if cmd == CMD["MEM_WRITE"]:
+        status = WRITE_FAILED
+        if address_ok(addr) and data_ok:
+            target.hash_stream(addr, data)
+            target.program(addr, data)
+            status = WRITE_PASSED
+        return ack(bytes([status])), False
+    if cmd == CMD["MEM_WRITE_LZ"]:
+        status = WRITE_FAILED
+        if APP_BASE <= addr < APP_END and data_ok:
+            target.hash_record(addr, data)
+            status = WRITE_PASSED if target.lz_decode(data, addr) else WRITE_FAILED
+        return ack(bytes([status])), False
+    if cmd == CMD["SET_APP_INFO"]:
+        status = DIGEST_FAILED
+        if count == 36 and data_ok:
+            size, digest = struct.unpack("<I", data[:4])[0], target.stream.digest()
+            if digest == data[4:36] and 0 < size <= APP_END - APP_BASE and target.vector_sane():
+                target.app_size, target.app_hash = size, struct.unpack("<I", digest[:4])[0]
+                status = APP_SAVED
+        return ack(bytes([status])), False
+    if cmd == CMD["MEM_READ"]:
+        length, status = 0, ADDRESS_INVALID
+        if count == 4 and data_ok:
+            (length,) = struct.unpack("<I", data[:4])
+            end = FLASH_BASE + FLASH_SIZE
+            if FLASH_BASE <= addr <= end and length <= end - addr:
+                status = ADDRESS_VALID
+        out = bytearray(ack(struct.pack("<BI", status, target.app_size)))
+        while status == ADDRESS_VALID and length > 0:
+            n = min(length, fotaproto.READ_BLOCK)
+            block = target.read(addr, n)
+            out += bytes([fotaproto.ACK, n]) + block + struct.pack("<I", fotaproto.crc(block))
+            addr += n
+            length -= n
+        return bytes(out), False
+    if cmd == CMD["GO_TO_ADDR"]:
+        valid = address_ok(addr)
+        return ack(bytes([ADDRESS_VALID if valid else ADDRESS_INVALID])), valid
+    if cmd == CMD["GET_COMPONENTS"]:
+        if not target.app_size:
+            return ack(b""), False
+        return ack(struct.pack("<BIIII", 0, NO_VERSION, APP_BASE, target.app_size, target.app_hash)), False
+    return bytes([fotaproto.NACK]), False
+
+
+class Session(socketserver.BaseRequestHandler):
+    def handle(self):
+        target = self.server.target
+        target.stream_reset()
+        buf, booting, silent = bytearray(), target.app_size and target.vector_sane(), False
+        while True:
+            chunk = self.request.recv(4096)
+            if not chunk:
+                return
+            if silent:
+                continue
+            buf += chunk
+            if booting:
+                # BL_Boot(): a knock keeps the bootloader, anything else jumps
+                if buf[0] != fotaproto.KNOCK:
+                    silent = True
+                    continue
+                self.request.sendall(ack(b""))
+                booting = False
+            while buf:
+                n = buf[0]
+                if n >= fotaproto.MAX_FRAME:
+                    del buf[0]           # Late knock or bad length: byte dropped
+                    continue
+                if len(buf) < n + 1:
+                    break
+                frame, buf = bytes(buf[:n + 1]), buf[n + 1:]
+                try:
+                    cmd, addr, count, data = fotaproto.decode(frame)
+                except ValueError:
+                    self.request.sendall(bytes([fotaproto.NACK]))
+                    continue
+                reply, jumped = execute(target, cmd, addr, count, data)
+                self.request.sendall(reply)
+                if jumped:
+                    silent = True
+                    break
+
+
+class Server(socketserver.TCPServer):
+    allow_reuse_address = True
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__.split("\n\n")[0])
+    ap.add_argument("--host", default="127.0.0.1")
+    ap.add_argument("--port", type=int, default=5555)
+    ap.add_argument("--image", help="raw application image, installed and valid at boot")
+    a = ap.parse_args()
+
+    server = Server((a.host, a.port), Session)
+    server.target = Target()
+    if a.image:
+        server.target.load(open(a.image, "rb").read())
+    print("bootloader simulator on %s:%d (application %s)" %
+          (a.host, a.port, "valid, %d bytes" % server.target.app_size if server.target.app_size else "none"))
+    try:
+        server.serve_forever()
+    except KeyboardInterrupt:
+        pass
+
+
+if __name__ == "__main__":
+    main()
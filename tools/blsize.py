@@ -0,0 +1,201 @@
+#!/usr/bin/env python3
+"""
+blsize.py - Per-symbol flash / RAM footprint of the STM32 bootloader.
+
+Reads the linker map (-Wl,-Map=...), the ELF itself (runs nm) or a saved
+`nm -S --size-sort` listing, and reports the biggest symbols, the total per
+object file (map only) and the flash total against a budget: 16 KB, sector 0,
+for a BL_COMPACT build (see stm32-code/README.md). Exits 1 over budget, so it
+can gate a build.
+
+Flash counts .isr_vector, .text, .rodata, init arrays and the initial values
+of .data; RAM counts .data and .bss.
+
+Usage:
+    blsize.py report bootloader.map [--budget 16384] [--top 25] [--by-file]
+    blsize.py report bootloader.elf [--nm arm-none-eabi-nm]
+    blsize.py diff   old.map new.map        # symbols that grew or shrank
+"""
+import argparse
+import re
+import subprocess
+import sys
+
+SECTOR0 = 16 * 1024
+
+# Map input section (prefix) -> kind
+KINDS = [
+    (".isr_vector", "vector"),
+    (".text", "text"),
+    (".rodata", "rodata"),
+    (".ARM", "rodata"),
+    (".init_array", "rodata"),
+    (".fini_array", "rodata"),
+    (".preinit_array", "rodata"),
+    (".data", "data"),
+    (".bss", "bss"),
+    ("COMMON", "bss"),
+]
+FLASH = {"vector", "text", "rodata", "data"}
+RAM = {"data", "bss"}
+# GCC sub-sections in front of the symbol name (.text.startup.main)
+SUBSECTIONS = ("startup.", "unlikely.", "hot.", "exit.", "rel.ro.local.", "rel.local.", "rel.ro.", "rel.")
+NM_KINDS = {"t": "text", "w": "text", "r": "rodata", "d": "data", "b": "bss", "c": "bss"}
+
+SECTION = re.compile(r"^ (\.\S+|COMMON)(?:\s+0x([0-9a-fA-F]+)\s+0x([0-9a-fA-F]+)\s+(\S.*))?$")
+CONTINUED = re.compile(r"^\s+0x([0-9a-fA-F]+)\s+0x([0-9a-fA-F]+)\s+(\S.*)$")
+
+
+def section_kind(name):
+    for prefix, kind in KINDS:
+        if name == prefix or name.startswith(prefix + ".") or name.startswith(prefix + "_"):
+            return kind
+    return None
+
+
+def symbol_name(section, obj):
+    for prefix, _ in KINDS:
+        if section.startswith(prefix + "."):
+            name = section[len(prefix) + 1:]
+            for sub in SUBSECTIONS:
+                if name.startswith(sub):
+                    name = name[len(sub):]
+                    break
+            if name and name + "." not in SUBSECTIONS:
+                return name
+    return "%s(%s)" % (section, obj.rsplit("/", 1)[-1])
+
+
+def parse_map(lines):
+    """Input sections kept by the linker: {name, kind, size, file}."""
+    out, pending, started = [], None, False
+    for line in lines:
+        if line.startswith("Linker script and memory map"):
+            started = True
+            continue
+        if not started:
+            continue
+        m = SECTION.match(line)
+        if m:
+            pending = None
+            name, addr, size, obj = m.groups()
+            if addr is None:
+                pending = name           # Long name: address and size on the next line
+                continue
+        elif pending:
+            m2 = CONTINUED.match(line)
+            name, pending = pending, None
+            if not m2:
+                continue
+            addr, size, obj = m2.groups()
+        else:
+            continue
+        kind, size = section_kind(name), int(size, 16)
+        if kind and size and int(addr, 16):
+            out.append({"name": symbol_name(name, obj), "kind": kind, "size": size,
+                        "file": obj.rsplit("/", 1)[-1]})
+    return out
+
+
+def parse_nm(lines):
+    """`nm -S --size-sort` lines: address size type name (hex)."""
+    out = []
+    for line in lines:
+        parts = line.split()
+        if len(parts) < 4:
+            continue
+        kind = NM_KINDS.get(parts[2].lower())
+        if kind:
+            out.append({"name": parts[3], "kind": kind, "size": int(parts[1], 16), "file": ""})
+    return out
+
+
+def load(path, nm):
+    with open(path, "rb") as f:
+        head = f.read(4)
+    if head == b"\x7fELF":
+        try:
+            text = subprocess.run([nm, "-S", "--size-sort", "--radix=x", path], check=True,
+                                  capture_output=True, text=True).stdout
+        except (OSError, subprocess.CalledProcessError) as e:
+            sys.exit("%s: %s" % (nm, e))
+        return parse_nm(text.splitlines())
+    lines = open(path, errors="replace").read().splitlines()
+    if any(l.startswith("Linker script and memory map") for l in lines):
+        return parse_map(lines)
+    return parse_nm(lines)
+
+
+def totals(symbols):
+    flash = sum(s["size"] for s in symbols if s["kind"] in FLASH)
+    ram = sum(s["size"] for s in symbols if s["kind"] in RAM)
+    return flash, ram
+
+
+def merged(symbols):
+    """Flash bytes per symbol name (static functions of the same name add up)."""
+    sizes = {}
+    for s in symbols:
+        if s["kind"] in FLASH:
+            sizes[s["name"]] = sizes.get(s["name"], 0) + s["size"]
+    return sizes
+
+
+def cmd_report(args):
+    symbols = load(args.file, args.nm)
+    if not symbols:
+        sys.exit("%s: no sized symbols found" % args.file)
+    flash, ram = totals(symbols)
+
+    print("%-8s %-7s %-40s %s" % ("bytes", "kind", "symbol", "file"))
+    for s in sorted(symbols, key=lambda s: -s["size"])[:args.top]:
+        print("%-8d %-7s %-40s %s" % (s["size"], s["kind"], s["name"][:40], s["file"]))
+
+    if args.by_file:
+        files = {}
+        for s in symbols:
+            if s["kind"] in FLASH and s["file"]:
+                files[s["file"]] = files.get(s["file"], 0) + s["size"]
+        print("\n%-8s %s" % ("flash", "file"))
+        for name, size in sorted(files.items(), key=lambda f: -f[1]):
+            print("%-8d %s" % (size, name))
+
+    over = flash > args.budget
+    print("\n%s: flash %d / %d bytes (%.1f %%), RAM %d bytes%s" %
+          (args.file, flash, args.budget, 100.0 * flash / args.budget, ram,
+           "  OVER BUDGET by %d" % (flash - args.budget) if over else ""))
+    return 1 if over else 0
+
+
+def cmd_diff(args):
+    old, new = merged(load(args.old, args.nm)), merged(load(args.new, args.nm))
+    rows = [(name, old.get(name, 0), new.get(name, 0)) for name in set(old) | set(new)]
+    rows = [r for r in rows if r[1] != r[2]]
+    print("%-8s %-8s %-8s %s" % ("old", "new", "delta", "symbol"))
+    for name, a, b in sorted(rows, key=lambda r: -abs(r[2] - r[1])):
+        print("%-8d %-8d %+-8d %s" % (a, b, b - a, name))
+    a, b = sum(old.values()), sum(new.values())
+    print("\nflash %d -> %d bytes (%+d)" % (a, b, b - a))
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__.split("\n\n")[0])
+    ap.add_argument("--nm", default="arm-none-eabi-nm", help="nm used for ELF input")
+    sub = ap.add_subparsers(dest="cmd", required=True)
+    p = sub.add_parser("report", help="biggest symbols and flash total against a budget")
+    p.add_argument("file", help=".map, .elf or saved nm listing")
+    p.add_argument("--budget", type=int, default=SECTOR0, help="flash budget in bytes (default: sector 0)")
+    p.add_argument("--top", type=int, default=25)
+    p.add_argument("--by-file", action="store_true", help="flash per object file (map input)")
+    p = sub.add_parser("diff", help="per-symbol flash change between two builds")
+    p.add_argument("old")
+    p.add_argument("new")
+    a = ap.parse_args()
+
+    if a.cmd == "report":
+        sys.exit(cmd_report(a))
+    cmd_diff(a)
+
+
+if __name__ == "__main__":
+    main()
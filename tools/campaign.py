@@ -0,0 +1,245 @@
+#!/usr/bin/env python3
+"""
+campaign.py - Fleet update campaign scheduler for the FOTA gateways.
+
+Sends an update command to each gateway on its own topic (/FOTA/<id>/cmd)
+in waves, never more than --concurrency updates in flight, and watches
+/FOTA/<id>/status for the outcome. The campaign pauses as soon as the
+failure rate over finished devices exceeds --max-failure-rate; devices not
+yet updated are written to --remaining so the campaign can be resumed.
+
+The 'simulate' command runs N fake gateways on one MQTT connection: it is
+used as a load benchmark of the scheduler and the broker (1,000+ devices
+against a local Mosquitto).
+
+Requires the 'paho-mqtt' package (imported by the run and simulate commands
+only, --help works without it).
+
+Usage:
+    campaign.py run --url https://.../app.bin --devices ids.txt
+                    [--wave-size 50] [--concurrency 10] [--max-failure-rate 0.1]
+    campaign.py run --url ... --discover 5          # devices seen online
+    campaign.py simulate --count 1000 [--fail-rate 0.01] [--duration 2.0]
+"""
+import argparse
+import random
+import sys
+import threading
+import time
+
+ROOT = "/FOTA"
+SUCCESS = ("Update FINISHED",)
+FAILURE = ("Fail", "INVALID", "rejected", "mismatch")
+
+
+def make_client(client_id=""):
+    try:
+        import paho.mqtt.client as mqtt
+    except ImportError:
+        sys.exit("campaign.py needs the 'paho-mqtt' package")
+    try:
+        return mqtt.Client(mqtt.CallbackAPIVersion.VERSION2, client_id=client_id)
+    except AttributeError:  # paho-mqtt < 2.0
+        return mqtt.Client(client_id=client_id)
+
+
+def topic_device(topic):
+    parts = topic.split("/")
+    return parts[2] if len(parts) > 3 else None
+
+
+class Campaign:
+    def __init__(self, client, command, concurrency, max_failure_rate, min_samples, timeout):
+        self.client = client
+        self.command = command
+        self.concurrency = concurrency
+        self.max_failure_rate = max_failure_rate
+        self.min_samples = min_samples
+        self.timeout = timeout
+        self.cond = threading.Condition()
+        self.in_flight = {}     # device -> start time
+        self.results = {}       # device -> (ok, seconds)
+        self.peak = 0
+        client.message_callback_add(ROOT + "/+/status", self._on_status)
+        client.subscribe(ROOT + "/+/status", qos=1)
+
+    def _on_status(self, _client, _userdata, msg):
+        device = topic_device(msg.topic)
+        text = msg.payload.decode(errors="replace")
+        with self.cond:
+            if device not in self.in_flight:
+                return
+            if any(s in text for s in SUCCESS):
+                self._finish(device, True)
+            elif any(s in text for s in FAILURE):
+                self._finish(device, False)
+
+    def _finish(self, device, ok):
+        start = self.in_flight.pop(device)
+        self.results[device] = (ok, time.monotonic() - start)
+        self.cond.notify_all()
+
+    def failure_rate(self):
+        if not self.results:
+            return 0.0
+        return sum(1 for ok, _ in self.results.values() if not ok) / len(self.results)
+
+    def _expire(self):
+        now = time.monotonic()
+        for device, start in list(self.in_flight.items()):
+            if now - start > self.timeout:
+                self._finish(device, False)
+
+    def _paused(self):
+        return len(self.results) >= self.min_samples and self.failure_rate() > self.max_failure_rate
+
+    def run_wave(self, devices):
+        """Return False if the campaign had to pause."""
+        pending = list(devices)
+        with self.cond:
+            while pending or self.in_flight:
+                self._expire()
+                if self._paused():
+                    return False
+                while pending and len(self.in_flight) < self.concurrency:
+                    device = pending.pop(0)
+                    self.in_flight[device] = time.monotonic()
+                    self.client.publish("%s/%s/cmd" % (ROOT, device), self.command, qos=1)
+                self.peak = max(self.peak, len(self.in_flight))
+                self.cond.wait(0.5)
+        return not self._paused()
+
+
+def discover(client, seconds):
+    online = set()
+
+    def on_presence(_client, _userdata, msg):
+        device = topic_device(msg.topic)
+        if msg.payload == b"online":
+            online.add(device)
+        else:
+            online.discard(device)
+
+    client.message_callback_add(ROOT + "/+/presence", on_presence)
+    client.subscribe(ROOT + "/+/presence", qos=1)
+    time.sleep(seconds)
+    client.message_callback_remove(ROOT + "/+/presence")
+    return sorted(online)
+
+
+def connect(args, client_id=""):
+    client = make_client(client_id)
+    client.connect(args.broker, args.port, keepalive=30)
+    client.loop_start()
+    return client
+
+
+def cmd_run(args):
+    client = connect(args)
+    if args.devices:
+        with open(args.devices) as f:
+            devices = [line.strip() for line in f if line.strip() and not line.startswith("#")]
+    else:
+        devices = discover(client, args.discover)
+    print("campaign: %d devices, waves of %d, %d in flight" %
+          (len(devices), args.wave_size, args.concurrency))
+
+    campaign = Campaign(client, args.url, args.concurrency, args.max_failure_rate,
+                        args.min_samples, args.timeout)
+    t0 = time.monotonic()
+    done = 0
+    paused = False
+    for w in range(0, len(devices), args.wave_size):
+        wave = devices[w:w + args.wave_size]
+        ok = campaign.run_wave(wave)
+        done = w + len(wave)
+        good = sum(1 for r in campaign.results.values() if r[0])
+        print("wave %d: %d/%d ok, failure rate %.1f%%" %
+              (w // args.wave_size + 1, good, len(campaign.results), 100 * campaign.failure_rate()))
+        if not ok:
+            paused = True
+            break
+    elapsed = time.monotonic() - t0
+
+    remaining = [d for d in devices if d not in campaign.results or not campaign.results[d][0]]
+    if args.remaining:
+        with open(args.remaining, "w") as f:
+            f.write("\n".join(remaining) + ("\n" if remaining else ""))
+    durations = sorted(s for ok, s in campaign.results.values() if ok)
+    print("%s after %.1f s: %d updated, %d failed or pending, peak %d in flight" %
+          ("PAUSED (failure rate)" if paused else "done", elapsed,
+           len(durations), len(remaining), campaign.peak))
+    if durations:
+        print("per-device time: median %.2f s, p95 %.2f s" %
+              (durations[len(durations) // 2], durations[min(len(durations) - 1, int(len(durations) * 0.95))]))
+    client.loop_stop()
+    return 2 if paused else 0
+
+
+def cmd_simulate(args):
+    """N fake gateways behind one connection: presence, then status on each command."""
+    client = connect(args, "fota-sim-%d" % random.randrange(1 << 16))
+    devices = ["SIM%09d" % i for i in range(args.count)]
+    timers = []
+    stats = {"cmds": 0}
+
+    def on_cmd(_client, _userdata, msg):
+        device = topic_device(msg.topic)
+        stats["cmds"] += 1
+        duration = random.uniform(0.5, 1.5) * args.duration
+        result = "Write Fail @ 8008000" if random.random() < args.fail_rate else "Update FINISHED"
+        t = threading.Timer(duration, client.publish,
+                            ("%s/%s/status" % (ROOT, device), result))
+        t.daemon = True
+        t.start()
+        timers.append(t)
+
+    client.message_callback_add(ROOT + "/+/cmd", on_cmd)
+    client.subscribe(ROOT + "/+/cmd", qos=1)
+    for device in devices:
+        client.publish("%s/%s/presence" % (ROOT, device), "online", qos=1, retain=True)
+    print("simulating %d gateways, Ctrl-C to stop" % args.count)
+    try:
+        while True:
+            time.sleep(5)
+            print("commands received: %d" % stats["cmds"])
+    except KeyboardInterrupt:
+        for device in devices:
+            client.publish("%s/%s/presence" % (ROOT, device), b"", retain=True)
+        time.sleep(1)
+    client.loop_stop()
+    return 0
+
+
+def main(argv=None):
+    parser = argparse.ArgumentParser(description=__doc__.split("\n")[1])
+    parser.add_argument("--broker", default="localhost")
+    parser.add_argument("--port", type=int, default=1883)
+    sub = parser.add_subparsers(dest="cmd", required=True)
+
+    p = sub.add_parser("run")
+    p.add_argument("--url", required=True, help="command sent to each device (image URL)")
+    src = p.add_mutually_exclusive_group(required=True)
+    src.add_argument("--devices", help="file with one device id per line")
+    src.add_argument("--discover", type=float, help="seconds to listen for online devices")
+    p.add_argument("--wave-size", type=int, default=50)
+    p.add_argument("--concurrency", type=int, default=10)
+    p.add_argument("--max-failure-rate", type=float, default=0.1)
+    p.add_argument("--min-samples", type=int, default=10,
+                   help="finished devices needed before the failure rate can pause")
+    p.add_argument("--timeout", type=float, default=600, help="per-device timeout (s)")
+    p.add_argument("--remaining", help="write devices still to update to this file")
+    p.set_defaults(func=cmd_run)
+
+    p = sub.add_parser("simulate")
+    p.add_argument("--count", type=int, default=1000)
+    p.add_argument("--fail-rate", type=float, default=0.0)
+    p.add_argument("--duration", type=float, default=2.0, help="mean update time (s)")
+    p.set_defaults(func=cmd_simulate)
+
+    args = parser.parse_args(argv)
+    return args.func(args)
+
+
+if __name__ == "__main__":
+    sys.exit(main())
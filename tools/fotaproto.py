@@ -0,0 +1,134 @@
+#!/usr/bin/env python3
+"""
+fotaproto.py - Host-side mirror of common/FotaProto.h.
+
+Encodes and decodes bootloader command frames exactly like the gateway and
+the bootloader, so host tools never carry their own byte offsets. Keep the
+constants below in sync with the header; `table` regenerates the CRC table
+literal pasted into it.
+
+Frame layout (little endian):
+    len u8 | cmd u8 | addr u32 | count u8 | data[count] | crc u32
+    len  = number of bytes after itself
+    crc  = STM32 CRC unit (poly 0x04C11DB7, init 0xFFFFFFFF, one byte per
+           32-bit word, no final xor) over cmd .. end of data
+
+Usage:
+    fotaproto.py table
+    fotaproto.py encode <cmd> [--addr 0x08008000] [--data hex]
+    fotaproto.py decode <hex frame>
+"""
+import argparse
+import struct
+import sys
+
+POLY = 0x04C11DB7
+MAX_FRAME = 200                     # HOSTM_MAX_SIZE
+HEADER_SIZE = 7                     # len, cmd, addr(4), count
+CRC_SIZE = 4
+OVERHEAD = HEADER_SIZE + CRC_SIZE
+MAX_DATA = MAX_FRAME - OVERHEAD
+
+ACK = 0xCD
+NACK = 0xAB
+KNOCK = 0xF0
+READ_BLOCK = 248                    # MEM_READ reply block size
+NODE_BROADCAST = 0xFFFFFFFF         # SELECT address of a silent broadcast session
+BITMAP_PAGE = 128                   # GET_BITMAP reply size
+COMP_INFO_SIZE = 17                 # GET_COMPONENTS record: id, version, addr, size, hash prefix
+
+COMMANDS = {
+    0x10: "GET_VER",
+    0x11: "GET_HELP",
+    0x12: "GET_CID",
+    0x14: "GO_TO_ADDR",
+    0x15: "FLASH_ERASE",
+    0x16: "MEM_WRITE",
+    0x17: "MEM_WRITE_LZ",
+    0x18: "SET_APP_INFO",
+    0x19: "MEM_READ",
+    0x1A: "SELECT",
+    0x1B: "GET_BITMAP",
+    0x1C: "DISCOVER",
+    0x1D: "SET_COMP_INFO",
+    0x1E: "GET_COMPONENTS",
+}
+BY_NAME = {v: k for k, v in COMMANDS.items()}
+
+
+def _table():
+    t = []
+    for i in range(256):
+        c = i << 24
+        for _ in range(8):
+            c = ((c << 1) ^ POLY if c & 0x80000000 else c << 1) & 0xFFFFFFFF
+        t.append(c)
+    return t
+
+
+TABLE = _table()
+
+
+def crc(data, value=0xFFFFFFFF):
+    for b in data:
+        value ^= b
+        for _ in range(4):
+            value = ((value << 8) & 0xFFFFFFFF) ^ TABLE[value >> 24]
+    return value
+
+
+def encode(cmd, addr=0, data=b""):
+    if len(data) > MAX_DATA:
+        raise ValueError("data too long (%d > %d)" % (len(data), MAX_DATA))
+    body = struct.pack("<BIB", cmd, addr & 0xFFFFFFFF, len(data)) + data
+    return bytes([len(body) + CRC_SIZE]) + body + struct.pack("<I", crc(body))
+
+
+def decode(frame):
+    """Return (cmd, addr, count, data) or raise ValueError."""
+    if len(frame) < 1 + 1 + CRC_SIZE or frame[0] + 1 != len(frame):
+        raise ValueError("bad frame size")
+    body, (host_crc,) = frame[1:-CRC_SIZE], struct.unpack("<I", frame[-CRC_SIZE:])
+    if crc(body) != host_crc:
+        raise ValueError("bad CRC")
+    if len(frame) < OVERHEAD:
+        return frame[1], 0, 0, b""
+    cmd, addr, count = struct.unpack_from("<BIB", body)
+    return cmd, addr, count, bytes(body[HEADER_SIZE - 1:])
+
+
+def command_name(cmd):
+    return COMMANDS.get(cmd, "0x%02X" % cmd)
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__.split("\n\n")[0])
+    sub = ap.add_subparsers(dest="cmd", required=True)
+    sub.add_parser("table", help="print the CRC table as a C initializer")
+    p = sub.add_parser("encode", help="build a frame")
+    p.add_argument("command", help="name (MEM_WRITE) or code (0x16)")
+    p.add_argument("--addr", type=lambda s: int(s, 0), default=0)
+    p.add_argument("--data", default="", help="payload as hex")
+    p = sub.add_parser("decode", help="check and split a frame")
+    p.add_argument("frame", help="frame as hex")
+    a = ap.parse_args()
+
+    if a.cmd == "table":
+        for i in range(0, 256, 6):
+            row = ", ".join("0x%08XU" % v for v in TABLE[i:i + 6])
+            print("    " + row + ("," if i + 6 < 256 else ""))
+    elif a.cmd == "encode":
+        code = BY_NAME.get(a.command.upper())
+        if code is None:
+            code = int(a.command, 0)
+        print(encode(code, a.addr, bytes.fromhex(a.data)).hex())
+    else:
+        try:
+            cmd, addr, count, data = decode(bytes.fromhex(a.frame))
+        except ValueError as e:
+            sys.exit(str(e))
+        print("%s addr=0x%08X count=%d data=%s" % (command_name(cmd), addr, count, data.hex()))
+
+
+if __name__ == "__main__":
+    main()
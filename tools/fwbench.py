@@ -0,0 +1,395 @@
+#!/usr/bin/env python3
+"""
+fwbench.py - Update-time benchmark matrix with regression baselines.
+
+Replays a complete point-to-point update (reset and knock, FLASH_ERASE,
+MEM_WRITE stream, SET_APP_INFO, GO_TO_ADDR) frame by frame through a timing
+model of the gateway and the bootloader, for every combination of image
+size, link, injected byte error rate and erase strategy. The gateway side
+mirrors main.cpp: AIMD chunk size (CHUNK_*), re-split of the rest of a
+write after a loss, Jacobson/Karels RTO, Karn's rule, rto/4 back-off before
+a retransmission, the 2x wire time floor on timeouts, retried SET_APP_INFO
+and GO_TO_ADDR. The target side charges the CRC and SHA-256 of each frame, word
+programming and the erase time of each sector. Frame sizes come from
+fotaproto.py, so they follow FotaProto.h.
+
+Errors are drawn from a seeded generator: the same matrix always gives the
+same numbers, and a change to a constant below or to the transfer logic
+shows up as a diff against the stored baseline (fwbench_baseline.json).
+
+    mass       FLASH_ERASE 0xFFFFFFFF: the whole application area
+    selective  FLASH_ERASE of the sectors the image covers only
+
+`trace` turns a session recorded by the gateway (uarttrace.py) into the
+same JSON record, so hardware runs can be kept next to the model.
+
+`goodput` sweeps noise levels on one link: corrupted bytes (the target
+NACKs on CRC) and dropped bytes (the target gives up on the frame after
+CBL_POINT_BYTE_TIMEOUT_MS of silence and NACKs, a lost reply costs the
+gateway its timeout). It compares the AIMD chunk size with a fixed
+CHUNK_START chunk, averaged over several seeds.
+
+Usage:
+    fwbench.py run [--json out.json] [--baseline fwbench_baseline.json] [--tolerance 5]
+    fwbench.py compare fwbench_baseline.json out.json [--tolerance 5]
+    fwbench.py trace session.trace --name uart115k-128k-mass
+    fwbench.py goodput [--link uart115k] [--size 128] [--seeds 5]
+"""
+import argparse
+import json
+import math
+import os
+import random
+import sys
+
+import fotaproto
+
+MODEL_VERSION = 3
+BASELINE = os.path.join(os.path.dirname(os.path.abspath(__file__)), "fwbench_baseline.json")
+
+# --- Gateway (esp32-code/main.cpp) ---
+CHUNK_MIN = 16
+CHUNK_START = 64
+CHUNK_MAX = fotaproto.MAX_DATA & ~3
+CHUNK_STEP = 16
+MAX_RETRIES = 5
+RTO_MIN = 20                        # ms
+RTO_MAX = 2000                      # ms
+RESET_MS = 150 + 5                  # reset pulse + end of knock burst
+GATEWAY_US = 150                    # LittleFS read + SHA-256 update + frame encode, per frame
+
+# --- Bootloader, STM32F401 at 84 MHz (datasheet typical, x32 parallelism) ---
+WORD_PROGRAM_US = 16
+SHA_US_PER_BYTE = 0.7               # Sha256.c
+CRC_US_PER_BYTE = 0.15              # Proto_Crc, 4 table lookups per byte
+SECTOR_ERASE_MS = {16: 250, 64: 550, 128: 1000}
+APP_SECTORS_KB = [16, 16, 64, 128, 128]  # sectors 2..6, 352 KB without BL_STAGING
+KNOCK_MS = 10
+POINT_BYTE_TIMEOUT_MS = 5           # CBL_POINT_BYTE_TIMEOUT_MS
+
+# --- Links ---
+SPI_XFER = fotaproto.MAX_FRAME + 1  # CBL_SPI_XFER_SIZE
+SPI_READY_US = 30                   # DMA re-arm before the target raises ready
+LINKS = {
+    "uart115k": ("uart", 115200),
+    "uart460k": ("uart", 460800),
+    "uart921k": ("uart", 921600),
+    "spi8m": ("spi", 8000000),
+}
+
+SIZES_KB = [8, 32, 128, 224]
+ERROR_RATES = [0.0, 1e-4, 1e-3]     # per byte, both directions
+ERASES = ["mass", "selective"]
+# goodput: (corrupted, dropped) per byte
+NOISE = [(0.0, 0.0), (1e-5, 0.0), (1e-4, 0.0), (1e-3, 0.0), (3e-3, 0.0),
+         (0.0, 1e-4), (0.0, 1e-3), (1e-3, 1e-3)]
+
+
+class Link:
+    def __init__(self, kind, rate):
+        self.kind, self.rate = kind, rate
+
+    def ms(self, nbytes):
+        """Time for nbytes in one direction."""
+        if self.kind == "uart":
+            return nbytes * 10 * 1000.0 / self.rate
+        exchanges = max(1, math.ceil(nbytes / (SPI_XFER - 1)))
+        return exchanges * (SPI_XFER * 8 * 1000.0 / self.rate + SPI_READY_US / 1000.0)
+
+    def wire_ms(self, nbytes):
+        """WIRE_MS() of main.cpp, integer ms."""
+        if self.kind == "uart":
+            return nbytes * 10 * 1000 // self.rate + 1
+        return SPI_XFER * 8 * 1000 // self.rate + 1
+
+
+class Gateway:
+    """sendWithRetry() and the link control state of main.cpp."""
+
+    def __init__(self, link, error_rate, rng, drop_rate=0.0, adaptive=True):
+        self.link, self.error_rate, self.rng = link, error_rate, rng
+        self.drop_rate, self.adaptive = drop_rate, adaptive
+        self.chunk, self.srtt, self.rttvar, self.rto = CHUNK_START, 0.0, 0.0, RTO_MAX
+        self.frames = self.retries = self.nacks = self.timeouts = 0
+        self.now = 0.0
+
+    def corrupted(self, nbytes):
+        return self.error_rate > 0 and self.rng.random() < 1 - (1 - self.error_rate) ** nbytes
+
+    def dropped(self, nbytes):
+        return self.drop_rate > 0 and self.rng.random() < 1 - (1 - self.drop_rate) ** nbytes
+
+    def on_ack(self, rtt):
+        if self.srtt == 0:
+            self.srtt, self.rttvar = rtt, rtt / 2.0
+        else:
+            self.rttvar = 0.75 * self.rttvar + 0.25 * abs(self.srtt - rtt)
+            self.srtt = 0.875 * self.srtt + 0.125 * rtt
+        self.rto = min(max(int(self.srtt + 4 * self.rttvar), RTO_MIN), RTO_MAX)
+        if self.adaptive:
+            self.chunk = min(CHUNK_MAX, self.chunk + CHUNK_STEP)
+
+    def on_loss(self):
+        if self.adaptive:
+            self.chunk = max(CHUNK_MIN, (self.chunk // 2) & ~3)
+        self.rto = min(RTO_MAX, self.rto * 2)
+
+    def exchange(self, length, target_ms, wait, reply=3):
+        """One frame and its status reply. Returns the round trip in ms, None if lost."""
+        frame = length + fotaproto.OVERHEAD
+        t0 = self.now
+        self.now += GATEWAY_US / 1000.0 + self.link.ms(frame)
+        if self.dropped(frame):
+            # Frame cut short: inter-byte timeout on the target, then NACK
+            self.nacks += 1
+            self.now += POINT_BYTE_TIMEOUT_MS + self.link.ms(1)
+            return None
+        if self.corrupted(frame):
+            # CRC refused: NACK as soon as the frame is in
+            self.nacks += 1
+            self.now += frame * CRC_US_PER_BYTE / 1000.0 + self.link.ms(1)
+            return None
+        self.now += target_ms + self.link.ms(reply)
+        if self.corrupted(reply) or self.dropped(reply):
+            # ACK byte lost: readResponse() runs into its timeout
+            self.timeouts += 1
+            self.now = t0 + wait
+            return None
+        return self.now - t0
+
+    def back_off(self):
+        self.retries += 1
+        self.now += self.rto // 4
+
+    def command(self, length, target_ms, split=True):
+        """sendWithRetry(): at most MAX_RETRIES retransmissions in a row; after a
+        loss the rest of a MEM_WRITE is re-split at the new chunk size.
+        target_ms(n) is the target time for n bytes. Returns False on give-up."""
+        done = attempt = 0
+        while done < length:
+            if attempt > MAX_RETRIES:
+                return False
+            if attempt:
+                self.back_off()
+            n = min(length - done, self.chunk) if split else length
+            rtt = self.exchange(n, target_ms(n), max(self.rto, 2 * self.link.wire_ms(n + 14)))
+            if rtt is None:
+                self.on_loss()
+                attempt += 1
+                continue
+            if attempt == 0:
+                self.on_ack(int(rtt))
+            self.frames += 1
+            done += n
+            attempt = 0
+        return True
+
+    def retried(self, length, target_ms):
+        """commandWithRetry(): SET_APP_INFO, GO_TO_ADDR. Fixed waitStatus() timeout,
+        no RTT sample, no chunk change."""
+        for attempt in range(MAX_RETRIES + 1):
+            if attempt:
+                self.back_off()
+            if self.exchange(length, target_ms, RTO_MAX) is not None:
+                return True
+        return False
+
+    def single(self, length, target_ms, timeout):
+        """waitStatus() without retry: FLASH_ERASE."""
+        return self.exchange(length, target_ms, timeout) is not None
+
+
+def erase_ms(size, strategy):
+    if strategy == "mass":
+        sectors = APP_SECTORS_KB
+    else:
+        sectors, covered = [], 0
+        for kb in APP_SECTORS_KB:
+            if covered >= size:
+                break
+            sectors.append(kb)
+            covered += kb * 1024
+    return sum(SECTOR_ERASE_MS[kb] for kb in sectors)
+
+
+def write_ms(length):
+    return (length + fotaproto.OVERHEAD) * CRC_US_PER_BYTE / 1000.0 + \
+        length * SHA_US_PER_BYTE / 1000.0 + math.ceil(length / 4) * WORD_PROGRAM_US / 1000.0
+
+
+def simulate(size_kb, link_name, error_rate, strategy, seed=1, drop_rate=0.0, adaptive=True):
+    size = size_kb * 1024
+    link = Link(*LINKS[link_name])
+    name = "%s-%dk-%s-e%g" % (link_name, size_kb, strategy, error_rate)
+    if drop_rate or not adaptive:
+        name += "-d%g-%s" % (drop_rate, "aimd" if adaptive else "fixed")
+    gw = Gateway(link, error_rate, random.Random("%s/%d" % (name, seed)), drop_rate, adaptive)
+
+    gw.now = RESET_MS + KNOCK_MS
+    t_erase = erase_ms(size, strategy)
+    ok = gw.single(0, t_erase, 10000)
+    erase_done = gw.now
+
+    sent = 0
+    while ok and sent < size:
+        length = min(gw.chunk, size - sent)
+        ok = gw.command(length, write_ms)
+        sent += length
+    transfer_done = gw.now
+
+    # SET_APP_INFO (size + SHA-256), then GO_TO_ADDR
+    ok = ok and gw.retried(4 + 32, 0.1) and gw.retried(0, 0.1)
+    return {
+        "name": name,
+        "image_kb": size_kb,
+        "link": link_name,
+        "error_rate": error_rate,
+        "erase": strategy,
+        "ok": ok,
+        "total_ms": round(gw.now, 1),
+        "erase_ms": round(erase_done - RESET_MS - KNOCK_MS, 1),
+        "transfer_ms": round(transfer_done - erase_done, 1),
+        "frames": gw.frames,
+        "retries": gw.retries,
+        "nacks": gw.nacks,
+        "timeouts": gw.timeouts,
+        "throughput_Bps": int(size * 1000 / max(1.0, transfer_done - erase_done)),
+    }
+
+
+def run_matrix():
+    results = [simulate(s, l, e, m) for l in LINKS for s in SIZES_KB for e in ERROR_RATES for m in ERASES]
+    return {"model": MODEL_VERSION, "results": results}
+
+
+def compare(base, cur, tolerance):
+    """Print per-scenario deltas; return the number of regressions."""
+    if base.get("model") != cur.get("model"):
+        print("note: model version %s vs %s, constants differ" % (base.get("model"), cur.get("model")))
+    now = {r["name"]: r for r in cur["results"]}
+    regressions = 0
+    for b in base["results"]:
+        c = now.get(b["name"])
+        if c is None:
+            print("MISSING    %s" % b["name"])
+            regressions += 1
+            continue
+        delta = 100.0 * (c["total_ms"] - b["total_ms"]) / max(1.0, b["total_ms"])
+        if delta > tolerance or (b["ok"] and not c["ok"]):
+            tag = "REGRESSED"
+            regressions += 1
+        elif delta < -tolerance:
+            tag = "improved"
+        else:
+            continue
+        print("%-10s %-36s %10.1f ms -> %10.1f ms (%+.1f%%)" % (tag, b["name"], b["total_ms"], c["total_ms"], delta))
+    print("%d scenarios, %d regressions over %g%%" % (len(base["results"]), regressions, tolerance))
+    return regressions
+
+
+def print_table(results):
+    print("%-36s %10s %9s %11s %7s %8s" % ("scenario", "total ms", "erase ms", "transfer ms", "retries", "B/s"))
+    for r in results:
+        print("%-36s %10.1f %9.1f %11.1f %7d %8d%s" %
+              (r["name"], r["total_ms"], r["erase_ms"], r["transfer_ms"], r["retries"], r["throughput_Bps"],
+               "" if r["ok"] else "  FAILED"))
+
+
+def cmd_run(args):
+    cur = run_matrix()
+    if args.json:
+        # One scenario per line: baseline updates diff line by line
+        with open(args.json, "w") as f:
+            f.write('{"model": %d, "results": [\n' % cur["model"])
+            f.write(",\n".join(json.dumps(r) for r in cur["results"]))
+            f.write("\n]}\n")
+    else:
+        print_table(cur["results"])
+    if args.baseline:
+        with open(args.baseline) as f:
+            return 1 if compare(json.load(f), cur, args.tolerance) else 0
+    return 0
+
+
+def cmd_compare(args):
+    with open(args.baseline) as f:
+        base = json.load(f)
+    with open(args.current) as f:
+        cur = json.load(f)
+    return 1 if compare(base, cur, args.tolerance) else 0
+
+
+def cmd_trace(args):
+    import uarttrace
+    baud, records = uarttrace.load(args.trace)
+    written, seen, resent, frames = 0, set(), 0, 0
+    for _, kind, data in records:
+        if kind != uarttrace.TX:
+            continue
+        for frame in uarttrace.split_frames(data):
+            try:
+                cmd, addr, count, _ = fotaproto.decode(frame)
+            except ValueError:
+                continue
+            frames += 1
+            if cmd == fotaproto.BY_NAME["MEM_WRITE"]:
+                if addr in seen:
+                    resent += 1
+                else:
+                    seen.add(addr)
+                    written += count
+    duration = (records[-1][0] - records[0][0]) / 1000.0 if records else 0
+    print(json.dumps({"name": args.name, "image_kb": written // 1024, "link": "trace@%d" % baud,
+                      "ok": True, "total_ms": round(duration, 1), "frames": frames, "retries": resent},
+                     indent=1))
+
+
+def cmd_goodput(args):
+    """Transfer-phase goodput against noise, AIMD vs fixed chunk."""
+    print("%-9s %-9s %-6s %10s %8s %8s %6s" % ("corrupt", "drop", "chunk", "goodput B/s", "retries", "NACK",
+                                                 "done"))
+    for error_rate, drop_rate in NOISE:
+        for adaptive in (True, False):
+            runs = [simulate(args.size, args.link, error_rate, "selective", seed, drop_rate, adaptive)
+                    for seed in range(1, args.seeds + 1)]
+            done = [r for r in runs if r["ok"]]
+            goodput = sum(r["throughput_Bps"] for r in done) / len(done) if done else 0
+            print("%-9g %-9g %-6s %10d %8.1f %8.1f %3d/%-2d" %
+                  (error_rate, drop_rate, "aimd" if adaptive else "fixed", goodput,
+                   sum(r["retries"] for r in runs) / float(len(runs)),
+                   sum(r["nacks"] for r in runs) / float(len(runs)), len(done), len(runs)))
+    return 0
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__.split("\n\n")[0])
+    sub = ap.add_subparsers(dest="cmd", required=True)
+    p = sub.add_parser("run", help="run the scenario matrix")
+    p.add_argument("--json", help="write results here instead of printing a table")
+    p.add_argument("--baseline", nargs="?", const=BASELINE, help="compare with a baseline (default: stored one)")
+    p.add_argument("--tolerance", type=float, default=5.0, help="allowed slowdown in %%")
+    p = sub.add_parser("compare", help="compare two result files")
+    p.add_argument("baseline")
+    p.add_argument("current")
+    p.add_argument("--tolerance", type=float, default=5.0)
+    p = sub.add_parser("trace", help="result record from a recorded gateway session")
+    p.add_argument("trace")
+    p.add_argument("--name", required=True, help="scenario name to file it under")
+    p = sub.add_parser("goodput", help="goodput across injected error / drop rates")
+    p.add_argument("--link", choices=sorted(LINKS), default="uart115k")
+    p.add_argument("--size", type=int, default=128, help="image size in KB")
+    p.add_argument("--seeds", type=int, default=5, help="runs averaged per noise level")
+    a = ap.parse_args()
+
+    if a.cmd == "run":
+        sys.exit(cmd_run(a))
+    elif a.cmd == "compare":
+        sys.exit(cmd_compare(a))
+    elif a.cmd == "goodput":
+        sys.exit(cmd_goodput(a))
+    else:
+        cmd_trace(a)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,177 @@
+#!/usr/bin/env python3
+"""
+fwdelta.py - Delta (patch) generator for the STM32 FOTA gateway.
+
+Builds an FDP1 patch that turns the image currently installed on the target
+(the gateway keeps a copy in /current.bin) into a new image. The gateway
+applies the patch as a stream before flashing, so only the patch crosses the
+WAN link.
+
+Patch layout (little endian):
+    "FDP1" | base_size u32 | base_crc u32 | target_size u32 | target_crc u32
+    then a sequence of operations until target_size bytes are produced:
+    0x01 COPY   : base_offset u32 | length u32
+    0x02 INSERT : length u32 | <length literal bytes>
+
+CRCs are standard CRC-32 (zlib), the same value esp_rom_crc32_le() returns.
+
+Usage:
+    fwdelta.py diff  old.bin new.bin out.patch
+    fwdelta.py apply old.bin in.patch out.bin
+    fwdelta.py bench old.bin new.bin [--wan-kbps 256]
+"""
+import argparse
+import struct
+import sys
+import time
+import zlib
+
+MAGIC = b"FDP1"
+HEADER = struct.Struct("<4sIIII")
+OP_COPY = 0x01
+OP_INSERT = 0x02
+
+KEY_LEN = 8        # bytes hashed to find match candidates
+MIN_COPY = 16      # a COPY op costs 9 bytes, shorter matches are inserted
+MAX_CANDIDATES = 8 # candidates tried per position (bounds worst case)
+
+
+def _index(base):
+    index = {}
+    for i in range(len(base) - KEY_LEN + 1):
+        key = base[i:i + KEY_LEN]
+        slot = index.get(key)
+        if slot is None:
+            index[key] = [i]
+        elif len(slot) < MAX_CANDIDATES:
+            slot.append(i)
+    return index
+
+
+def _match_len(base, b_off, target, t_off):
+    n = 0
+    limit = min(len(base) - b_off, len(target) - t_off)
+    while n < limit and base[b_off + n] == target[t_off + n]:
+        n += 1
+    return n
+
+
+def diff(base, target):
+    index = _index(base)
+    out = bytearray(HEADER.pack(MAGIC, len(base), zlib.crc32(base),
+                                len(target), zlib.crc32(target)))
+    literal = bytearray()
+    expected = 0  # base offset that would continue the previous COPY
+    pos = 0
+
+    def flush_literal():
+        if literal:
+            out.extend(struct.pack("<BI", OP_INSERT, len(literal)))
+            out.extend(literal)
+            literal.clear()
+
+    while pos < len(target):
+        best_off, best_len = 0, 0
+        # Code that did not move is the common case: try it first.
+        if expected < len(base):
+            best_off, best_len = expected, _match_len(base, expected, target, pos)
+        if best_len < MIN_COPY:
+            for cand in index.get(bytes(target[pos:pos + KEY_LEN]), ()):
+                n = _match_len(base, cand, target, pos)
+                if n > best_len:
+                    best_off, best_len = cand, n
+        if best_len >= MIN_COPY:
+            flush_literal()
+            out.extend(struct.pack("<BII", OP_COPY, best_off, best_len))
+            pos += best_len
+            expected = best_off + best_len
+        else:
+            literal.append(target[pos])
+            pos += 1
+            expected += 1
+    flush_literal()
+    return bytes(out)
+
+
+def apply(base, patch):
+    magic, base_size, base_crc, target_size, target_crc = HEADER.unpack_from(patch, 0)
+    if magic != MAGIC:
+        raise ValueError("not an FDP1 patch")
+    if base_size != len(base) or base_crc != zlib.crc32(base):
+        raise ValueError("patch does not match the installed image")
+    out = bytearray()
+    p = HEADER.size
+    while len(out) < target_size:
+        op = patch[p]
+        if op == OP_COPY:
+            off, length = struct.unpack_from("<II", patch, p + 1)
+            out.extend(base[off:off + length])
+            p += 9
+        elif op == OP_INSERT:
+            (length,) = struct.unpack_from("<I", patch, p + 1)
+            out.extend(patch[p + 5:p + 5 + length])
+            p += 5 + length
+        else:
+            raise ValueError("bad opcode 0x%02X at %d" % (op, p))
+    if zlib.crc32(out) != target_crc:
+        raise ValueError("patched image CRC mismatch")
+    return bytes(out)
+
+
+def _read(path):
+    with open(path, "rb") as f:
+        return f.read()
+
+
+def _write(path, data):
+    with open(path, "wb") as f:
+        f.write(data)
+
+
+def cmd_diff(args):
+    patch = diff(_read(args.old), _read(args.new))
+    _write(args.out, patch)
+    print("%s: %d bytes" % (args.out, len(patch)))
+
+
+def cmd_apply(args):
+    _write(args.out, apply(_read(args.old), _read(args.patch)))
+
+
+def cmd_bench(args):
+    base, target = _read(args.old), _read(args.new)
+    t0 = time.perf_counter()
+    patch = diff(base, target)
+    t1 = time.perf_counter()
+    rebuilt = apply(base, patch)
+    t2 = time.perf_counter()
+    assert rebuilt == target
+    wan = args.wan_kbps * 1000 / 8
+    print("full image      : %8d bytes" % len(target))
+    print("patch           : %8d bytes (%.1f%% of full)" %
+          (len(patch), 100.0 * len(patch) / max(1, len(target))))
+    print("diff time       : %8.1f ms" % ((t1 - t0) * 1000))
+    print("apply time      : %8.1f ms (host)" % ((t2 - t1) * 1000))
+    print("WAN transfer    : %8.2f s full / %.2f s patch @ %d kbit/s" %
+          (len(target) / wan, len(patch) / wan, args.wan_kbps))
+
+
+def main(argv=None):
+    parser = argparse.ArgumentParser(description=__doc__.split("\n")[1])
+    sub = parser.add_subparsers(dest="cmd", required=True)
+    p = sub.add_parser("diff")
+    p.add_argument("old"); p.add_argument("new"); p.add_argument("out")
+    p.set_defaults(func=cmd_diff)
+    p = sub.add_parser("apply")
+    p.add_argument("old"); p.add_argument("patch"); p.add_argument("out")
+    p.set_defaults(func=cmd_apply)
+    p = sub.add_parser("bench")
+    p.add_argument("old"); p.add_argument("new")
+    p.add_argument("--wan-kbps", type=int, default=256)
+    p.set_defaults(func=cmd_bench)
+    args = parser.parse_args(argv)
+    args.func(args)
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,200 @@
+#!/usr/bin/env python3
+"""
+fwmanifest.py - Multi-component FMF1 manifests for the STM32 FOTA gateway.
+
+A manifest carries several flash regions (application, configuration,
+calibration tables...) with their own id, version and SHA-256. The gateway
+asks the bootloader for its component list (GET_COMPONENTS) and only erases
+and rewrites the components whose hash changed; a configuration-only change
+costs the configuration sectors, not the whole application area.
+
+Layout (little endian):
+    "FMF1" | count u8 | 3 reserved bytes
+    entry  : id u8 | sectors u8 | reserved u16 | version u32 | addr u32 |
+             size u32 | sha256[32] | name[16]
+    then the component contents, in entry order
+Id 0 is the application and must start at 0x08008000. Every component
+starts on a sector boundary and owns whole sectors: erasing one never
+touches another. fwsign.py signs the SHA-256 of the header and the table;
+each content is then checked against its own hash.
+
+Usage:
+    fwmanifest.py build out.fmf --comp app:0:0x08008000:app.bin[:version] \\
+                                --comp config:1:0x08020000:cfg.bin:7
+    fwmanifest.py show  out.fmf
+    fwmanifest.py diff  old.fmf new.fmf     # what an update would send
+"""
+import argparse
+import hashlib
+import struct
+import sys
+
+MAGIC = b"FMF1"
+HEADER = struct.Struct("<4sB3x")
+ENTRY = struct.Struct("<BBHIII32s16s")
+MAX_COMPONENTS = 7                  # PROTO_MAX_COMPONENTS
+APP_ID = 0
+APP_BASE = 0x08008000
+FLASH_BASE = 0x08000000
+
+# STM32F4 sector starts (offsets) followed by the end of flash
+SECTORS = {
+    256: [0x0000, 0x4000, 0x8000, 0xC000, 0x10000, 0x20000, 0x40000],
+    512: [0x0000, 0x4000, 0x8000, 0xC000, 0x10000, 0x20000, 0x40000, 0x60000, 0x80000],
+}
+
+
+def app_area(flash_kb, compact=False, staging=False):
+    """Component area: sector 2 up to the metadata sector.
+
+    The last sector holds the metadata, unless the bootloader is BL_COMPACT
+    (metadata in sector 1); BL_STAGING takes one more sector off the end.
+    """
+    bases = SECTORS[flash_kb]
+    end = len(bases) - (1 if compact else 2) - (1 if staging else 0)
+    return FLASH_BASE + bases[2], FLASH_BASE + bases[end]
+
+
+def sector_span(flash_kb, addr, size):
+    """Return the sector count covering [addr, addr + size), or raise if unaligned."""
+    bases = [FLASH_BASE + b for b in SECTORS[flash_kb]]
+    if addr not in bases:
+        raise ValueError("0x%08X is not a sector boundary" % addr)
+    first = bases.index(addr)
+    if first + 1 >= len(bases):
+        raise ValueError("0x%08X is the end of flash" % addr)
+    last = first
+    while bases[last + 1] < addr + size:
+        last += 1
+        if last + 1 >= len(bases):
+            raise ValueError("0x%08X + %d runs past the end of flash" % (addr, size))
+    return last - first + 1, bases[last + 1]
+
+
+def parse_comp(text):
+    parts = text.split(":")
+    if len(parts) not in (4, 5):
+        raise argparse.ArgumentTypeError("expected name:id:addr:file[:version]")
+    name, cid, addr, path = parts[:4]
+    if len(name.encode()) > 15:
+        raise argparse.ArgumentTypeError("name longer than 15 bytes: " + name)
+    return {"name": name, "id": int(cid, 0), "addr": int(addr, 0), "path": path,
+            "version": int(parts[4], 0) if len(parts) == 5 else 0}
+
+
+def build(comps, flash_kb, compact=False, staging=False):
+    if not 0 < len(comps) <= MAX_COMPONENTS:
+        raise ValueError("1 to %d components" % MAX_COMPONENTS)
+    lo, hi = app_area(flash_kb, compact, staging)
+    comps = sorted(comps, key=lambda c: c["addr"])
+    table, blobs, end = b"", b"", 0
+    for c in comps:
+        data = open(c["path"], "rb").read()
+        if not data:
+            raise ValueError("%s: empty" % c["path"])
+        if not 0 <= c["id"] <= 255 or [o["id"] for o in comps].count(c["id"]) > 1:
+            raise ValueError("%s: bad or duplicate id %d" % (c["name"], c["id"]))
+        if c["id"] == APP_ID and c["addr"] != APP_BASE:
+            raise ValueError("the application (id 0) must start at 0x%08X" % APP_BASE)
+        sectors, stop = sector_span(flash_kb, c["addr"], len(data))
+        if c["addr"] < lo or stop > hi:
+            raise ValueError("%s: 0x%08X-0x%08X outside the component area 0x%08X-0x%08X" %
+                             (c["name"], c["addr"], stop, lo, hi))
+        if c["addr"] < end:
+            raise ValueError("%s: overlaps the sectors of the previous component" % c["name"])
+        end = stop
+        table += ENTRY.pack(c["id"], sectors, 0, c["version"], c["addr"], len(data),
+                            hashlib.sha256(data).digest(), c["name"].encode())
+        blobs += data
+    return HEADER.pack(MAGIC, len(comps)) + table + blobs
+
+
+def parse(raw):
+    magic, count = HEADER.unpack_from(raw)
+    if magic != MAGIC:
+        raise ValueError("not an FMF1 manifest")
+    entries, offset = [], HEADER.size + count * ENTRY.size
+    for i in range(count):
+        cid, sectors, _, version, addr, size, sha, name = ENTRY.unpack_from(raw, HEADER.size + i * ENTRY.size)
+        data = raw[offset:offset + size]
+        entries.append({"id": cid, "sectors": sectors, "version": version, "addr": addr, "size": size,
+                        "sha": sha, "name": name.rstrip(b"\0").decode(errors="replace"),
+                        "ok": len(data) == size and hashlib.sha256(data).digest() == sha})
+        offset += size
+    return entries
+
+
+def erase_bytes(flash_kb, e):
+    bases = [FLASH_BASE + b for b in SECTORS[flash_kb]]
+    first = bases.index(e["addr"])
+    return bases[first + e["sectors"]] - bases[first]
+
+
+def cmd_build(args):
+    try:
+        raw = build(args.comp, args.flash_kb, args.compact, args.staging)
+    except (OSError, ValueError) as e:
+        sys.exit(str(e))
+    with open(args.out, "wb") as f:
+        f.write(raw)
+    print("%s: %d components, %d bytes (sign it with fwsign.py sign)" % (args.out, len(args.comp), len(raw)))
+
+
+def cmd_show(args):
+    entries = parse(open(args.manifest, "rb").read())
+    print("id  name             version  address     size     sectors  sha256")
+    for e in entries:
+        print("%-3d %-16s %-8d 0x%08X  %-8d %-8d %s%s" %
+              (e["id"], e["name"], e["version"], e["addr"], e["size"], e["sectors"],
+               e["sha"][:8].hex(), "" if e["ok"] else "  CONTENT MISMATCH"))
+    return 0 if all(e["ok"] for e in entries) else 1
+
+
+def cmd_diff(args):
+    old = {e["id"]: e for e in parse(open(args.old, "rb").read())}
+    new = parse(open(args.new, "rb").read())
+    lo, hi = app_area(args.flash_kb, args.compact, args.staging)
+    sent = erased = 0
+    for e in new:
+        prev = old.get(e["id"])
+        same = prev is not None and (prev["addr"], prev["size"], prev["sha"]) == (e["addr"], e["size"], e["sha"])
+        if not same:
+            sent += e["size"]
+            erased += erase_bytes(args.flash_kb, e)
+        print("%-16s %s" % (e["name"], "unchanged" if same else "%d bytes, %d KB erased" %
+                            (e["size"], erase_bytes(args.flash_kb, e) // 1024)))
+    full = sum(e["size"] for e in new)
+    print("update: %d bytes sent, %d KB erased (monolithic image: %d bytes, %d KB erased)" %
+          (sent, erased // 1024, full, (hi - lo) // 1024))
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__.split("\n\n")[0])
+    ap.add_argument("--flash-kb", type=int, choices=sorted(SECTORS), default=512,
+                    help="target flash size (F401RE: 512)")
+    ap.add_argument("--compact", action="store_true",
+                    help="target runs a BL_COMPACT bootloader (metadata in sector 1)")
+    ap.add_argument("--staging", action="store_true",
+                    help="target is built with BL_STAGING (one sector less for the application)")
+    sub = ap.add_subparsers(dest="cmd", required=True)
+    p = sub.add_parser("build", help="build a manifest from component files")
+    p.add_argument("out")
+    p.add_argument("--comp", type=parse_comp, action="append", required=True,
+                   help="name:id:addr:file[:version]")
+    p = sub.add_parser("show", help="list components and check their hashes")
+    p.add_argument("manifest")
+    p = sub.add_parser("diff", help="components an update from old to new would rewrite")
+    p.add_argument("old")
+    p.add_argument("new")
+    a = ap.parse_args()
+
+    if a.cmd == "build":
+        cmd_build(a)
+    elif a.cmd == "show":
+        sys.exit(cmd_show(a))
+    else:
+        cmd_diff(a)
+
+
+if __name__ == "__main__":
+    main()
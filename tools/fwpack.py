@@ -0,0 +1,251 @@
+#!/usr/bin/env python3
+"""
+fwpack.py - Compressed image container for the STM32 FOTA bootloader.
+
+Packs a raw application image into FWZ1 records that the gateway forwards
+one by one with CBL_MEM_WRITE_LZ_CMD (0x17). Each record is an independent
+LZ4-style block whose back-references may point anywhere in the image
+already written, because the bootloader reads the match source back from
+flash: the decompression window costs no RAM on the target.
+
+Container layout (little endian):
+    "FWZ1" | base_addr u32 | raw_size u32 | raw_crc u32 | record_count u32
+    record : out_addr u32 | clen u8 | <clen bytes of LZ sequences>
+
+Sequence: token (literal length << 4 | match length - 4), optional 255-run
+length extensions, literals, offset u16, optional match length extensions.
+A record always ends with a literal-only sequence.
+
+Usage:
+    fwpack.py pack   app.bin app.fwz [--base 0x08008000] [--block 180]
+    fwpack.py unpack app.fwz app.bin
+    fwpack.py stats  app.bin [--block 180] [--baud 115200]
+"""
+import argparse
+import struct
+import sys
+import zlib
+
+MAGIC = b"FWZ1"
+HEADER = struct.Struct("<4sIIII")
+RECORD = struct.Struct("<IB")
+
+APP_BASE = 0x08008000
+MIN_MATCH = 4
+MAX_OFFSET = 0xFFFF
+MAX_BLOCK = 189       # HOSTM_MAX_SIZE - (len, cmd, addr, len, crc)
+CHAIN = 16            # candidates tried per position
+FRAME_OVERHEAD = 11   # len + cmd + addr(4) + len + crc(4)
+REPLY_BYTES = 3       # ACK + len + status
+
+
+def _len_ext(n):
+    """Encoded size of the 255-run extension of a 4-bit length field."""
+    if n < 15:
+        return 0
+    return (n - 15) // 255 + 1
+
+
+def _put_len(out, n):
+    if n >= 15:
+        n -= 15
+        while n >= 255:
+            out.append(255)
+            n -= 255
+        out.append(n)
+
+
+def _sequence(lits, offset=0, mlen=0):
+    out = bytearray()
+    ml = mlen - MIN_MATCH if mlen else 0
+    out.append((min(len(lits), 15) << 4) | min(ml, 15))
+    _put_len(out, len(lits))
+    out.extend(lits)
+    if mlen:
+        out.extend(struct.pack("<H", offset))
+        _put_len(out, ml)
+    return out
+
+
+def _literal_cost(n):
+    return 1 + _len_ext(n) + n
+
+
+def seq_cost_with_tail(seq):
+    # A record must still be able to end with an (empty) literal token.
+    return len(seq) + 1
+
+
+def compress(data, base=APP_BASE, block=MAX_BLOCK):
+    """Return a list of (out_addr, compressed_bytes) records."""
+    n = len(data)
+    chains = {}
+    records = []
+    pos = 0
+
+    def insert(i):
+        if i + MIN_MATCH <= n:
+            key = data[i:i + MIN_MATCH]
+            chain = chains.setdefault(key, [])
+            chain.append(i)
+            if len(chain) > CHAIN:
+                del chain[0]
+
+    def find(i):
+        best_off, best_len = 0, 0
+        for cand in reversed(chains.get(data[i:i + MIN_MATCH], ())):
+            if i - cand > MAX_OFFSET:
+                break
+            m = 0
+            while i + m < n and data[cand + m] == data[i + m]:
+                m += 1
+            if m > best_len:
+                best_off, best_len = i - cand, m
+        return best_off, best_len
+
+    while pos < n:
+        start = pos
+        lit_start = pos
+        out = bytearray()
+        while pos < n:
+            off, mlen = find(pos)
+            if mlen >= MIN_MATCH:
+                seq = _sequence(data[lit_start:pos], off, mlen)
+                if len(out) + seq_cost_with_tail(seq) > block:
+                    break
+                out.extend(seq)
+                for i in range(pos, pos + mlen):
+                    insert(i)
+                pos += mlen
+                lit_start = pos
+            else:
+                if len(out) + _literal_cost(pos + 1 - lit_start) > block:
+                    break
+                insert(pos)
+                pos += 1
+        out.extend(_sequence(data[lit_start:pos]))
+        records.append((base + start, bytes(out)))
+    return records
+
+
+def decompress(records, base, size):
+    """Reference decoder, mirrors BL_LZ_Decode() on the target."""
+    image = bytearray(b"\xFF" * size)
+    for addr, blob in records:
+        dest = addr - base
+        p = 0
+        while p < len(blob):
+            token = blob[p]; p += 1
+            length = token >> 4
+            if length == 15:
+                while True:
+                    b = blob[p]; p += 1
+                    length += b
+                    if b != 255:
+                        break
+            image[dest:dest + length] = blob[p:p + length]
+            p += length
+            dest += length
+            if p >= len(blob):
+                break
+            offset = blob[p] | (blob[p + 1] << 8); p += 2
+            mlen = (token & 0x0F) + MIN_MATCH
+            if token & 0x0F == 15:
+                while True:
+                    b = blob[p]; p += 1
+                    mlen += b
+                    if b != 255:
+                        break
+            for _ in range(mlen):
+                image[dest] = image[dest - offset]
+                dest += 1
+    return bytes(image)
+
+
+def write_container(path, data, base, records):
+    with open(path, "wb") as f:
+        f.write(HEADER.pack(MAGIC, base, len(data), zlib.crc32(data), len(records)))
+        for addr, blob in records:
+            f.write(RECORD.pack(addr, len(blob)))
+            f.write(blob)
+
+
+def read_container(path):
+    with open(path, "rb") as f:
+        raw = f.read()
+    magic, base, size, crc, count = HEADER.unpack_from(raw, 0)
+    if magic != MAGIC:
+        raise ValueError("not an FWZ1 container")
+    records, p = [], HEADER.size
+    for _ in range(count):
+        addr, clen = RECORD.unpack_from(raw, p)
+        p += RECORD.size
+        records.append((addr, raw[p:p + clen]))
+        p += clen
+    return base, size, crc, records
+
+
+def link_time(frames, payload, baud):
+    """Seconds on a 8N1 UART: frame bytes out, ACK + status back."""
+    return (frames * (FRAME_OVERHEAD + REPLY_BYTES) + payload) * 10.0 / baud
+
+
+def cmd_pack(args):
+    data = open(args.input, "rb").read()
+    records = compress(data, args.base, args.block)
+    write_container(args.output, data, args.base, records)
+    print("%s: %d records" % (args.output, len(records)))
+
+
+def cmd_unpack(args):
+    base, size, crc, records = read_container(args.input)
+    image = decompress(records, base, size)
+    if zlib.crc32(image) != crc:
+        raise SystemExit("CRC mismatch")
+    open(args.output, "wb").write(image)
+
+
+def cmd_stats(args):
+    data = open(args.input, "rb").read()
+    records = compress(data, APP_BASE, args.block)
+    assert decompress(records, APP_BASE, len(data)) == data
+    packed = sum(len(b) for _, b in records)
+    raw_frames = (len(data) + 63) // 64
+    t_raw = link_time(raw_frames, len(data), args.baud)
+    t_lz = link_time(len(records), packed, args.baud)
+    print("raw image        : %8d bytes, %5d frames of 64 bytes" % (len(data), raw_frames))
+    print("compressed       : %8d bytes, %5d frames (ratio %.2f)" %
+          (packed, len(records), len(data) / max(1, packed)))
+    print("link time @%-6d: %8.2f s raw / %.2f s compressed" % (args.baud, t_raw, t_lz))
+    print("effective rate   : %8.0f B/s raw / %.0f B/s compressed (x%.2f)" %
+          (len(data) / t_raw, len(data) / t_lz, t_raw / t_lz))
+
+
+def _int(text):
+    return int(text, 0)
+
+
+def main(argv=None):
+    parser = argparse.ArgumentParser(description=__doc__.split("\n")[1])
+    sub = parser.add_subparsers(dest="cmd", required=True)
+    p = sub.add_parser("pack")
+    p.add_argument("input"); p.add_argument("output")
+    p.add_argument("--base", type=_int, default=APP_BASE)
+    p.add_argument("--block", type=int, default=MAX_BLOCK)
+    p.set_defaults(func=cmd_pack)
+    p = sub.add_parser("unpack")
+    p.add_argument("input"); p.add_argument("output")
+    p.set_defaults(func=cmd_unpack)
+    p = sub.add_parser("stats")
+    p.add_argument("input")
+    p.add_argument("--block", type=int, default=MAX_BLOCK)
+    p.add_argument("--baud", type=int, default=115200)
+    p.set_defaults(func=cmd_stats)
+    args = parser.parse_args(argv)
+    if not 8 <= args.__dict__.get("block", MAX_BLOCK) <= MAX_BLOCK:
+        parser.error("--block must be between 8 and %d" % MAX_BLOCK)
+    args.func(args)
+
+
+if __name__ == "__main__":
+    sys.exit(main())
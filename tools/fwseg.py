@@ -0,0 +1,210 @@
+#!/usr/bin/env python3
+"""
+fwseg.py - Sparse segment image builder for the STM32 FOTA gateway.
+
+A flat .bin carries the gaps between linker sections and every 0xFF run
+(reserved areas, padding) byte for byte, although programming 0xFF onto
+erased flash is a no-op. This tool reads an ELF, Intel HEX or raw binary
+and keeps only real content as (address, length) segments; the gateway
+sends each segment with CBL_MEM_WRITE_CMD at its own address.
+
+Container layout (little endian):
+    "FSG1" | segment_count u32 | content_crc u32
+    segment: addr u32 | len u32 | <len bytes>
+content_crc is the CRC-32 (zlib) of all segment bytes in order.
+
+Usage:
+    fwseg.py build app.elf|app.hex|app.bin app.fsg [--base 0x08008000] [--min-gap 32]
+    fwseg.py info  app.fsg
+    fwseg.py flat  app.fsg app.bin      # back to a flat image (0xFF filled)
+"""
+import argparse
+import struct
+import sys
+import zlib
+
+MAGIC = b"FSG1"
+HEADER = struct.Struct("<4sII")
+SEGMENT = struct.Struct("<II")
+
+APP_BASE = 0x08008000
+MIN_GAP = 32          # shorter 0xFF runs are cheaper to send than a new segment
+FRAME_OVERHEAD = 14   # frame header/CRC + ACK/status per 64-byte chunk
+
+
+def load_elf(raw):
+    """Return {address: bytes} for PT_LOAD segments, placed at their LMA."""
+    if raw[:4] != b"\x7fELF" or raw[4] != 1 or raw[5] != 1:
+        raise ValueError("only 32-bit little endian ELF files are supported")
+    e_phoff, = struct.unpack_from("<I", raw, 28)
+    e_phentsize, e_phnum = struct.unpack_from("<HH", raw, 42)
+    chunks = {}
+    for i in range(e_phnum):
+        p_type, p_offset, _vaddr, p_paddr, p_filesz = struct.unpack_from(
+            "<IIIII", raw, e_phoff + i * e_phentsize)
+        if p_type == 1 and p_filesz:
+            chunks[p_paddr] = raw[p_offset:p_offset + p_filesz]
+    return chunks
+
+
+def load_hex(text):
+    chunks, upper = {}, 0
+    for line in text.splitlines():
+        line = line.strip()
+        if not line.startswith(":"):
+            continue
+        rec = bytes.fromhex(line[1:])
+        if sum(rec) & 0xFF:
+            raise ValueError("bad checksum: " + line)
+        count, addr, rtype = rec[0], (rec[1] << 8) | rec[2], rec[3]
+        data = rec[4:4 + count]
+        if rtype == 0x00:
+            chunks[upper + addr] = data
+        elif rtype == 0x02:
+            upper = ((data[0] << 8) | data[1]) << 4
+        elif rtype == 0x04:
+            upper = ((data[0] << 8) | data[1]) << 16
+        elif rtype == 0x01:
+            break
+    return chunks
+
+
+def load(path, base):
+    raw = open(path, "rb").read()
+    if raw[:4] == b"\x7fELF":
+        return load_elf(raw)
+    if path.lower().endswith((".hex", ".ihex")):
+        return load_hex(raw.decode("ascii"))
+    return {base: raw}
+
+
+def _merge(chunks):
+    """Merge adjacent/overlapping chunks into contiguous (addr, bytearray)."""
+    merged = []
+    for addr in sorted(chunks):
+        data = chunks[addr]
+        if merged and addr <= merged[-1][0] + len(merged[-1][1]):
+            start, buf = merged[-1]
+            off = addr - start
+            buf[off:off + len(data)] = data
+        else:
+            merged.append((addr, bytearray(data)))
+    return merged
+
+
+def segments(chunks, min_gap=MIN_GAP):
+    """Split contiguous data at 0xFF runs of at least min_gap bytes."""
+    out = []
+    for addr, buf in _merge(chunks):
+        i, n = 0, len(buf)
+        while i < n:
+            while i < n and buf[i] == 0xFF:
+                i += 1
+            start = i
+            run = 0
+            while i < n:
+                if buf[i] == 0xFF:
+                    run += 1
+                    if run >= min_gap:
+                        break
+                else:
+                    run = 0
+                i += 1
+            end = i - run if i < n else n
+            while end > start and buf[end - 1] == 0xFF:
+                end -= 1
+            if end > start:
+                # Keep word alignment so the bootloader programs whole words.
+                a0 = (addr + start) & ~3
+                a1 = (addr + end + 3) & ~3
+                lo, hi = max(0, a0 - addr), min(n, a1 - addr)
+                out.append((addr + lo, bytes(buf[lo:hi])))
+    return out
+
+
+def write(path, segs):
+    crc = 0
+    for _, data in segs:
+        crc = zlib.crc32(data, crc)
+    with open(path, "wb") as f:
+        f.write(HEADER.pack(MAGIC, len(segs), crc))
+        for addr, data in segs:
+            f.write(SEGMENT.pack(addr, len(data)))
+            f.write(data)
+
+
+def read(path):
+    raw = open(path, "rb").read()
+    magic, count, crc = HEADER.unpack_from(raw, 0)
+    if magic != MAGIC:
+        raise ValueError("not an FSG1 container")
+    segs, p = [], HEADER.size
+    for _ in range(count):
+        addr, length = SEGMENT.unpack_from(raw, p)
+        p += SEGMENT.size
+        segs.append((addr, raw[p:p + length]))
+        p += length
+    return segs, crc
+
+
+def _chunks_time(nbytes, baud):
+    frames = (nbytes + 63) // 64
+    return (nbytes + frames * FRAME_OVERHEAD) * 10.0 / baud
+
+
+def cmd_build(args):
+    chunks = load(args.input, args.base)
+    segs = segments(chunks, args.min_gap)
+    write(args.output, segs)
+    merged = _merge(chunks)
+    span = merged[-1][0] + len(merged[-1][1]) - merged[0][0] if merged else 0
+    sent = sum(len(d) for _, d in segs)
+    print("%s: %d segments, %d of %d bytes sent (%.1f%%)" %
+          (args.output, len(segs), sent, span, 100.0 * sent / max(1, span)))
+    print("link time @%d: %.2f s flat / %.2f s sparse" %
+          (args.baud, _chunks_time(span, args.baud), _chunks_time(sent, args.baud)))
+
+
+def cmd_info(args):
+    segs, crc = read(args.input)
+    for addr, data in segs:
+        print("0x%08X  %7d bytes" % (addr, len(data)))
+    print("content crc 0x%08X" % crc)
+
+
+def cmd_flat(args):
+    segs, _ = read(args.input)
+    base = segs[0][0]
+    end = max(a + len(d) for a, d in segs)
+    image = bytearray(b"\xFF" * (end - base))
+    for addr, data in segs:
+        image[addr - base:addr - base + len(data)] = data
+    open(args.output, "wb").write(image)
+
+
+def _int(text):
+    return int(text, 0)
+
+
+def main(argv=None):
+    parser = argparse.ArgumentParser(description=__doc__.split("\n")[1])
+    sub = parser.add_subparsers(dest="cmd", required=True)
+    p = sub.add_parser("build")
+    p.add_argument("input"); p.add_argument("output")
+    p.add_argument("--base", type=_int, default=APP_BASE,
+                   help="load address of a raw .bin input")
+    p.add_argument("--min-gap", type=int, default=MIN_GAP)
+    p.add_argument("--baud", type=int, default=115200)
+    p.set_defaults(func=cmd_build)
+    p = sub.add_parser("info")
+    p.add_argument("input")
+    p.set_defaults(func=cmd_info)
+    p = sub.add_parser("flat")
+    p.add_argument("input"); p.add_argument("output")
+    p.set_defaults(func=cmd_flat)
+    args = parser.parse_args(argv)
+    args.func(args)
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,101 @@
+#!/usr/bin/env python3
+"""
+fwsign.py - Sign firmware images for the STM32 FOTA gateway.
+
+The signed value is the SHA-256 of the image file, so the addresses and
+sizes of a container are covered along with its data:
+    raw .bin : the file itself
+    FWZ1     : the whole container, header and record addresses included
+               (tools/fwpack.py)
+    FSG1     : the whole container, segment addresses and lengths included
+               (tools/fwseg.py)
+    FMF1     : the manifest header and component table (tools/fwmanifest.py);
+               the table carries the SHA-256 of every component
+The gateway checks it when the file is downloaded and again on the bytes
+it reads while sending. The payload stream digest it then hands to the
+bootloader only guards the transfer.
+
+The signature is ECDSA P-256 over that digest, DER encoded, published next
+to the image as <image URL>.sig. Requires the 'cryptography' package.
+
+Usage:
+    fwsign.py keygen  signing_key.pem
+    fwsign.py pubkey  signing_key.pem [--header]  # PEM, or fw_public_key.h for the gateway
+    fwsign.py digest  image                    # signed SHA-256 (hex)
+    fwsign.py sign    signing_key.pem image    # writes image.sig
+"""
+import argparse
+import hashlib
+import sys
+
+
+def signed_digest(path):
+    """SHA-256 covered by the signature of this image file."""
+    with open(path, "rb") as f:
+        raw = f.read()
+    if raw[:4] == b"FMF1":
+        raw = raw[:8 + 64 * raw[4]]
+    return hashlib.sha256(raw).digest()
+
+
+def _load_key(path):
+    from cryptography.hazmat.primitives import serialization
+    with open(path, "rb") as f:
+        return serialization.load_pem_private_key(f.read(), password=None)
+
+
+def cmd_keygen(args):
+    from cryptography.hazmat.primitives import serialization
+    from cryptography.hazmat.primitives.asymmetric import ec
+    key = ec.generate_private_key(ec.SECP256R1())
+    with open(args.key, "wb") as f:
+        f.write(key.private_bytes(serialization.Encoding.PEM,
+                                  serialization.PrivateFormat.PKCS8,
+                                  serialization.NoEncryption()))
+
+
+def pem_header(pem):
+    """esp32-code/fw_public_key.h: FW_PUBLIC_KEY as a C string, one line per PEM line."""
+    lines = ['    "%s\\n"' % line for line in pem.splitlines()]
+    return ("// Generated by tools/fwsign.py pubkey --header, do not commit\n"
+            "static const char FW_PUBLIC_KEY[] =\n%s;\n" % "\n".join(lines))
+
+
+def cmd_pubkey(args):
+    from cryptography.hazmat.primitives import serialization
+    pub = _load_key(args.key).public_key()
+    pem = pub.public_bytes(serialization.Encoding.PEM,
+                           serialization.PublicFormat.SubjectPublicKeyInfo).decode()
+    sys.stdout.write(pem_header(pem) if args.header else pem)
+
+
+def cmd_digest(args):
+    print(signed_digest(args.image).hex())
+
+
+def cmd_sign(args):
+    from cryptography.hazmat.primitives import hashes
+    from cryptography.hazmat.primitives.asymmetric import ec, utils
+    digest = signed_digest(args.image)
+    sig = _load_key(args.key).sign(digest, ec.ECDSA(utils.Prehashed(hashes.SHA256())))
+    with open(args.image + ".sig", "wb") as f:
+        f.write(sig)
+    print("%s.sig: %s" % (args.image, digest.hex()))
+
+
+def main(argv=None):
+    parser = argparse.ArgumentParser(description=__doc__.split("\n")[1])
+    sub = parser.add_subparsers(dest="cmd", required=True)
+    p = sub.add_parser("keygen"); p.add_argument("key"); p.set_defaults(func=cmd_keygen)
+    p = sub.add_parser("pubkey"); p.add_argument("key"); p.set_defaults(func=cmd_pubkey)
+    p.add_argument("--header", action="store_true", help="C header for esp32-code/fw_public_key.h")
+    p = sub.add_parser("digest"); p.add_argument("image"); p.set_defaults(func=cmd_digest)
+    p = sub.add_parser("sign")
+    p.add_argument("key"); p.add_argument("image")
+    p.set_defaults(func=cmd_sign)
+    args = parser.parse_args(argv)
+    args.func(args)
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,315 @@
+#!/usr/bin/env python3
+"""
+peercache.py - LAN image cache peer, same protocol as the gateways.
+
+Gateways announce the files they downloaded (image, .sig, patch) on UDP
+broadcast, keyed by the CRC-32 of the URL, and serve them to each other over
+plain HTTP with Range. Before going to the WAN a gateway asks whether a peer
+already has the file or is fetching it, so only the first one on a site
+leaves it. This tool speaks the same protocol from a PC: `seed` pre-loads a
+site from a local file, `fetch` behaves like one gateway, and `fanout` starts
+an origin server plus N fetch processes on the loopback interface and
+reports how many requests reached the origin.
+
+Messages (little endian), UDP port 8071:
+    "FPC1" | type u8 | key u32 (CRC-32 of the URL)
+    WANT    -
+    HAVE    size u32 | http port u16 | sha256[32]
+    FETCH   id u64 : WAN download in progress, the lowest id keeps it
+    FAILED  -      : WAN download abandoned, waiters fetch it themselves
+HTTP, port 8070: GET /<key hex>, optional "Range: bytes=start-[end]".
+
+Usage:
+    peercache.py seed  fw.bin --url https://.../ota0.0.bin [--sig fw.bin.sig]
+    peercache.py fetch https://.../ota0.0.bin out.bin [--linger 60]
+    peercache.py fanout fw.bin [-n 8]
+"""
+import argparse
+import hashlib
+import http.server
+import os
+import random
+import socket
+import struct
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+import urllib.request
+import zlib
+
+MAGIC = b"FPC1"
+WANT, HAVE, FETCH, FAILED = 0, 1, 2, 3
+UDP_PORT = 8071
+HTTP_PORT = 8070
+QUERY_S = 0.3                       # PEER_QUERY_MS
+CLAIM_S = 0.2                       # PEER_CLAIM_MS
+WAIT_S = 120.0                      # PEER_WAIT_MS
+RETRIES = 3                         # PEER_RETRIES
+
+
+def url_key(url):
+    return zlib.crc32(url.encode())
+
+
+def file_sha256(path):
+    h = hashlib.sha256()
+    with open(path, "rb") as f:
+        for block in iter(lambda: f.read(65536), b""):
+            h.update(block)
+    return h.digest(), os.path.getsize(path)
+
+
+class Peer:
+    def __init__(self, bcast="255.255.255.255", udp_port=UDP_PORT, http_port=HTTP_PORT, peer_id=None):
+        self.bcast, self.udp_port = bcast, udp_port
+        self.id = peer_id or random.getrandbits(63) + 1
+        self.files = {}             # key -> (path, size, sha)
+        self.fetching = None
+        self.want = None
+        self.cond = threading.Condition()
+
+        self.sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        self.sock.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+        self.sock.setsockopt(socket.SOL_SOCKET, socket.SO_BROADCAST, 1)
+        self.sock.bind(("", udp_port))
+        threading.Thread(target=self._udp_loop, daemon=True).start()
+
+        peer = self
+
+        class Handler(http.server.BaseHTTPRequestHandler):
+            def do_GET(self):
+                peer._serve(self)
+
+            def log_message(self, *args):
+                pass
+
+        self.httpd = http.server.ThreadingHTTPServer(("", http_port), Handler)
+        self.http_port = self.httpd.server_address[1]
+        threading.Thread(target=self.httpd.serve_forever, daemon=True).start()
+
+    def send(self, kind, key, data=b""):
+        self.sock.sendto(MAGIC + struct.pack("<BI", kind, key) + data, (self.bcast, self.udp_port))
+
+    def announce(self, key):
+        path, size, sha = self.files[key]
+        self.send(HAVE, key, struct.pack("<IH", size, self.http_port) + sha)
+
+    def publish(self, key, path):
+        sha, size = file_sha256(path)
+        with self.cond:
+            self.files[key] = (path, size, sha)
+        self.announce(key)
+
+    def _udp_loop(self):
+        while True:
+            msg, (ip, _) = self.sock.recvfrom(64)
+            if len(msg) < 9 or msg[:4] != MAGIC:
+                continue
+            kind, key = struct.unpack_from("<BI", msg, 4)
+            with self.cond:
+                if kind == WANT:
+                    # Loopback peers share one address: answers go to broadcast
+                    if key in self.files:
+                        self.announce(key)
+                    elif self.fetching == key:
+                        self.send(FETCH, key, struct.pack("<Q", self.id))
+                elif self.want is not None and key == self.want["key"]:
+                    if kind == HAVE and len(msg) == 9 + 38 and "have" not in self.want:
+                        size, port = struct.unpack_from("<IH", msg, 9)
+                        self.want["have"] = (ip, port, size, msg[15:47])
+                    elif kind == FETCH and len(msg) == 9 + 8:
+                        (other,) = struct.unpack_from("<Q", msg, 9)
+                        if other != self.id:
+                            self.want["fetcher"] = min(other, self.want.get("fetcher", other))
+                    elif kind == FAILED:
+                        self.want["failed"] = True
+                    self.cond.notify_all()
+
+    def _serve(self, req):
+        entry = None
+        try:
+            entry = self.files.get(int(req.path.lstrip("/"), 16))
+        except ValueError:
+            pass
+        if entry is None:
+            req.send_error(404)
+            return
+        path, size, _ = entry
+        start, end, rng = 0, size - 1, req.headers.get("Range", "")
+        if rng.startswith("bytes="):
+            a, _, b = rng[6:].partition("-")
+            start, end = int(a), min(int(b), size - 1) if b else size - 1
+            if start >= size:
+                req.send_error(416)
+                return
+            req.send_response(206)
+            req.send_header("Content-Range", "bytes %d-%d/%d" % (start, end, size))
+        else:
+            req.send_response(200)
+        req.send_header("Content-Length", str(end - start + 1))
+        req.end_headers()
+        with open(path, "rb") as f:
+            f.seek(start)
+            req.wfile.write(f.read(end - start + 1))
+
+    def _wait(self, timeout, done):
+        with self.cond:
+            self.cond.wait_for(lambda: done(self.want), timeout)
+
+    def _copy(self, have, key, out):
+        ip, port, size, sha = have
+        url = "http://%s:%d/%x" % (ip, port, key)
+        open(out, "wb").close()
+        for _ in range(RETRIES):
+            got = os.path.getsize(out)
+            if got >= size:
+                break
+            req = urllib.request.Request(url, headers={"Range": "bytes=%d-" % got} if got else {})
+            try:
+                with urllib.request.urlopen(req, timeout=5) as r, open(out, "r+b" if got else "wb") as f:
+                    # 200 to a ranged request: the peer ignored Range, start over
+                    f.seek(got if r.status == 206 else 0)
+                    f.truncate()
+                    while True:
+                        block = r.read(65536)
+                        if not block:
+                            break
+                        f.write(block)
+            except OSError:
+                continue
+        return file_sha256(out) == (sha, size)
+
+    def fetch(self, url, out, origin=None):
+        """Peer first, origin second. Returns "peer" or "origin", raises on failure."""
+        key = url_key(url)
+        with self.cond:
+            self.want = {"key": key}
+        self.send(WANT, key)
+        self._wait(QUERY_S, lambda w: "have" in w)
+
+        with self.cond:
+            claim = "have" not in self.want and "fetcher" not in self.want
+            if claim:
+                self.fetching = key
+        if claim:
+            self.send(FETCH, key, struct.pack("<Q", self.id))
+            self._wait(CLAIM_S, lambda w: "have" in w)
+            with self.cond:
+                claim = "have" not in self.want and self.want.get("fetcher", self.id + 1) > self.id
+                if not claim:
+                    self.fetching = None
+        if not claim:
+            self._wait(WAIT_S, lambda w: "have" in w or "failed" in w)
+        with self.cond:
+            want, self.want = self.want, None
+
+        source = None
+        if not claim and "have" in want and self._copy(want["have"], key, out):
+            source = "peer"
+        else:
+            try:
+                with urllib.request.urlopen(origin or url, timeout=30) as r, open(out, "wb") as f:
+                    f.write(r.read())
+                source = "origin"
+            except OSError:
+                pass
+        with self.cond:
+            self.fetching = None
+        if source is None:
+            if claim:
+                self.send(FAILED, key)
+            raise OSError("download failed: %s" % url)
+        self.publish(key, out)
+        return source
+
+
+def cmd_seed(args):
+    peer = Peer(args.bcast, args.udp_port, args.http_port)
+    peer.publish(url_key(args.url), args.file)
+    if args.sig:
+        peer.publish(url_key(args.url + ".sig"), args.sig)
+    print("seeding %s as %08x on port %d" % (args.file, url_key(args.url), peer.http_port))
+    while True:
+        time.sleep(1)
+
+
+def cmd_fetch(args):
+    peer = Peer(args.bcast, args.udp_port, args.http_port, args.id)
+    start = time.monotonic()
+    try:
+        source = peer.fetch(args.url, args.out)
+    except OSError as e:
+        sys.exit(str(e))
+    print("%s from %s in %.2f s" % (args.out, source, time.monotonic() - start), flush=True)
+    time.sleep(args.linger)
+
+
+def cmd_fanout(args):
+    hits = []
+
+    class Origin(http.server.BaseHTTPRequestHandler):
+        def do_GET(self):
+            hits.append(self.path)
+            data = open(args.file, "rb").read()
+            self.send_response(200)
+            self.send_header("Content-Length", str(len(data)))
+            self.end_headers()
+            self.wfile.write(data)
+
+        def log_message(self, *a):
+            pass
+
+    origin = http.server.ThreadingHTTPServer(("127.0.0.1", 0), Origin)
+    threading.Thread(target=origin.serve_forever, daemon=True).start()
+    url = "http://127.0.0.1:%d/fw.bin" % origin.server_address[1]
+    expected = file_sha256(args.file)
+    udp_port = random.randint(20000, 40000)
+    base = udp_port + 1
+
+    with tempfile.TemporaryDirectory() as tmp:
+        outs = [os.path.join(tmp, "gw%d.bin" % i) for i in range(args.n)]
+        procs = [subprocess.Popen([sys.executable, __file__, "fetch", url, out,
+                                   "--bcast", "127.255.255.255", "--udp-port", str(udp_port),
+                                   "--http-port", str(base + i), "--id", str(i + 1),
+                                   "--linger", "2"])
+                 for i, out in enumerate(outs)]
+        failed = sum(p.wait() != 0 for p in procs)
+        good = sum(os.path.exists(o) and file_sha256(o) == expected for o in outs)
+    print("%d gateways, %d origin requests, %d copies verified, %d failed" %
+          (args.n, len(hits), good, failed))
+    return 0 if len(hits) == 1 and good == args.n else 1
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__.split("\n\n")[0])
+    sub = ap.add_subparsers(dest="cmd", required=True)
+    common = argparse.ArgumentParser(add_help=False)
+    common.add_argument("--bcast", default="255.255.255.255", help="broadcast address")
+    common.add_argument("--udp-port", type=int, default=UDP_PORT)
+    common.add_argument("--http-port", type=int, default=HTTP_PORT)
+    p = sub.add_parser("seed", parents=[common], help="serve a local image to the site")
+    p.add_argument("file")
+    p.add_argument("--url", required=True, help="URL the gateways will be told to fetch")
+    p.add_argument("--sig", help="signature file served as <url>.sig")
+    p = sub.add_parser("fetch", parents=[common], help="fetch like a gateway")
+    p.add_argument("url")
+    p.add_argument("out")
+    p.add_argument("--id", type=int, help="claim id (gateways use their MAC)")
+    p.add_argument("--linger", type=float, default=0, help="keep serving for this many seconds")
+    p = sub.add_parser("fanout", help="N local fetchers against one origin")
+    p.add_argument("file")
+    p.add_argument("-n", type=int, default=8)
+    a = ap.parse_args()
+
+    if a.cmd == "seed":
+        cmd_seed(a)
+    elif a.cmd == "fetch":
+        cmd_fetch(a)
+    else:
+        sys.exit(cmd_fanout(a))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,270 @@
+#!/usr/bin/env python3
+"""
+uarttrace.py - Inspect and replay gateway <-> bootloader UART traces.
+
+The gateway records every update session to /uart.trace when tracing is on
+(MQTT "trace on", fetch it with "trace upload <url>"). Frames are decoded
+with fotaproto.py.
+
+Trace layout (little endian):
+    "FTR1" | baud u32
+    record : dt varint (us since previous record) | type u8 | len varint | bytes
+    type   : 0 gateway -> target, 1 target -> gateway, 2 target reset (len 0)
+
+Replay sends the recorded gateway bytes to a serial port (needs pyserial) or
+to a TCP endpoint such as blsim.py (bootloader simulator; a reset record
+reconnects, which reboots it), and compares what comes back with the recorded answers. --speed scales the recorded gaps (2 = twice
+as fast); --speed 0 sends each burst as soon as the previous answer is in.
+
+Usage:
+    uarttrace.py dump   session.trace
+    uarttrace.py stats  session.trace
+    uarttrace.py replay session.trace --port /dev/ttyUSB0 [--speed 1] [--reset-dtr]
+    uarttrace.py replay session.trace --tcp localhost:5555 --speed 0   # blsim.py running
+"""
+import argparse
+import socket
+import struct
+import sys
+import time
+
+import fotaproto
+
+MAGIC = b"FTR1"
+TX, RX, RESET = 0, 1, 2
+TYPE_NAMES = {TX: "TX", RX: "RX", RESET: "RESET"}
+
+
+def _varint(data, pos):
+    value = shift = 0
+    while True:
+        b = data[pos]
+        pos += 1
+        value |= (b & 0x7F) << shift
+        shift += 7
+        if not b & 0x80:
+            return value, pos
+
+
+def load(path):
+    """Return (baud, [(t_us, type, bytes)]) with absolute times."""
+    data = open(path, "rb").read()
+    if data[:4] != MAGIC:
+        raise SystemExit("%s: not an FTR1 trace" % path)
+    (baud,) = struct.unpack_from("<I", data, 4)
+    pos, t, records = 8, 0, []
+    while pos < len(data):
+        dt, pos = _varint(data, pos)
+        kind = data[pos]
+        n, pos = _varint(data, pos + 1)
+        t += dt
+        records.append((t, kind, data[pos:pos + n]))
+        pos += n
+    return baud, records
+
+
+def split_frames(stream):
+    """Cut the gateway byte stream into knock bytes and length-prefixed frames."""
+    pos = 0
+    while pos < len(stream):
+        n = stream[pos]
+        if n >= fotaproto.MAX_FRAME or pos + n + 1 > len(stream):
+            yield stream[pos:pos + 1]
+            pos += 1
+        else:
+            yield stream[pos:pos + n + 1]
+            pos += n + 1
+
+
+def describe_tx(chunk):
+    out = []
+    for frame in split_frames(chunk):
+        if len(frame) == 1:
+            out.append("knock" if frame[0] == fotaproto.KNOCK else "byte 0x%02X" % frame[0])
+            continue
+        try:
+            cmd, addr, count, data = fotaproto.decode(frame)
+            out.append("%s addr=0x%08X count=%d" % (fotaproto.command_name(cmd), addr, count))
+        except ValueError as e:
+            out.append("bad frame (%s)" % e)
+    return ", ".join(out)
+
+
+def describe_rx(chunk):
+    if chunk[:1] == bytes([fotaproto.NACK]):
+        return "NACK"
+    if chunk[:1] == bytes([fotaproto.ACK]) and len(chunk) >= 2:
+        return "ACK %s" % chunk[2:2 + chunk[1]].hex()
+    return chunk.hex()
+
+
+def cmd_dump(args):
+    baud, records = load(args.trace)
+    print("baud %d, %d records" % (baud, len(records)))
+    for t, kind, data in records:
+        if kind == TX:
+            text = describe_tx(data)
+        elif kind == RX:
+            text = describe_rx(data)
+        else:
+            text = ""
+        print("%10.3f ms %-5s %s" % (t / 1000.0, TYPE_NAMES.get(kind, kind), text))
+
+
+def cmd_stats(args):
+    baud, records = load(args.trace)
+    tx = sum(len(d) for _, k, d in records if k == TX)
+    rx = sum(len(d) for _, k, d in records if k == RX)
+    written, seen, resent, nacks = 0, set(), 0, 0
+    counts, waits, last_tx = {}, [], None
+    for t, kind, data in records:
+        if kind == TX:
+            last_tx = t
+            for frame in split_frames(data):
+                if len(frame) == 1:
+                    continue
+                try:
+                    cmd, addr, count, payload = fotaproto.decode(frame)
+                except ValueError:
+                    continue
+                name = fotaproto.command_name(cmd)
+                counts[name] = counts.get(name, 0) + 1
+                if cmd in (fotaproto.BY_NAME["MEM_WRITE"], fotaproto.BY_NAME["MEM_WRITE_LZ"]):
+                    if addr in seen:
+                        resent += 1
+                    else:
+                        seen.add(addr)
+                        written += count
+        elif kind == RX:
+            if data[:1] == bytes([fotaproto.NACK]):
+                nacks += 1
+            if last_tx is not None:
+                waits.append(t - last_tx)
+                last_tx = None
+    duration = records[-1][0] - records[0][0] if records else 0
+    wire = (tx + rx) * 10 * 1e6 / baud
+    print("duration        %.1f ms" % (duration / 1000.0))
+    print("bytes           %d sent, %d received (%.1f ms on the wire at %d baud)" %
+          (tx, rx, wire / 1000.0, baud))
+    print("payload         %d bytes, %.0f B/s" % (written, written * 1e6 / duration if duration else 0))
+    print("retransmitted   %d frames, %d NACK" % (resent, nacks))
+    if waits:
+        waits.sort()
+        print("reply latency   median %.2f ms, p95 %.2f ms, max %.2f ms" %
+              (waits[len(waits) // 2] / 1000.0, waits[int(len(waits) * 0.95)] / 1000.0,
+               waits[-1] / 1000.0))
+    for name, n in sorted(counts.items()):
+        print("  %-14s %d" % (name, n))
+
+
+class TcpLink:
+    def __init__(self, target):
+        host, port = target.rsplit(":", 1)
+        self.address = (host, int(port))
+        self.connect()
+
+    def connect(self):
+        self.sock = socket.create_connection(self.address)
+        self.sock.settimeout(0.001)
+
+    def write(self, data):
+        self.sock.sendall(data)
+
+    def read(self):
+        try:
+            return self.sock.recv(4096)
+        except socket.timeout:
+            return b""
+
+    def reset(self):
+        # blsim.py: a new connection is a power-on
+        self.sock.close()
+        self.connect()
+
+
+class SerialLink:
+    def __init__(self, port, baud, reset_dtr):
+        try:
+            import serial
+        except ImportError:
+            raise SystemExit("replay on a serial port needs pyserial")
+        self.port = serial.Serial(port, baud, timeout=0)
+        self.reset_dtr = reset_dtr
+
+    def write(self, data):
+        self.port.write(data)
+
+    def read(self):
+        return self.port.read(4096)
+
+    def reset(self):
+        if self.reset_dtr:
+            self.port.dtr = True
+            time.sleep(0.15)
+            self.port.dtr = False
+
+
+def cmd_replay(args):
+    baud, records = load(args.trace)
+    link = TcpLink(args.tcp) if args.tcp else SerialLink(args.port, baud, args.reset_dtr)
+    got, expected, mismatches = bytearray(), bytearray(), 0
+    start = time.monotonic()
+    t0 = records[0][0] if records else 0
+
+    def drain(until):
+        while time.monotonic() < until:
+            got.extend(link.read())
+
+    for t, kind, data in records:
+        if kind == RX:
+            expected.extend(data)
+            continue
+        if args.speed > 0:
+            drain(start + (t - t0) / 1e6 / args.speed)
+        else:
+            # Closed loop: wait for the answers recorded so far (2 s max)
+            deadline = time.monotonic() + 2.0
+            while len(got) < len(expected) and time.monotonic() < deadline:
+                got.extend(link.read())
+        if kind == RESET:
+            link.reset()
+        else:
+            link.write(data)
+    drain(time.monotonic() + 0.5)
+    elapsed = time.monotonic() - start
+
+    for a, b in zip(got, expected):
+        mismatches += a != b
+    mismatches += abs(len(got) - len(expected))
+    original = (records[-1][0] - t0) / 1e6 if records else 0
+    print("replayed %d records in %.3f s (original %.3f s)" % (len(records), elapsed, original))
+    print("answers  %d bytes received, %d expected, %d differ" % (len(got), len(expected), mismatches))
+    return 1 if mismatches else 0
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__.split("\n\n")[0])
+    sub = ap.add_subparsers(dest="cmd", required=True)
+    for name in ("dump", "stats"):
+        p = sub.add_parser(name)
+        p.add_argument("trace")
+    p = sub.add_parser("replay")
+    p.add_argument("trace")
+    target = p.add_mutually_exclusive_group(required=True)
+    target.add_argument("--port", help="serial port wired to the target")
+    target.add_argument("--tcp", help="host:port of a bootloader simulator (blsim.py)")
+    p.add_argument("--speed", type=float, default=1.0,
+                   help="time scale (1 = recorded timing, 0 = as fast as answers allow)")
+    p.add_argument("--reset-dtr", action="store_true", help="pulse DTR on reset records")
+    a = ap.parse_args()
+
+    if a.cmd == "dump":
+        cmd_dump(a)
+    elif a.cmd == "stats":
+        cmd_stats(a)
+    else:
+        sys.exit(cmd_replay(a))
+
+
+if __name__ == "__main__":
+    main()